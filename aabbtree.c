@@ -0,0 +1,495 @@
+#include <math.h>
+#include <string.h>
+#include "aabbtree.h"
+#include "alloc.h"
+#include "utils.h"
+
+#define AABB_INITIAL_CAPACITY 64
+#define AABB_STACK_SIZE 256
+
+static float box_area(vec3 min, vec3 max)
+{
+    vec3 d;
+    glm_vec3_sub(max, min, d);
+    return 2.0f * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+}
+
+static float union_area(AABBNode* a, AABBNode* b)
+{
+    vec3 min;
+    vec3 max;
+    glm_vec3_minv(a->min, b->min, min);
+    glm_vec3_maxv(a->max, b->max, max);
+    return box_area(min, max);
+}
+
+static bool box_contains(vec3 outer_min, vec3 outer_max, vec3 min, vec3 max)
+{
+    return outer_min[0] <= min[0] && outer_min[1] <= min[1] &&
+        outer_min[2] <= min[2] && max[0] <= outer_max[0] &&
+        max[1] <= outer_max[1] && max[2] <= outer_max[2];
+}
+
+static bool boxes_overlap(vec3 min_a, vec3 max_a, vec3 min_b, vec3 max_b)
+{
+    return min_a[0] <= max_b[0] && min_b[0] <= max_a[0] &&
+        min_a[1] <= max_b[1] && min_b[1] <= max_a[1] &&
+        min_a[2] <= max_b[2] && min_b[2] <= max_a[2];
+}
+
+static void refit(AABBTree* tree, uint32_t index)
+{
+    AABBNode* node = &tree->nodes[index];
+    AABBNode* left = &tree->nodes[node->left];
+    AABBNode* right = &tree->nodes[node->right];
+    glm_vec3_minv(left->min, right->min, node->min);
+    glm_vec3_maxv(left->max, right->max, node->max);
+    node->height = 1 + MAX(left->height, right->height);
+}
+
+static void link_free_nodes(AABBTree* tree, uint32_t first)
+{
+    for (uint32_t i=first; i < tree->capacity; i++) {
+        tree->nodes[i].next = i + 1;
+        tree->nodes[i].height = -1;
+    }
+    tree->nodes[tree->capacity - 1].next = AABB_NULL;
+    tree->free_list = first;
+}
+
+static uint32_t alloc_node(AABBTree* tree)
+{
+    if (tree->free_list == AABB_NULL) {
+        uint32_t old_capacity = tree->capacity;
+        AABBNode* nodes = malloc_nofail(sizeof(AABBNode) * old_capacity * 2);
+        memcpy(nodes, tree->nodes, sizeof(AABBNode) * old_capacity);
+        mem_free(tree->nodes);
+        tree->nodes = nodes;
+        tree->capacity = old_capacity * 2;
+        link_free_nodes(tree, old_capacity);
+    }
+
+    uint32_t index = tree->free_list;
+    AABBNode* node = &tree->nodes[index];
+    tree->free_list = node->next;
+    node->parent = AABB_NULL;
+    node->left = AABB_NULL;
+    node->right = AABB_NULL;
+    node->height = 0;
+    node->key = 0;
+    tree->count++;
+    return index;
+}
+
+static void free_node(AABBTree* tree, uint32_t index)
+{
+    tree->nodes[index].next = tree->free_list;
+    tree->nodes[index].height = -1;
+    tree->free_list = index;
+    tree->count--;
+}
+
+void aabbtree_init(AABBTree* tree, uint32_t key_count)
+{
+    tree->capacity = AABB_INITIAL_CAPACITY;
+    tree->nodes = malloc_nofail(sizeof(AABBNode) * tree->capacity);
+    tree->count = 0;
+    tree->root = AABB_NULL;
+    link_free_nodes(tree, 0);
+
+    tree->key_count = key_count;
+    tree->leaf_of_key = malloc_nofail(sizeof(uint32_t) * key_count);
+    for (uint32_t k=0; k < key_count; k++) tree->leaf_of_key[k] = AABB_NULL;
+}
+
+void aabbtree_destroy(AABBTree* tree)
+{
+    mem_free(tree->nodes);
+    mem_free(tree->leaf_of_key);
+}
+
+// Rotates the taller grandchild subtree up if the node is unbalanced and
+// returns the index of the subtree's new root
+static uint32_t balance(AABBTree* tree, uint32_t ia)
+{
+    AABBNode* a = &tree->nodes[ia];
+    if (a->height < 2) return ia;
+
+    uint32_t ib = a->left;
+    uint32_t ic = a->right;
+    AABBNode* b = &tree->nodes[ib];
+    AABBNode* c = &tree->nodes[ic];
+    int32_t diff = c->height - b->height;
+
+    // Swap c (or b) with a, then move the shorter of its children under a
+    if (diff > 1 || diff < -1) {
+        uint32_t iup = diff > 1 ? ic : ib;
+        uint32_t ikeep = diff > 1 ? ib : ic;
+        AABBNode* up = &tree->nodes[iup];
+        uint32_t i0 = up->left;
+        uint32_t i1 = up->right;
+        uint32_t itall = tree->nodes[i0].height > tree->nodes[i1].height ?
+            i0 : i1;
+        uint32_t ishort = itall == i0 ? i1 : i0;
+
+        up->left = ia;
+        up->parent = a->parent;
+        a->parent = iup;
+        if (up->parent != AABB_NULL) {
+            AABBNode* parent = &tree->nodes[up->parent];
+            if (parent->left == ia) parent->left = iup;
+            else parent->right = iup;
+        } else {
+            tree->root = iup;
+        }
+
+        up->right = itall;
+        if (diff > 1) {
+            a->left = ikeep;
+            a->right = ishort;
+        } else {
+            a->left = ishort;
+            a->right = ikeep;
+        }
+        tree->nodes[ishort].parent = ia;
+        refit(tree, ia);
+        refit(tree, iup);
+        return iup;
+    }
+    return ia;
+}
+
+static void fix_upwards(AABBTree* tree, uint32_t index)
+{
+    while (index != AABB_NULL) {
+        index = balance(tree, index);
+        refit(tree, index);
+        index = tree->nodes[index].parent;
+    }
+}
+
+// Finds the sibling with the lowest surface area increase
+static void insert_leaf(AABBTree* tree, uint32_t leaf)
+{
+    if (tree->root == AABB_NULL) {
+        tree->root = leaf;
+        tree->nodes[leaf].parent = AABB_NULL;
+        return;
+    }
+
+    AABBNode* leaf_node = &tree->nodes[leaf];
+    uint32_t index = tree->root;
+    while (tree->nodes[index].height > 0) {
+        AABBNode* node = &tree->nodes[index];
+        float area = box_area(node->min, node->max);
+        float combined = union_area(node, leaf_node);
+        // Cost of making a new parent for this node and the leaf
+        float cost = 2.0f * combined;
+        // Minimum cost of pushing the leaf further down
+        float inheritance = 2.0f * (combined - area);
+
+        float child_costs[2];
+        uint32_t children[2] = {node->left, node->right};
+        for (int c=0; c < 2; c++) {
+            AABBNode* child = &tree->nodes[children[c]];
+            child_costs[c] = union_area(child, leaf_node) + inheritance;
+            if (child->height > 0)
+                child_costs[c] -= box_area(child->min, child->max);
+        }
+
+        if (cost < child_costs[0] && cost < child_costs[1]) break;
+        index = child_costs[0] < child_costs[1] ? children[0] : children[1];
+    }
+
+    uint32_t sibling = index;
+    uint32_t old_parent = tree->nodes[sibling].parent;
+    uint32_t new_parent = alloc_node(tree);
+    tree->nodes[new_parent].parent = old_parent;
+    tree->nodes[new_parent].left = sibling;
+    tree->nodes[new_parent].right = leaf;
+    tree->nodes[sibling].parent = new_parent;
+    tree->nodes[leaf].parent = new_parent;
+    refit(tree, new_parent);
+
+    if (old_parent != AABB_NULL) {
+        if (tree->nodes[old_parent].left == sibling)
+            tree->nodes[old_parent].left = new_parent;
+        else
+            tree->nodes[old_parent].right = new_parent;
+    } else {
+        tree->root = new_parent;
+    }
+
+    fix_upwards(tree, old_parent);
+}
+
+static void remove_leaf(AABBTree* tree, uint32_t leaf)
+{
+    if (leaf == tree->root) {
+        tree->root = AABB_NULL;
+        return;
+    }
+
+    uint32_t parent = tree->nodes[leaf].parent;
+    uint32_t grandparent = tree->nodes[parent].parent;
+    uint32_t sibling = tree->nodes[parent].left == leaf ?
+        tree->nodes[parent].right : tree->nodes[parent].left;
+
+    tree->nodes[sibling].parent = grandparent;
+    if (grandparent != AABB_NULL) {
+        if (tree->nodes[grandparent].left == parent)
+            tree->nodes[grandparent].left = sibling;
+        else
+            tree->nodes[grandparent].right = sibling;
+    } else {
+        tree->root = sibling;
+    }
+    free_node(tree, parent);
+    fix_upwards(tree, grandparent);
+}
+
+static void set_fat_box(AABBNode* node, vec3 min, vec3 max)
+{
+    vec3 margin = {AABB_FAT_MARGIN, AABB_FAT_MARGIN, AABB_FAT_MARGIN};
+    glm_vec3_sub(min, margin, node->min);
+    glm_vec3_add(max, margin, node->max);
+}
+
+bool aabbtree_contains(AABBTree* tree, uint32_t key)
+{
+    DBASSERT(key < tree->key_count);
+    return tree->leaf_of_key[key] != AABB_NULL;
+}
+
+void aabbtree_insert(AABBTree* tree, uint32_t key, vec3 min, vec3 max)
+{
+    DBASSERT(key < tree->key_count);
+    DBASSERT(tree->leaf_of_key[key] == AABB_NULL);
+    uint32_t leaf = alloc_node(tree);
+    tree->nodes[leaf].key = key;
+    set_fat_box(&tree->nodes[leaf], min, max);
+    tree->leaf_of_key[key] = leaf;
+    insert_leaf(tree, leaf);
+}
+
+void aabbtree_remove(AABBTree* tree, uint32_t key)
+{
+    DBASSERT(key < tree->key_count);
+    uint32_t leaf = tree->leaf_of_key[key];
+    DBASSERT(leaf != AABB_NULL);
+    remove_leaf(tree, leaf);
+    free_node(tree, leaf);
+    tree->leaf_of_key[key] = AABB_NULL;
+}
+
+// Returns true if the new bounds escaped the fat box and the leaf was
+// reinserted
+bool aabbtree_move(AABBTree* tree, uint32_t key, vec3 min, vec3 max)
+{
+    DBASSERT(key < tree->key_count);
+    uint32_t leaf = tree->leaf_of_key[key];
+    DBASSERT(leaf != AABB_NULL);
+    AABBNode* node = &tree->nodes[leaf];
+    if (box_contains(node->min, node->max, min, max)) return false;
+
+    remove_leaf(tree, leaf);
+    set_fat_box(&tree->nodes[leaf], min, max);
+    insert_leaf(tree, leaf);
+    return true;
+}
+
+void aabbtree_query_box(AABBTree* tree, vec3 min, vec3 max,
+        AABBQueryFn fn, void* user)
+{
+    if (tree->root == AABB_NULL) return;
+    uint32_t stack[AABB_STACK_SIZE];
+    uint32_t top = 0;
+    stack[top++] = tree->root;
+    while (top) {
+        AABBNode* node = &tree->nodes[stack[--top]];
+        if (!boxes_overlap(node->min, node->max, min, max)) continue;
+        if (node->height == 0) {
+            fn(node->key, user);
+        } else {
+            DBASSERT(top + 2 <= AABB_STACK_SIZE);
+            stack[top++] = node->left;
+            stack[top++] = node->right;
+        }
+    }
+}
+
+float aabb_ray_entry(vec3 min, vec3 max, vec3 origin, vec3 inv_dir,
+        float max_t)
+{
+    float t_near = 0.0f;
+    float t_far = max_t;
+    for (int i=0; i < 3; i++) {
+        // Parallel to the slabs, where 0 * inf would give NaN
+        if (isinf(inv_dir[i])) {
+            if (origin[i] < min[i] || origin[i] > max[i]) return -1.0f;
+            continue;
+        }
+        float t0 = (min[i] - origin[i]) * inv_dir[i];
+        float t1 = (max[i] - origin[i]) * inv_dir[i];
+        if (t0 > t1) {
+            float tmp = t0;
+            t0 = t1;
+            t1 = tmp;
+        }
+        t_near = MAX(t_near, t0);
+        t_far = MIN(t_far, t1);
+        if (t_near > t_far) return -1.0f;
+    }
+    return t_near;
+}
+
+void aabbtree_query_ray(AABBTree* tree, vec3 origin, vec3 dir, float* max_t,
+        AABBQueryFn fn, void* user)
+{
+    if (tree->root == AABB_NULL) return;
+    vec3 inv_dir = {1.0f / dir[0], 1.0f / dir[1], 1.0f / dir[2]};
+    uint32_t stack[AABB_STACK_SIZE];
+    float entries[AABB_STACK_SIZE];
+    uint32_t top = 0;
+    float entry = aabb_ray_entry(tree->nodes[tree->root].min,
+            tree->nodes[tree->root].max, origin, inv_dir, *max_t);
+    if (entry < 0.0f) return;
+    stack[top] = tree->root;
+    entries[top++] = entry;
+    while (top) {
+        top--;
+        // Hits found since the push may have moved past this box
+        if (entries[top] > *max_t) continue;
+        AABBNode* node = &tree->nodes[stack[top]];
+        if (node->height == 0) {
+            fn(node->key, user);
+            continue;
+        }
+        uint32_t near = node->left;
+        uint32_t far = node->right;
+        float near_t = aabb_ray_entry(tree->nodes[near].min,
+                tree->nodes[near].max, origin, inv_dir, *max_t);
+        float far_t = aabb_ray_entry(tree->nodes[far].min,
+                tree->nodes[far].max, origin, inv_dir, *max_t);
+        if (far_t >= 0.0f && (near_t < 0.0f || far_t < near_t)) {
+            uint32_t t = near;
+            near = far;
+            far = t;
+            float tmp = near_t;
+            near_t = far_t;
+            far_t = tmp;
+        }
+        // The nearer child goes on top
+        DBASSERT(top + 2 <= AABB_STACK_SIZE);
+        if (far_t >= 0.0f) {
+            stack[top] = far;
+            entries[top++] = far_t;
+        }
+        if (near_t >= 0.0f) {
+            stack[top] = near;
+            entries[top++] = near_t;
+        }
+    }
+}
+
+void aabbtree_query_sphere(AABBTree* tree, vec3 center, float radius,
+        AABBQueryFn fn, void* user)
+{
+    if (tree->root == AABB_NULL) return;
+    float radius2 = radius * radius;
+    uint32_t stack[AABB_STACK_SIZE];
+    uint32_t top = 0;
+    stack[top++] = tree->root;
+    while (top) {
+        AABBNode* node = &tree->nodes[stack[--top]];
+        vec3 closest;
+        glm_vec3_maxv(center, node->min, closest);
+        glm_vec3_minv(closest, node->max, closest);
+        if (glm_vec3_distance2(closest, center) > radius2) continue;
+        if (node->height == 0) {
+            fn(node->key, user);
+        } else {
+            DBASSERT(top + 2 <= AABB_STACK_SIZE);
+            stack[top++] = node->left;
+            stack[top++] = node->right;
+        }
+    }
+}
+
+// Subtrees fully inside a plane stop testing against it. Once inside all
+// planes, every leaf below is reported without further tests.
+void aabbtree_query_frustum(AABBTree* tree, vec4 planes[6],
+        AABBQueryFn fn, void* user)
+{
+    if (tree->root == AABB_NULL) return;
+    uint32_t stack[AABB_STACK_SIZE];
+    uint8_t masks[AABB_STACK_SIZE];
+    uint32_t top = 0;
+    stack[top] = tree->root;
+    masks[top++] = 0x3f;
+    while (top) {
+        top--;
+        AABBNode* node = &tree->nodes[stack[top]];
+        uint8_t mask = masks[top];
+
+        bool outside = false;
+        for (int p=0; p < 6 && mask; p++) {
+            if (!(mask & (1 << p))) continue;
+            float* plane = planes[p];
+            // Box corners furthest along and against the plane normal
+            float dist_max = plane[3];
+            float dist_min = plane[3];
+            for (int i=0; i < 3; i++) {
+                if (plane[i] > 0.0f) {
+                    dist_max += plane[i] * node->max[i];
+                    dist_min += plane[i] * node->min[i];
+                } else {
+                    dist_max += plane[i] * node->min[i];
+                    dist_min += plane[i] * node->max[i];
+                }
+            }
+            if (dist_max < 0.0f) {
+                outside = true;
+                break;
+            }
+            if (dist_min >= 0.0f) mask &= ~(1 << p);
+        }
+        if (outside) continue;
+
+        if (node->height == 0) {
+            fn(node->key, user);
+        } else {
+            DBASSERT(top + 2 <= AABB_STACK_SIZE);
+            stack[top] = node->left;
+            masks[top++] = mask;
+            stack[top] = node->right;
+            masks[top++] = mask;
+        }
+    }
+}
+
+// Reports every pair of leaves with overlapping fat boxes once
+void aabbtree_pairs(AABBTree* tree, AABBPairFn fn, void* user)
+{
+    uint32_t stack[AABB_STACK_SIZE];
+    for (uint32_t leaf=0; leaf < tree->capacity; leaf++) {
+        AABBNode* query = &tree->nodes[leaf];
+        if (query->height != 0) continue;
+
+        uint32_t top = 0;
+        stack[top++] = tree->root;
+        while (top) {
+            uint32_t index = stack[--top];
+            AABBNode* node = &tree->nodes[index];
+            if (!boxes_overlap(node->min, node->max, query->min, query->max))
+                continue;
+            if (node->height == 0) {
+                if (index > leaf) fn(query->key, node->key, user);
+            } else {
+                DBASSERT(top + 2 <= AABB_STACK_SIZE);
+                stack[top++] = node->left;
+                stack[top++] = node->right;
+            }
+        }
+    }
+}
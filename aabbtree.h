@@ -0,0 +1,64 @@
+#ifndef AABBTREE_H
+#define AABBTREE_H
+
+#include <cglm/cglm.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define AABB_NULL UINT32_MAX
+// Leaves are enlarged by this much so small moves don't touch the tree
+#define AABB_FAT_MARGIN 0.1f
+
+typedef struct AABBNode {
+    vec3 min;
+    vec3 max;
+    uint32_t parent;
+    uint32_t left;
+    uint32_t right;
+    uint32_t next; // Free list link
+    int32_t height; // 0 for leaves, -1 for free nodes
+    uint32_t key;
+} AABBNode;
+
+// Dynamic bounding volume tree. Leaves are keyed by a small integer, e.g.
+// a Node id, and store fattened bounds.
+typedef struct AABBTree {
+    AABBNode* nodes;
+    uint32_t capacity;
+    uint32_t count;
+    uint32_t root;
+    uint32_t free_list;
+    uint32_t* leaf_of_key;
+    uint32_t key_count;
+} AABBTree;
+
+// Slab test of a ray within [0, max_t], inv_dir is 1 / dir per axis.
+// Returns the entry distance or a negative value on a miss.
+float aabb_ray_entry(vec3 min, vec3 max, vec3 origin, vec3 inv_dir,
+        float max_t);
+
+typedef void (*AABBQueryFn)(uint32_t key, void* user);
+typedef void (*AABBPairFn)(uint32_t key_a, uint32_t key_b, void* user);
+
+void aabbtree_init(AABBTree* tree, uint32_t key_count);
+void aabbtree_destroy(AABBTree* tree);
+
+bool aabbtree_contains(AABBTree* tree, uint32_t key);
+void aabbtree_insert(AABBTree* tree, uint32_t key, vec3 min, vec3 max);
+void aabbtree_remove(AABBTree* tree, uint32_t key);
+bool aabbtree_move(AABBTree* tree, uint32_t key, vec3 min, vec3 max);
+
+void aabbtree_query_box(AABBTree* tree, vec3 min, vec3 max,
+        AABBQueryFn fn, void* user);
+// Visits the leaves the ray enters before *max_t, closest boxes first.
+// fn may shorten *max_t to prune the rest.
+void aabbtree_query_ray(AABBTree* tree, vec3 origin, vec3 dir, float* max_t,
+        AABBQueryFn fn, void* user);
+void aabbtree_query_sphere(AABBTree* tree, vec3 center, float radius,
+        AABBQueryFn fn, void* user);
+// Planes as produced by glm_frustum_planes, pointing inwards
+void aabbtree_query_frustum(AABBTree* tree, vec4 planes[6],
+        AABBQueryFn fn, void* user);
+void aabbtree_pairs(AABBTree* tree, AABBPairFn fn, void* user);
+
+#endif
@@ -0,0 +1,269 @@
+#include <float.h>
+#include <stdbool.h>
+#include <string.h>
+#include "cgltf.h"
+#include "accessor.h"
+#include "utils.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Elements gathered and converted at a time
+#define UNPACK_CHUNK 256
+#define MAX_COMPONENTS 4
+
+static const uint8_t* view_data(const cgltf_buffer_view* view)
+{
+    if (view->data) return (const uint8_t*) view->data;
+    if (!view->buffer->data) return NULL;
+    return (const uint8_t*) view->buffer->data + view->offset;
+}
+
+static size_t component_size(cgltf_component_type type)
+{
+    switch (type) {
+        case cgltf_component_type_r_8:
+        case cgltf_component_type_r_8u: return 1;
+        case cgltf_component_type_r_16:
+        case cgltf_component_type_r_16u: return 2;
+        case cgltf_component_type_r_32u:
+        case cgltf_component_type_r_32f: return 4;
+        default:
+            fatal("Unsupported accessor component type.");
+            return 0;
+    }
+}
+
+static uint32_t read_index(const uint8_t* src, cgltf_component_type type,
+        size_t i)
+{
+    switch (type) {
+        case cgltf_component_type_r_8u: return src[i];
+        case cgltf_component_type_r_16u: {
+            uint16_t index;
+            memcpy(&index, src + i * 2, sizeof(index));
+            return index;
+        }
+        case cgltf_component_type_r_32u: {
+            uint32_t index;
+            memcpy(&index, src + i * 4, sizeof(index));
+            return index;
+        }
+        default:
+            fatal("Unsupported index component type.");
+            return 0;
+    }
+}
+
+static float component_scale(cgltf_component_type type, bool normalized)
+{
+    if (!normalized) return 1.0f;
+    switch (type) {
+        case cgltf_component_type_r_8: return 1.0f / 127.0f;
+        case cgltf_component_type_r_8u: return 1.0f / 255.0f;
+        case cgltf_component_type_r_16: return 1.0f / 32767.0f;
+        case cgltf_component_type_r_16u: return 1.0f / 65535.0f;
+        default: return 1.0f;
+    }
+}
+
+static float read_component(const uint8_t* src, cgltf_component_type type,
+        size_t i)
+{
+    switch (type) {
+        case cgltf_component_type_r_8: return ((const int8_t*) src)[i];
+        case cgltf_component_type_r_8u: return src[i];
+        case cgltf_component_type_r_16: {
+            int16_t value;
+            memcpy(&value, src + i * 2, sizeof(value));
+            return value;
+        }
+        case cgltf_component_type_r_16u: {
+            uint16_t value;
+            memcpy(&value, src + i * 2, sizeof(value));
+            return value;
+        }
+        case cgltf_component_type_r_32u: {
+            uint32_t value;
+            memcpy(&value, src + i * 4, sizeof(value));
+            return (float) value;
+        }
+        case cgltf_component_type_r_32f: {
+            float value;
+            memcpy(&value, src + i * 4, sizeof(value));
+            return value;
+        }
+        default:
+            fatal("Unsupported accessor component type.");
+            return 0.0f;
+    }
+}
+
+// Converts n packed components to floats
+static void convert_components(const uint8_t* src, cgltf_component_type type,
+        bool normalized, size_t n, float* dst)
+{
+    if (type == cgltf_component_type_r_32f) {
+        memcpy(dst, src, sizeof(float) * n);
+        return;
+    }
+    float scale = component_scale(type, normalized);
+    bool is_signed = type == cgltf_component_type_r_8 ||
+        type == cgltf_component_type_r_16;
+    size_t i = 0;
+#if defined(__SSE2__)
+    __m128 scale4 = _mm_set1_ps(scale);
+    __m128 min4 = _mm_set1_ps(normalized && is_signed ? -1.0f : -FLT_MAX);
+    __m128i zero = _mm_setzero_si128();
+    if (type == cgltf_component_type_r_8 ||
+            type == cgltf_component_type_r_8u) {
+        for (; i + 4 <= n; i += 4) {
+            int32_t packed;
+            memcpy(&packed, src + i, sizeof(packed));
+            __m128i x = _mm_cvtsi32_si128(packed);
+            if (is_signed) {
+                // Bytes to the top of each lane, then shifted back down
+                x = _mm_unpacklo_epi8(x, x);
+                x = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 24);
+            } else {
+                x = _mm_unpacklo_epi16(_mm_unpacklo_epi8(x, zero), zero);
+            }
+            __m128 f = _mm_mul_ps(_mm_cvtepi32_ps(x), scale4);
+            _mm_storeu_ps(&dst[i], _mm_max_ps(f, min4));
+        }
+    } else if (type == cgltf_component_type_r_16 ||
+            type == cgltf_component_type_r_16u) {
+        for (; i + 4 <= n; i += 4) {
+            __m128i x = _mm_loadl_epi64((const __m128i*) (src + i * 2));
+            if (is_signed) {
+                x = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+            } else {
+                x = _mm_unpacklo_epi16(x, zero);
+            }
+            __m128 f = _mm_mul_ps(_mm_cvtepi32_ps(x), scale4);
+            _mm_storeu_ps(&dst[i], _mm_max_ps(f, min4));
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        float f = read_component(src, type, i) * scale;
+        dst[i] = normalized && is_signed ? MAX(f, -1.0f) : f;
+    }
+}
+
+void accessor_unpack_floats(const cgltf_accessor* accessor,
+        uint32_t components, float* dst, size_t dst_stride)
+{
+    size_t element_components = cgltf_num_components(accessor->type);
+    DBASSERT(element_components <= MAX_COMPONENTS);
+    size_t element_size =
+        element_components * component_size(accessor->component_type);
+    components = MIN(components, element_components);
+
+    uint8_t raw[UNPACK_CHUNK * MAX_COMPONENTS * sizeof(float)];
+    float converted[UNPACK_CHUNK * MAX_COMPONENTS];
+    const uint8_t* data = accessor->buffer_view ?
+        view_data(accessor->buffer_view) : NULL;
+    if (accessor->buffer_view && !data)
+        fatal("Accessor buffer is not loaded.");
+
+    for (size_t first=0; first < accessor->count; first += UNPACK_CHUNK) {
+        size_t count = MIN(accessor->count - first, UNPACK_CHUNK);
+        if (!data) {
+            // Sparse accessors may leave out the base data, it is zeros
+            memset(converted, 0, sizeof(float) * count * element_components);
+        } else {
+            const uint8_t* src = data + accessor->offset +
+                accessor->stride * first;
+            // Interleaved elements are gathered so the conversion runs
+            // over packed components
+            if (accessor->stride != element_size) {
+                for (size_t e=0; e < count; e++) {
+                    memcpy(&raw[e * element_size],
+                            src + accessor->stride * e, element_size);
+                }
+                src = raw;
+            }
+            convert_components(src, accessor->component_type,
+                    accessor->normalized, count * element_components,
+                    converted);
+        }
+        for (size_t e=0; e < count; e++) {
+            float* out = dst + (first + e) * dst_stride;
+            for (uint32_t c=0; c < components; c++) {
+                out[c] = converted[e * element_components + c];
+            }
+        }
+    }
+
+    if (!accessor->is_sparse) return;
+    const cgltf_accessor_sparse* sparse = &accessor->sparse;
+    const uint8_t* index_data = view_data(sparse->indices_buffer_view);
+    const uint8_t* values = view_data(sparse->values_buffer_view);
+    if (!index_data || !values) fatal("Sparse accessor buffer is not loaded.");
+    index_data += sparse->indices_byte_offset;
+    values += sparse->values_byte_offset;
+    for (size_t s=0; s < sparse->count; s++) {
+        size_t index =
+            read_index(index_data, sparse->indices_component_type, s);
+        DBASSERT(index < accessor->count);
+        convert_components(values + element_size * s,
+                accessor->component_type, accessor->normalized,
+                element_components, converted);
+        float* out = dst + index * dst_stride;
+        for (uint32_t c=0; c < components; c++) out[c] = converted[c];
+    }
+}
+
+void accessor_unpack_indices(const cgltf_accessor* accessor, uint32_t* dst)
+{
+    DBASSERT(accessor->type == cgltf_type_scalar);
+    size_t count = accessor->count;
+    size_t stride = accessor->stride;
+    const uint8_t* src = accessor->buffer_view ?
+        view_data(accessor->buffer_view) : NULL;
+    if (!src) {
+        if (accessor->buffer_view) fatal("Index buffer is not loaded.");
+        memset(dst, 0, sizeof(uint32_t) * count);
+    } else {
+        src += accessor->offset;
+    }
+
+    size_t i = 0;
+    if (src && stride == component_size(accessor->component_type)) {
+        if (accessor->component_type == cgltf_component_type_r_32u) {
+            memcpy(dst, src, sizeof(uint32_t) * count);
+            i = count;
+        }
+#if defined(__SSE2__)
+        if (accessor->component_type == cgltf_component_type_r_16u) {
+            __m128i zero = _mm_setzero_si128();
+            for (; i + 8 <= count; i += 8) {
+                __m128i x = _mm_loadu_si128((const __m128i*) (src + i * 2));
+                _mm_storeu_si128((__m128i*) &dst[i],
+                        _mm_unpacklo_epi16(x, zero));
+                _mm_storeu_si128((__m128i*) &dst[i + 4],
+                        _mm_unpackhi_epi16(x, zero));
+            }
+        }
+#endif
+    }
+    for (; src && i < count; i++) {
+        dst[i] = read_index(src + i * stride, accessor->component_type, 0);
+    }
+
+    if (!accessor->is_sparse) return;
+    const cgltf_accessor_sparse* sparse = &accessor->sparse;
+    const uint8_t* index_data = view_data(sparse->indices_buffer_view);
+    const uint8_t* values = view_data(sparse->values_buffer_view);
+    if (!index_data || !values) fatal("Sparse accessor buffer is not loaded.");
+    index_data += sparse->indices_byte_offset;
+    values += sparse->values_byte_offset;
+    for (size_t s=0; s < sparse->count; s++) {
+        size_t index =
+            read_index(index_data, sparse->indices_component_type, s);
+        DBASSERT(index < count);
+        dst[index] = read_index(values, accessor->component_type, s);
+    }
+}
@@ -0,0 +1,20 @@
+#ifndef ACCESSOR_H
+#define ACCESSOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// cgltf.h is left to the includer, its implementation is not include guarded
+typedef struct cgltf_accessor cgltf_accessor;
+
+// Unpacks every element of a scalar or vector accessor as floats, whatever
+// its component type, normalized by the glTF rules and with sparse values
+// applied. The first `components` components of element i are written to
+// dst + i * dst_stride, components the accessor lacks are left as they are.
+void accessor_unpack_floats(const cgltf_accessor* accessor,
+        uint32_t components, float* dst, size_t dst_stride);
+// Every element of an 8, 16 or 32-bit index accessor, sparse values
+// applied
+void accessor_unpack_indices(const cgltf_accessor* accessor, uint32_t* dst);
+
+#endif
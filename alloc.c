@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include "alloc.h"
 #include "utils.h"
 
@@ -40,6 +41,8 @@ void zone_init(Memzone* zone, size_t size)
 }
 
 static Memzone* mainzone;
+// Loader jobs allocate from worker threads
+static pthread_mutex_t zone_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 void mem_init(size_t size)
 {
@@ -48,7 +51,7 @@ void mem_init(size_t size)
     zone_init(mainzone, size);
 }
 
-void* mem_alloc(size_t size)
+static void* zone_alloc(size_t size)
 {
     size += sizeof(Memblock);
     size = (size + ALIGNMENT - 1) & ~ (ALIGNMENT - 1); 
@@ -79,10 +82,16 @@ void* mem_alloc(size_t size)
     return (void*) ((char*) block + sizeof(Memblock));
 }
 
-void mem_free(void* ptr)
+void* mem_alloc(size_t size)
 {
-    if (!ptr) fatal("Trying to free a NULL pointer.");
+    pthread_mutex_lock(&zone_mutex);
+    void* ptr = zone_alloc(size);
+    pthread_mutex_unlock(&zone_mutex);
+    return ptr;
+}
 
+static void zone_free(void* ptr)
+{
     Memblock* block = (Memblock*) ((char*) ptr - sizeof(Memblock));
     if (block->id != ZONEID) fatal("Trying to free a pointer without ZONEID.");
     if (block->tag == 0) fatal("Trying to free a free pointer.");
@@ -107,6 +116,14 @@ void mem_free(void* ptr)
     }
 }
 
+void mem_free(void* ptr)
+{
+    if (!ptr) fatal("Trying to free a NULL pointer.");
+    pthread_mutex_lock(&zone_mutex);
+    zone_free(ptr);
+    pthread_mutex_unlock(&zone_mutex);
+}
+
 void mem_shutdown()
 {
     free(mainzone);
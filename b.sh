@@ -1,3 +1,6 @@
-gcc -I./cglm/include -lglfw -lvulkan -lm \
-    globals.h utils.h utils.c render.h render.c main.c alloc.h alloc.c scene.c globals.c vkhelpers.c collision.c \
+gcc -I./cglm/include -lglfw -lvulkan -lm -lpthread \
+    globals.h utils.h utils.c render.h render.c main.c alloc.h alloc.c scene.c globals.c vkhelpers.c collision.c aabbtree.c transform.c jobs.c cull.c sort.c meshopt.c quantize.c accessor.c ktx2.c \
     -o game
+gcc \
+    utils.h utils.c alloc.h alloc.c ktx2.c bcenc.c cook.c \
+    -lm -lpthread -o cook
@@ -0,0 +1,259 @@
+#include <float.h>
+#include <math.h>
+#include <string.h>
+#include "bcenc.h"
+#include "utils.h"
+
+static uint16_t pack_565(const float* color)
+{
+    uint32_t r = (uint32_t) (fminf(fmaxf(color[0], 0.0f), 255.0f) *
+            31.0f / 255.0f + 0.5f);
+    uint32_t g = (uint32_t) (fminf(fmaxf(color[1], 0.0f), 255.0f) *
+            63.0f / 255.0f + 0.5f);
+    uint32_t b = (uint32_t) (fminf(fmaxf(color[2], 0.0f), 255.0f) *
+            31.0f / 255.0f + 0.5f);
+    return r << 11 | g << 5 | b;
+}
+
+// Expands by bit replication like the decoders do
+static void unpack_565(uint16_t packed, int* color)
+{
+    int r = packed >> 11 & 31;
+    int g = packed >> 5 & 63;
+    int b = packed & 31;
+    color[0] = r << 3 | r >> 2;
+    color[1] = g << 2 | g >> 4;
+    color[2] = b << 3 | b >> 2;
+}
+
+// The four color palette, endpoints first
+static void color_palette(uint16_t c0, uint16_t c1, int palette[4][3])
+{
+    unpack_565(c0, palette[0]);
+    unpack_565(c1, palette[1]);
+    for (int i=0; i < 3; i++) {
+        palette[2][i] = (2 * palette[0][i] + palette[1][i]) / 3;
+        palette[3][i] = (palette[0][i] + 2 * palette[1][i]) / 3;
+    }
+}
+
+// Picks the nearest palette entry per pixel, returns the squared error
+static uint32_t color_indices(const uint8_t* rgba, int palette[4][3],
+        uint8_t* o_indices)
+{
+    uint32_t total = 0;
+    for (int p=0; p < 16; p++) {
+        const uint8_t* pixel = &rgba[p * 4];
+        uint32_t best = UINT32_MAX;
+        for (int e=0; e < 4; e++) {
+            int dr = pixel[0] - palette[e][0];
+            int dg = pixel[1] - palette[e][1];
+            int db = pixel[2] - palette[e][2];
+            uint32_t error = dr * dr + dg * dg + db * db;
+            if (error < best) {
+                best = error;
+                o_indices[p] = e;
+            }
+        }
+        total += best;
+    }
+    return total;
+}
+
+// Palette position of each index, 0 at c0 and 1 at c1
+static const float INDEX_WEIGHTS[4] = {0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f};
+
+// Endpoints minimizing the squared error of pixels fixed to their indices,
+// false if the system is degenerate
+static bool fit_endpoints(const uint8_t* rgba, const uint8_t* indices,
+        float* o_c0, float* o_c1)
+{
+    float aa = 0.0f, ab = 0.0f, bb = 0.0f;
+    float ax[3] = {0}, bx[3] = {0};
+    for (int p=0; p < 16; p++) {
+        float b = INDEX_WEIGHTS[indices[p]];
+        float a = 1.0f - b;
+        aa += a * a;
+        ab += a * b;
+        bb += b * b;
+        for (int i=0; i < 3; i++) {
+            ax[i] += a * rgba[p * 4 + i];
+            bx[i] += b * rgba[p * 4 + i];
+        }
+    }
+    float det = aa * bb - ab * ab;
+    if (fabsf(det) < 1e-6f) return false;
+    for (int i=0; i < 3; i++) {
+        o_c0[i] = (bb * ax[i] - ab * bx[i]) / det;
+        o_c1[i] = (aa * bx[i] - ab * ax[i]) / det;
+    }
+    return true;
+}
+
+// Endpoints at the extremes of the pixels along their principal axis,
+// inset by a 16th of the range like the usual fast encoders
+static void principal_endpoints(const uint8_t* rgba, float* o_c0,
+        float* o_c1)
+{
+    float mean[3] = {0};
+    for (int p=0; p < 16; p++) {
+        for (int i=0; i < 3; i++) mean[i] += rgba[p * 4 + i] / 16.0f;
+    }
+    float cov[6] = {0}; // rr rg rb gg gb bb
+    for (int p=0; p < 16; p++) {
+        float d[3];
+        for (int i=0; i < 3; i++) d[i] = rgba[p * 4 + i] - mean[i];
+        cov[0] += d[0] * d[0];
+        cov[1] += d[0] * d[1];
+        cov[2] += d[0] * d[2];
+        cov[3] += d[1] * d[1];
+        cov[4] += d[1] * d[2];
+        cov[5] += d[2] * d[2];
+    }
+    // Power iteration from the luma direction
+    float axis[3] = {0.3f, 0.6f, 0.1f};
+    for (int it=0; it < 8; it++) {
+        float next[3] = {
+            cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2],
+            cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2],
+            cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2],
+        };
+        float length = sqrtf(next[0] * next[0] + next[1] * next[1] +
+                next[2] * next[2]);
+        if (length < 1e-6f) break;
+        for (int i=0; i < 3; i++) axis[i] = next[i] / length;
+    }
+
+    float min_t = FLT_MAX;
+    float max_t = -FLT_MAX;
+    for (int p=0; p < 16; p++) {
+        float t = 0.0f;
+        for (int i=0; i < 3; i++) t += (rgba[p * 4 + i] - mean[i]) * axis[i];
+        min_t = fminf(min_t, t);
+        max_t = fmaxf(max_t, t);
+    }
+    float inset = (max_t - min_t) / 16.0f;
+    min_t += inset;
+    max_t -= inset;
+    for (int i=0; i < 3; i++) {
+        o_c0[i] = mean[i] + axis[i] * max_t;
+        o_c1[i] = mean[i] + axis[i] * min_t;
+    }
+}
+
+// Orders the endpoints for the four color mode and writes the block
+static void write_color_block(uint16_t c0, uint16_t c1,
+        const uint8_t* indices, uint8_t* dst)
+{
+    // Swapping the endpoints swaps indices 0 and 1, and 2 and 3
+    static const uint8_t SWAPPED[4] = {1, 0, 3, 2};
+    bool swap = c0 < c1;
+    uint32_t bits = 0;
+    for (int p=0; p < 16; p++) {
+        // Equal endpoints decode in three color mode, index 0 stays valid
+        uint32_t index = c0 == c1 ? 0 : indices[p];
+        if (swap) index = SWAPPED[index];
+        bits |= index << (2 * p);
+    }
+    if (swap) {
+        uint16_t t = c0;
+        c0 = c1;
+        c1 = t;
+    }
+    dst[0] = c0 & 0xff;
+    dst[1] = c0 >> 8;
+    dst[2] = c1 & 0xff;
+    dst[3] = c1 >> 8;
+    for (int i=0; i < 4; i++) dst[4 + i] = bits >> (8 * i) & 0xff;
+}
+
+void bc1_encode_block(const uint8_t* rgba, uint8_t* dst)
+{
+    float c0[3], c1[3];
+    principal_endpoints(rgba, c0, c1);
+    uint16_t best_c0 = pack_565(c0);
+    uint16_t best_c1 = pack_565(c1);
+    uint8_t best_indices[16];
+    int palette[4][3];
+    color_palette(best_c0, best_c1, palette);
+    uint32_t best_error = color_indices(rgba, palette, best_indices);
+
+    // A least squares refit to the chosen indices, kept if it helps
+    uint8_t indices[16];
+    if (best_error > 0 && fit_endpoints(rgba, best_indices, c0, c1)) {
+        uint16_t fit_c0 = pack_565(c0);
+        uint16_t fit_c1 = pack_565(c1);
+        color_palette(fit_c0, fit_c1, palette);
+        uint32_t error = color_indices(rgba, palette, indices);
+        if (error < best_error) {
+            best_c0 = fit_c0;
+            best_c1 = fit_c1;
+            memcpy(best_indices, indices, sizeof(indices));
+        }
+    }
+    write_color_block(best_c0, best_c1, best_indices, dst);
+}
+
+// Eight value mode between the alpha extremes
+static void encode_alpha_block(const uint8_t* rgba, uint8_t* dst)
+{
+    int a0 = 0;
+    int a1 = 255;
+    for (int p=0; p < 16; p++) {
+        a0 = MAX(a0, rgba[p * 4 + 3]);
+        a1 = MIN(a1, rgba[p * 4 + 3]);
+    }
+    dst[0] = a0;
+    dst[1] = a1;
+    int palette[8] = {a0, a1};
+    for (int i=1; i < 7; i++) {
+        palette[i + 1] = ((7 - i) * a0 + i * a1) / 7;
+    }
+
+    uint64_t bits = 0;
+    for (int p=0; p < 16; p++) {
+        int alpha = rgba[p * 4 + 3];
+        int best = 0;
+        for (int e=1; e < 8 && a0 != a1; e++) {
+            if (abs(alpha - palette[e]) < abs(alpha - palette[best])) best = e;
+        }
+        bits |= (uint64_t) best << (3 * p);
+    }
+    for (int i=0; i < 6; i++) dst[2 + i] = bits >> (8 * i) & 0xff;
+}
+
+void bc3_encode_block(const uint8_t* rgba, uint8_t* dst)
+{
+    encode_alpha_block(rgba, dst);
+    bc1_encode_block(rgba, dst + 8);
+}
+
+size_t bc_image_size(uint32_t width, uint32_t height, size_t block_size)
+{
+    return (size_t) ((width + 3) / 4) * ((height + 3) / 4) * block_size;
+}
+
+void bc_encode_image(const uint8_t* rgba, uint32_t width, uint32_t height,
+        bool alpha, uint8_t* dst)
+{
+    size_t block_size = alpha ? BC3_BLOCK_SIZE : BC1_BLOCK_SIZE;
+    uint8_t block[64];
+    for (uint32_t by=0; by < height; by += 4) {
+        for (uint32_t bx=0; bx < width; bx += 4) {
+            for (uint32_t y=0; y < 4; y++) {
+                for (uint32_t x=0; x < 4; x++) {
+                    uint32_t sx = MIN(bx + x, width - 1);
+                    uint32_t sy = MIN(by + y, height - 1);
+                    memcpy(&block[(y * 4 + x) * 4],
+                            &rgba[((size_t) sy * width + sx) * 4], 4);
+                }
+            }
+            if (alpha) {
+                bc3_encode_block(block, dst);
+            } else {
+                bc1_encode_block(block, dst);
+            }
+            dst += block_size;
+        }
+    }
+}
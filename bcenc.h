@@ -0,0 +1,23 @@
+#ifndef BCENC_H
+#define BCENC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BC1_BLOCK_SIZE 8
+#define BC3_BLOCK_SIZE 16
+
+// Encodes a 4x4 block of RGBA pixels in rows. BC1 ignores alpha and always
+// uses the four color mode.
+void bc1_encode_block(const uint8_t* rgba, uint8_t* dst);
+void bc3_encode_block(const uint8_t* rgba, uint8_t* dst);
+
+// Bytes of an image in 4x4 blocks of block_size
+size_t bc_image_size(uint32_t width, uint32_t height, size_t block_size);
+// Encodes an RGBA image as BC3 if alpha is set, otherwise BC1. Edge blocks
+// repeat the last row and column.
+void bc_encode_image(const uint8_t* rgba, uint32_t width, uint32_t height,
+        bool alpha, uint8_t* dst);
+
+#endif
@@ -1,5 +1,88 @@
+#include <float.h>
+#include <math.h>
 #include "collision.h"
+#include "alloc.h"
+#include "utils.h"
 #define POLE_SPACING 0.1
+#define LIGHT_PICK_RADIUS 0.25
+
+CollisionMesh collision_mesh;
+
+// Node world matrices must be up to date
+static void update_subtree(CollisionMesh* cmesh, Scene* scene, Node* node)
+{
+    CollisionPart* part = &cmesh->parts[node->id - 1];
+    vec4* world = scene->hierarchy.world[node->transform];
+    if (part->triangle_count) {
+        vec3* dest = &cmesh->positions[part->first_triangle * 3];
+        glm_vec3_copy((vec3) {FLT_MAX, FLT_MAX, FLT_MAX}, part->min);
+        glm_vec3_copy((vec3) {-FLT_MAX, -FLT_MAX, -FLT_MAX}, part->max);
+        for (size_t p=0; p < node->mesh->primitives_count; p++) {
+            Primitive* primitive = &node->mesh->primitives[p];
+            Vertex* vertices = &scene->vertices[primitive->vertex_offset];
+            for (uint32_t i=0; i < primitive->index_count; i++) {
+                uint32_t index = primitive_index(scene, primitive, i);
+                glm_mat4_mulv3(world, vertices[index].position, 1.0f, *dest);
+                glm_vec3_minv(part->min, *dest, part->min);
+                glm_vec3_maxv(part->max, *dest, part->max);
+                dest++;
+            }
+        }
+        if (aabbtree_contains(&cmesh->tree, node->id)) {
+            aabbtree_move(&cmesh->tree, node->id, part->min, part->max);
+        } else {
+            aabbtree_insert(&cmesh->tree, node->id, part->min, part->max);
+        }
+    }
+
+    for (size_t c=0; c < node->children_count; c++) {
+        update_subtree(cmesh, scene, node->children[c]);
+    }
+}
+
+void collision_build(CollisionMesh* cmesh, Scene* scene)
+{
+    cmesh->part_count = scene->node_count;
+    cmesh->parts = malloc_nofail(sizeof(CollisionPart) * cmesh->part_count);
+
+    cmesh->triangle_count = 0;
+    for (size_t n=0; n < scene->node_count; n++) {
+        Node* node = &scene->nodes[n];
+        CollisionPart* part = &cmesh->parts[node->id - 1];
+        part->first_triangle = cmesh->triangle_count;
+        part->triangle_count = 0;
+        if (node->mesh) {
+            for (size_t p=0; p < node->mesh->primitives_count; p++) {
+                part->triangle_count +=
+                    node->mesh->primitives[p].index_count / 3;
+            }
+        }
+        cmesh->triangle_count += part->triangle_count;
+    }
+    cmesh->positions = malloc_nofail(
+            sizeof(vec3) * 3 * cmesh->triangle_count);
+
+    aabbtree_init(&cmesh->tree, scene->node_count + 1);
+
+    for (size_t n=0; n < scene->node_count; n++) {
+        if (!scene->nodes[n].parent) {
+            update_subtree(cmesh, scene, &scene->nodes[n]);
+        }
+    }
+}
+
+// Retransforms the triangles of a moved node and of all its descendants
+void collision_update_node(CollisionMesh* cmesh, Scene* scene, Node* node)
+{
+    update_subtree(cmesh, scene, node);
+}
+
+void destroy_collision_mesh(CollisionMesh* cmesh)
+{
+    mem_free(cmesh->positions);
+    mem_free(cmesh->parts);
+    aabbtree_destroy(&cmesh->tree);
+}
 
 bool point_in_triangle(vec2 a, vec2 b, vec2 c, vec2 p)
 {
@@ -22,23 +105,33 @@ bool point_in_triangle(vec2 a, vec2 b, vec2 c, vec2 p)
     return (u >= 0) && (v >= 0) && (u + v < 1);
 }
 
-float get_height(Vertex* vertices, uint32_t vertex_count, uint16_t* indices, uint32_t index_count, float x, float y)
+typedef struct HeightQuery {
+    CollisionMesh* cmesh;
+    vec2 p;
+    float z_highest;
+    bool ground_found;
+} HeightQuery;
+
+static void part_height(uint32_t key, void* user)
 {
-    float z_highest = -1000.0;
-    bool ground_found = false;
-    int tricount=0;
-    for (size_t index = 0; index < index_count; index += 3) {
-        tricount++;
-        vec2 p = {x, y};
-        vec2 a = {vertices[indices[index]].position[0], vertices[indices[index]].position[1]};
-        vec2 b = {vertices[indices[index+1]].position[0], vertices[indices[index+1]].position[1]};
-        vec2 c = {vertices[indices[index+2]].position[0], vertices[indices[index+2]].position[1]};
+    HeightQuery* query = user;
+    CollisionPart* part = &query->cmesh->parts[key - 1];
+    float x = query->p[0];
+    float y = query->p[1];
+    if (x < part->min[0] || x > part->max[0] ||
+            y < part->min[1] || y > part->max[1]) return;
+
+    vec3* tri = &query->cmesh->positions[part->first_triangle * 3];
+    for (size_t t = 0; t < part->triangle_count; t++, tri += 3) {
+        vec2 a = {tri[0][0], tri[0][1]};
+        vec2 b = {tri[1][0], tri[1][1]};
+        vec2 c = {tri[2][0], tri[2][1]};
         vec2 ab;
         vec2 ac;
         vec2 ap;
         glm_vec2_sub(b, a, ab);
         glm_vec2_sub(c, a, ac);
-        glm_vec2_sub(p, a, ap);
+        glm_vec2_sub(query->p, a, ap);
 
         float cc = glm_vec2_dot(ac, ac);
         float bc = glm_vec2_dot(ab, ac);
@@ -51,18 +144,117 @@ float get_height(Vertex* vertices, uint32_t vertex_count, uint16_t* indices, uin
         float v = (cc * pb - bc * pc) / denom;
 
         if ((u >= 0.0) && (v >= 0.0) && (u + v <= 1.0)) {
-//            printf("koo\n");
-            float az = vertices[indices[index]].position[2];
-            float z = az + (vertices[indices[index+1]].position[2] - az) * v +
-                                        (vertices[indices[index+2]].position[2] - az) * u;
-            if (z > z_highest) z_highest = z;
-            ground_found = true;
-        } else {
- //           printf("nope\n");
+            float az = tri[0][2];
+            float z = az + (tri[1][2] - az) * v + (tri[2][2] - az) * u;
+            if (z > query->z_highest) query->z_highest = z;
+            query->ground_found = true;
         }
     }
+}
+
+float get_height(CollisionMesh* cmesh, float x, float y)
+{
+    HeightQuery query = {
+        .cmesh = cmesh,
+        .p = {x, y},
+        .z_highest = -1000.0,
+        .ground_found = false,
+    };
+    vec3 column_min = {x, y, -FLT_MAX};
+    vec3 column_max = {x, y, FLT_MAX};
+    aabbtree_query_box(&cmesh->tree, column_min, column_max,
+            part_height, &query);
+
     float z;
-    if (ground_found) z = z_highest; else z = 0.0;
-    printf("tri count %d\n", tricount);
+    if (query.ground_found) z = query.z_highest; else z = 0.0;
     return z;
 }
+
+// Moller-Trumbore, returns the ray distance or a negative value on a miss
+static float ray_hits_triangle(vec3 origin, vec3 dir, vec3 a, vec3 b, vec3 c)
+{
+    vec3 ab;
+    vec3 ac;
+    glm_vec3_sub(b, a, ab);
+    glm_vec3_sub(c, a, ac);
+    vec3 pvec;
+    glm_vec3_cross(dir, ac, pvec);
+    float det = glm_vec3_dot(ab, pvec);
+    if (fabsf(det) < 1e-8f) return -1.0f;
+    float inv_det = 1.0f / det;
+
+    vec3 tvec;
+    glm_vec3_sub(origin, a, tvec);
+    float u = glm_vec3_dot(tvec, pvec) * inv_det;
+    if (u < 0.0f || u > 1.0f) return -1.0f;
+
+    vec3 qvec;
+    glm_vec3_cross(tvec, ab, qvec);
+    float v = glm_vec3_dot(dir, qvec) * inv_det;
+    if (v < 0.0f || u + v > 1.0f) return -1.0f;
+
+    return glm_vec3_dot(ac, qvec) * inv_det;
+}
+
+// State of a ray pick while the tree is walked
+typedef struct PickQuery {
+    CollisionMesh* cmesh;
+    float* origin;
+    float* dir;
+    vec3 inv_dir;
+    float closest;
+    uint32_t code;
+} PickQuery;
+
+static void part_pick(uint32_t key, void* user)
+{
+    PickQuery* query = user;
+    CollisionPart* part = &query->cmesh->parts[key - 1];
+    // Tree leaves are fat, the part bounds are tight
+    if (aabb_ray_entry(part->min, part->max, query->origin, query->inv_dir,
+                query->closest) < 0.0f) return;
+
+    vec3* tri = &query->cmesh->positions[part->first_triangle * 3];
+    for (size_t t = 0; t < part->triangle_count; t++, tri += 3) {
+        float dist = ray_hits_triangle(query->origin, query->dir,
+                tri[0], tri[1], tri[2]);
+        if (dist > 0.0f && dist < query->closest) {
+            query->closest = dist;
+            query->code = key;
+        }
+    }
+}
+
+// Returns the code of the closest object along the ray: a node id, a light
+// code or 0 when nothing is hit. dir must be normalized.
+uint32_t collision_pick(CollisionMesh* cmesh, Scene* scene,
+        vec3 origin, vec3 dir)
+{
+    PickQuery query = {
+        .cmesh = cmesh,
+        .origin = origin,
+        .dir = dir,
+        .inv_dir = {1.0f / dir[0], 1.0f / dir[1], 1.0f / dir[2]},
+        .closest = FLT_MAX,
+        .code = 0,
+    };
+    aabbtree_query_ray(&cmesh->tree, origin, dir, &query.closest,
+            part_pick, &query);
+    uint32_t code = query.code;
+    float closest = query.closest;
+
+    for (size_t l = 0; l < scene->light_count; l++) {
+        Light* light = &scene->lights[l];
+        vec3 to_light;
+        glm_vec3_sub(light->pos, origin, to_light);
+        float along = glm_vec3_dot(to_light, dir);
+        if (along <= 0.0f || along >= closest) continue;
+        float dist2 = glm_vec3_norm2(to_light) - along * along;
+        if (dist2 <= LIGHT_PICK_RADIUS * LIGHT_PICK_RADIUS) {
+            closest = along;
+            code = light->code;
+        }
+    }
+
+    return code;
+}
@@ -5,8 +5,33 @@
 #include <cglm/cglm.h>
 #include <stdbool.h>
 #include "scene.h"
+#include "aabbtree.h"
+
+// World-space triangles of a single node
+typedef struct CollisionPart {
+    uint32_t first_triangle;
+    uint32_t triangle_count;
+    vec3 min;
+    vec3 max;
+} CollisionPart;
+
+typedef struct CollisionMesh {
+    vec3* positions; // 3 per triangle
+    size_t triangle_count;
+    CollisionPart* parts; // Indexed by node id - 1
+    size_t part_count;
+    AABBTree tree; // Broadphase over the parts, keyed by node id
+} CollisionMesh;
+
+void collision_build(CollisionMesh* cmesh, Scene* scene);
+void collision_update_node(CollisionMesh* cmesh, Scene* scene, Node* node);
+void destroy_collision_mesh(CollisionMesh* cmesh);
 
 bool point_in_triangle(vec2 a, vec2 b, vec2 c, vec2 p);
-float get_height(Vertex* vertices, uint32_t vertex_count, uint16_t* indices, uint32_t index_count, float x, float y);
+float get_height(CollisionMesh* cmesh, float x, float y);
+uint32_t collision_pick(CollisionMesh* cmesh, Scene* scene,
+        vec3 origin, vec3 dir);
+
+extern CollisionMesh collision_mesh;
 
 #endif
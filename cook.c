@@ -0,0 +1,153 @@
+// Offline texture cooker. Decodes the images of glTF binaries and writes
+// each as <scene>.<image index>.ktx2 with a full BC1 or BC3 mip chain,
+// which load_scene picks up instead of decoding the image.
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#define CGLTF_IMPLEMENTATION
+#include "cgltf.h"
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#include "utils.h"
+#include "alloc.h"
+#include "ktx2.h"
+#include "bcenc.h"
+
+static float srgb_to_linear[256];
+
+static uint8_t linear_to_srgb(float linear)
+{
+    float srgb = linear <= 0.0031308f ? linear * 12.92f :
+        1.055f * powf(linear, 1.0f / 2.4f) - 0.055f;
+    return (uint8_t) (fminf(fmaxf(srgb, 0.0f), 1.0f) * 255.0f + 0.5f);
+}
+
+// 2x2 box filter, color averaged in linear space. Odd sizes drop the last
+// row or column.
+static void downsample(const uint8_t* src, uint32_t width, uint32_t height,
+        uint8_t* dst)
+{
+    uint32_t dst_width = MAX(width / 2, 1);
+    uint32_t dst_height = MAX(height / 2, 1);
+    for (uint32_t y=0; y < dst_height; y++) {
+        for (uint32_t x=0; x < dst_width; x++) {
+            uint32_t x0 = MIN(2 * x, width - 1);
+            uint32_t x1 = MIN(2 * x + 1, width - 1);
+            uint32_t y0 = MIN(2 * y, height - 1);
+            uint32_t y1 = MIN(2 * y + 1, height - 1);
+            const uint8_t* p[4] = {
+                &src[((size_t) y0 * width + x0) * 4],
+                &src[((size_t) y0 * width + x1) * 4],
+                &src[((size_t) y1 * width + x0) * 4],
+                &src[((size_t) y1 * width + x1) * 4],
+            };
+            uint8_t* out = &dst[((size_t) y * dst_width + x) * 4];
+            for (int c=0; c < 3; c++) {
+                float sum = 0.0f;
+                for (int i=0; i < 4; i++) sum += srgb_to_linear[p[i][c]];
+                out[c] = linear_to_srgb(sum * 0.25f);
+            }
+            out[3] = (p[0][3] + p[1][3] + p[2][3] + p[3][3] + 2) / 4;
+        }
+    }
+}
+
+static void cook_image(const stbi_uc* buffer, size_t size, const char* path)
+{
+    int width, height, channels;
+    stbi_uc* pixels = stbi_load_from_memory(buffer, size,
+            &width, &height, &channels, STBI_rgb_alpha);
+    if (!pixels) fatal("Failed to decode image.\n");
+    bool alpha = false;
+    for (size_t p=0; p < (size_t) width * height; p++) {
+        if (pixels[p * 4 + 3] != 255) {
+            alpha = true;
+            break;
+        }
+    }
+    size_t block_size = alpha ? BC3_BLOCK_SIZE : BC1_BLOCK_SIZE;
+
+    Ktx2 ktx2 = {
+        .vk_format = alpha ? KTX2_FORMAT_BC3_SRGB : KTX2_FORMAT_BC1_RGB_SRGB,
+        .width = width,
+        .height = height,
+        .level_count = 1,
+    };
+    for (uint32_t s = MAX(width, height); s > 1; s >>= 1) ktx2.level_count++;
+    DBASSERT(ktx2.level_count <= KTX2_MAX_LEVELS);
+
+    uint8_t* level = malloc_nofail((size_t) width * height * 4);
+    uint8_t* next = malloc_nofail((size_t) width * height * 4);
+    memcpy(level, pixels, (size_t) width * height * 4);
+    stbi_image_free(pixels);
+    uint32_t level_width = width;
+    uint32_t level_height = height;
+    size_t encoded_size = 0;
+    for (uint32_t l=0; l < ktx2.level_count; l++) {
+        size_t level_size =
+            bc_image_size(level_width, level_height, block_size);
+        uint8_t* encoded = malloc_nofail(level_size);
+        bc_encode_image(level, level_width, level_height, alpha, encoded);
+        ktx2.levels[l].data = encoded;
+        ktx2.levels[l].size = level_size;
+        encoded_size += level_size;
+
+        downsample(level, level_width, level_height, next);
+        uint8_t* t = level;
+        level = next;
+        next = t;
+        level_width = MAX(level_width / 2, 1);
+        level_height = MAX(level_height / 2, 1);
+    }
+    mem_free(next);
+    mem_free(level);
+
+    if (ktx2_write(path, &ktx2)) fatal("Failed to write KTX2 file.\n");
+    printf("%s: %dx%d %s, %u levels, %zu KB\n", path, width, height,
+            alpha ? "BC3" : "BC1", ktx2.level_count, encoded_size / 1024);
+    for (uint32_t l=0; l < ktx2.level_count; l++) {
+        mem_free((void*) ktx2.levels[l].data);
+    }
+}
+
+static void cook_scene(const char* scene_path)
+{
+    cgltf_options options = {0};
+    cgltf_data* data = NULL;
+    if (cgltf_parse_file(&options, scene_path, &data) !=
+            cgltf_result_success ||
+            cgltf_load_buffers(&options, data, scene_path) !=
+            cgltf_result_success) {
+        fatal("Failed to load GLTF.\n");
+    }
+    for (size_t i=0; i < data->images_count; i++) {
+        cgltf_buffer_view* view = data->images[i].buffer_view;
+        if (!view) {
+            errprint("Skipping an image outside the binary.\n");
+            continue;
+        }
+        char path[1024];
+        snprintf(path, sizeof(path), "%s.%zu.ktx2", scene_path, i);
+        cook_image((const stbi_uc*) view->buffer->data + view->offset,
+                view->size, path);
+    }
+    cgltf_free(data);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s scene.glb...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    mem_init(MBS(512));
+    for (int i=0; i < 256; i++) {
+        float srgb = i / 255.0f;
+        srgb_to_linear[i] = srgb <= 0.04045f ? srgb / 12.92f :
+            powf((srgb + 0.055f) / 1.055f, 2.4f);
+    }
+    for (int i=1; i < argc; i++) cook_scene(argv[i]);
+    mem_shutdown();
+    return 0;
+}
@@ -0,0 +1,96 @@
+#include "cull.h"
+
+#if defined(__SSE__)
+#include <immintrin.h>
+#endif
+
+void frustum_from_matrix(mat4 view_proj, Frustum* o_frustum)
+{
+    vec4 planes[6];
+    glm_frustum_planes(view_proj, planes);
+    for (int p=0; p < 8; p++) {
+        if (p < 6) {
+            o_frustum->nx[p] = planes[p][0];
+            o_frustum->ny[p] = planes[p][1];
+            o_frustum->nz[p] = planes[p][2];
+            o_frustum->d[p] = planes[p][3];
+        } else {
+            o_frustum->nx[p] = 0.0f;
+            o_frustum->ny[p] = 0.0f;
+            o_frustum->nz[p] = 0.0f;
+            o_frustum->d[p] = 1.0f;
+        }
+    }
+}
+
+uint8_t frustum_test_box(Frustum* frustum, vec3 min, vec3 max, uint8_t mask)
+{
+    if (!mask) return 0;
+    if (min[0] > max[0]) return FRUSTUM_CULLED;
+
+    uint32_t outside = 0;
+    uint32_t inside = 0;
+#if defined(__SSE__)
+    __m128 min_x = _mm_set1_ps(min[0]);
+    __m128 min_y = _mm_set1_ps(min[1]);
+    __m128 min_z = _mm_set1_ps(min[2]);
+    __m128 max_x = _mm_set1_ps(max[0]);
+    __m128 max_y = _mm_set1_ps(max[1]);
+    __m128 max_z = _mm_set1_ps(max[2]);
+    __m128 zero = _mm_setzero_ps();
+    for (int g=0; g < 2; g++) {
+        __m128 nx = _mm_load_ps(&frustum->nx[g * 4]);
+        __m128 ny = _mm_load_ps(&frustum->ny[g * 4]);
+        __m128 nz = _mm_load_ps(&frustum->nz[g * 4]);
+        __m128 d = _mm_load_ps(&frustum->d[g * 4]);
+        __m128 x0 = _mm_mul_ps(nx, min_x);
+        __m128 x1 = _mm_mul_ps(nx, max_x);
+        __m128 y0 = _mm_mul_ps(ny, min_y);
+        __m128 y1 = _mm_mul_ps(ny, max_y);
+        __m128 z0 = _mm_mul_ps(nz, min_z);
+        __m128 z1 = _mm_mul_ps(nz, max_z);
+        // Distances of the corners furthest along and against each normal
+        __m128 dist_max = _mm_add_ps(d, _mm_add_ps(_mm_max_ps(x0, x1),
+                    _mm_add_ps(_mm_max_ps(y0, y1), _mm_max_ps(z0, z1))));
+        __m128 dist_min = _mm_add_ps(d, _mm_add_ps(_mm_min_ps(x0, x1),
+                    _mm_add_ps(_mm_min_ps(y0, y1), _mm_min_ps(z0, z1))));
+        outside |= _mm_movemask_ps(_mm_cmplt_ps(dist_max, zero)) << (g * 4);
+        inside |= _mm_movemask_ps(_mm_cmpge_ps(dist_min, zero)) << (g * 4);
+    }
+#else
+    for (int p=0; p < 6; p++) {
+        float n[3] = {frustum->nx[p], frustum->ny[p], frustum->nz[p]};
+        float dist_max = frustum->d[p];
+        float dist_min = frustum->d[p];
+        for (int i=0; i < 3; i++) {
+            dist_max += n[i] * (n[i] > 0.0f ? max[i] : min[i]);
+            dist_min += n[i] * (n[i] > 0.0f ? min[i] : max[i]);
+        }
+        if (dist_max < 0.0f) outside |= 1 << p;
+        if (dist_min >= 0.0f) inside |= 1 << p;
+    }
+#endif
+
+    if (outside & mask) return FRUSTUM_CULLED;
+    return mask & ~inside;
+}
+
+void cull_hierarchy(Hierarchy* h, Frustum* frustum, uint8_t* masks,
+        uint8_t* visible, uint32_t begin, uint32_t end)
+{
+    for (uint32_t i=begin; i < end; i++) {
+        uint32_t parent = h->parent[i];
+        uint8_t mask = parent == HIERARCHY_ROOT ?
+            FRUSTUM_ALL_PLANES : masks[parent];
+        if (mask != FRUSTUM_CULLED) {
+            mask = frustum_test_box(frustum,
+                    h->subtree_min[i], h->subtree_max[i], mask);
+        }
+        masks[i] = mask;
+
+        // A subtree fully inside needs no test of its own bounds
+        visible[i] = mask != FRUSTUM_CULLED && h->world_min[i][0] <=
+            h->world_max[i][0] && frustum_test_box(frustum,
+                h->world_min[i], h->world_max[i], mask) != FRUSTUM_CULLED;
+    }
+}
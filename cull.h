@@ -0,0 +1,30 @@
+#ifndef CULL_H
+#define CULL_H
+
+#include <cglm/cglm.h>
+#include <stdint.h>
+#include "scene.h"
+
+#define FRUSTUM_ALL_PLANES 0x3f
+#define FRUSTUM_CULLED 0xff
+
+// Planes in SoA form for 4-wide tests, the two padding planes always pass
+typedef struct Frustum {
+    CGLM_ALIGN(16) float nx[8];
+    CGLM_ALIGN(16) float ny[8];
+    CGLM_ALIGN(16) float nz[8];
+    CGLM_ALIGN(16) float d[8];
+} Frustum;
+
+void frustum_from_matrix(mat4 view_proj, Frustum* o_frustum);
+// Tests a box against the planes in mask. Returns FRUSTUM_CULLED if it is
+// outside one of them, otherwise the planes of mask it still crosses.
+uint8_t frustum_test_box(Frustum* frustum, vec3 min, vec3 max, uint8_t mask);
+
+// Culls hierarchy entries [begin, end), parents must be done already.
+// masks receive the planes each subtree still crosses, visible is set for
+// entries whose own bounds pass.
+void cull_hierarchy(Hierarchy* h, Frustum* frustum, uint8_t* masks,
+        uint8_t* visible, uint32_t begin, uint32_t end);
+
+#endif
@@ -0,0 +1,120 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include "jobs.h"
+#include "utils.h"
+
+typedef struct JobPool {
+    pthread_t threads[MAX_JOB_THREADS];
+    uint32_t thread_count;
+    pthread_mutex_t mutex;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    uint64_t generation;
+    uint32_t pending;
+    bool quit;
+
+    JobFn fn;
+    void* data;
+    uint32_t count;
+    uint32_t slice_count;
+} JobPool;
+
+static JobPool pool;
+
+static void run_slice(uint32_t thread)
+{
+    if (thread >= pool.slice_count) return;
+    uint32_t begin = (uint64_t) pool.count * thread / pool.slice_count;
+    uint32_t end = (uint64_t) pool.count * (thread + 1) / pool.slice_count;
+    pool.fn(pool.data, begin, end, thread);
+}
+
+static void* worker_main(void* arg)
+{
+    uint32_t thread = (uint32_t) (uintptr_t) arg;
+    uint64_t seen = 0;
+    pthread_mutex_lock(&pool.mutex);
+    for (;;) {
+        while (pool.generation == seen && !pool.quit)
+            pthread_cond_wait(&pool.work_ready, &pool.mutex);
+        if (pool.quit) break;
+        seen = pool.generation;
+        pthread_mutex_unlock(&pool.mutex);
+
+        run_slice(thread);
+
+        pthread_mutex_lock(&pool.mutex);
+        if (--pool.pending == 0) pthread_cond_signal(&pool.work_done);
+    }
+    pthread_mutex_unlock(&pool.mutex);
+    return NULL;
+}
+
+void jobs_init(uint32_t thread_count)
+{
+    if (thread_count == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = cores > 0 ? (uint32_t) cores : 1;
+    }
+    pool.thread_count = MIN(thread_count, MAX_JOB_THREADS);
+    pool.generation = 0;
+    pool.pending = 0;
+    pool.quit = false;
+    pthread_mutex_init(&pool.mutex, NULL);
+    pthread_cond_init(&pool.work_ready, NULL);
+    pthread_cond_init(&pool.work_done, NULL);
+
+    // Thread 0 is the caller of jobs_parallel_for
+    for (uint32_t t=1; t < pool.thread_count; t++) {
+        if (pthread_create(&pool.threads[t], NULL, worker_main,
+                    (void*) (uintptr_t) t) != 0)
+            fatal("Failed to create worker thread.");
+    }
+}
+
+void jobs_shutdown()
+{
+    pthread_mutex_lock(&pool.mutex);
+    pool.quit = true;
+    pthread_cond_broadcast(&pool.work_ready);
+    pthread_mutex_unlock(&pool.mutex);
+    for (uint32_t t=1; t < pool.thread_count; t++) {
+        pthread_join(pool.threads[t], NULL);
+    }
+    pthread_cond_destroy(&pool.work_done);
+    pthread_cond_destroy(&pool.work_ready);
+    pthread_mutex_destroy(&pool.mutex);
+}
+
+uint32_t jobs_thread_count()
+{
+    return pool.thread_count;
+}
+
+void jobs_parallel_for(JobFn fn, void* data, uint32_t count,
+        uint32_t min_per_thread)
+{
+    uint32_t slices = count / MAX(min_per_thread, 1);
+    slices = MAX(MIN(slices, pool.thread_count), 1);
+    if (slices == 1) {
+        fn(data, 0, count, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&pool.mutex);
+    pool.fn = fn;
+    pool.data = data;
+    pool.count = count;
+    pool.slice_count = slices;
+    pool.pending = pool.thread_count - 1;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.work_ready);
+    pthread_mutex_unlock(&pool.mutex);
+
+    run_slice(0);
+
+    pthread_mutex_lock(&pool.mutex);
+    while (pool.pending) pthread_cond_wait(&pool.work_done, &pool.mutex);
+    pthread_mutex_unlock(&pool.mutex);
+}
@@ -0,0 +1,24 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stdint.h>
+
+#define MAX_JOB_THREADS 16
+
+// Called once per thread with a contiguous slice [begin, end). Slice i
+// always goes to thread i, so per-thread results merged in thread order are
+// deterministic. Allocation takes a global lock, so per frame jobs must not
+// allocate.
+typedef void (*JobFn)(void* data, uint32_t begin, uint32_t end,
+        uint32_t thread);
+
+// thread_count 0 uses one thread per core, the calling thread included
+void jobs_init(uint32_t thread_count);
+void jobs_shutdown();
+uint32_t jobs_thread_count();
+// Runs fn over [0, count) and returns when every slice is done. Slices are
+// at least min_per_thread long, so small counts run on the calling thread.
+void jobs_parallel_for(JobFn fn, void* data, uint32_t count,
+        uint32_t min_per_thread);
+
+#endif
@@ -0,0 +1,273 @@
+#include <string.h>
+#include "ktx2.h"
+#include "utils.h"
+#include "alloc.h"
+
+static const uint8_t KTX2_IDENTIFIER[12] = {
+    0xab, 'K', 'T', 'X', ' ', '2', '0', 0xbb, '\r', '\n', 0x1a, '\n'
+};
+
+// Identifier, 9 header words, then the index up to the level index
+#define KTX2_HEADER_SIZE 48
+#define KTX2_INDEX_SIZE 32
+#define KTX2_LEVEL_INDEX_ENTRY_SIZE 24
+
+// Data format descriptor values of the Khronos data format spec
+#define DF_MODEL_RGBSDA 1
+#define DF_MODEL_BC1A 128
+#define DF_MODEL_BC3 130
+#define DF_MODEL_BC7 134
+#define DF_PRIMARIES_BT709 1
+#define DF_TRANSFER_SRGB 2
+#define DF_CHANNEL_RED 0
+#define DF_CHANNEL_GREEN 1
+#define DF_CHANNEL_BLUE 2
+#define DF_CHANNEL_COLOR 0
+#define DF_CHANNEL_ALPHA 15
+#define DF_SAMPLE_LINEAR 0x10
+
+static uint32_t read_u32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t read_u64(const uint8_t* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+size_t ktx2_level_size(uint32_t vk_format, uint32_t width, uint32_t height)
+{
+    size_t blocks = (size_t) ((width + 3) / 4) * ((height + 3) / 4);
+    switch (vk_format) {
+    case KTX2_FORMAT_R8G8B8A8_SRGB: return (size_t) width * height * 4;
+    case KTX2_FORMAT_BC1_RGB_SRGB: return blocks * 8;
+    case KTX2_FORMAT_BC3_SRGB: return blocks * 16;
+    case KTX2_FORMAT_BC7_SRGB: return blocks * 16;
+    default: return 0;
+    }
+}
+
+// Levels of a full mip chain, floor(log2(max(width, height))) + 1
+static uint32_t full_level_count(uint32_t width, uint32_t height)
+{
+    uint32_t levels = 1;
+    for (uint32_t size = MAX(width, height); size > 1; size >>= 1) levels++;
+    return levels;
+}
+
+bool ktx2_parse(const void* data, size_t size, Ktx2* o_ktx2)
+{
+    const uint8_t* bytes = data;
+    if (size < KTX2_HEADER_SIZE + KTX2_INDEX_SIZE ||
+            memcmp(bytes, KTX2_IDENTIFIER, sizeof(KTX2_IDENTIFIER))) {
+        errprint("Not a KTX2 file.\n");
+        return false;
+    }
+    const uint8_t* header = bytes + sizeof(KTX2_IDENTIFIER);
+    uint32_t vk_format = read_u32(header);
+    uint32_t width = read_u32(header + 8);
+    uint32_t height = read_u32(header + 12);
+    uint32_t depth = read_u32(header + 16);
+    uint32_t layer_count = read_u32(header + 20);
+    uint32_t face_count = read_u32(header + 24);
+    uint32_t level_count = read_u32(header + 28);
+    uint32_t supercompression = read_u32(header + 32);
+    if (supercompression != 0) {
+        errprint("Supercompressed KTX2 textures are not supported.\n");
+        return false;
+    }
+    if (ktx2_level_size(vk_format, 1, 1) == 0) {
+        errprint("Unsupported KTX2 texture format.\n");
+        return false;
+    }
+    if (width == 0 || height == 0 || depth != 0 || layer_count > 1 ||
+            face_count != 1) {
+        errprint("Only 2D KTX2 textures are supported.\n");
+        return false;
+    }
+    // 0 asks the loader to generate the levels, only the first is stored
+    o_ktx2->generate_levels = level_count == 0;
+    level_count = MAX(level_count, 1);
+    if (level_count > KTX2_MAX_LEVELS ||
+            level_count > full_level_count(width, height) ||
+            KTX2_HEADER_SIZE + KTX2_INDEX_SIZE +
+            level_count * KTX2_LEVEL_INDEX_ENTRY_SIZE > size) {
+        errprint("Bad KTX2 level index.\n");
+        return false;
+    }
+
+    o_ktx2->vk_format = vk_format;
+    o_ktx2->width = width;
+    o_ktx2->height = height;
+    o_ktx2->level_count = level_count;
+    const uint8_t* level_index = bytes + KTX2_HEADER_SIZE + KTX2_INDEX_SIZE;
+    for (uint32_t l=0; l < level_count; l++) {
+        const uint8_t* entry = level_index + l * KTX2_LEVEL_INDEX_ENTRY_SIZE;
+        uint64_t offset = read_u64(entry);
+        uint64_t length = read_u64(entry + 8);
+        if (offset > size || length > size - offset) {
+            errprint("Bad KTX2 level range.\n");
+            return false;
+        }
+        if (length != ktx2_level_size(vk_format,
+                    MAX(width >> l, 1), MAX(height >> l, 1))) {
+            errprint("KTX2 level size does not match its format.\n");
+            return false;
+        }
+        o_ktx2->levels[l].data = bytes + offset;
+        o_ktx2->levels[l].size = length;
+    }
+    return true;
+}
+
+static void put_u32(uint8_t* p, uint32_t v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+static void put_u64(uint8_t* p, uint64_t v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+typedef struct DfdSample {
+    uint32_t bit_offset;
+    uint32_t bit_length;
+    uint32_t channel;
+    uint32_t upper;
+} DfdSample;
+
+// Writes the basic descriptor block with its total size word in front,
+// returns its size. dst may be NULL to measure.
+static size_t write_dfd(uint8_t* dst, uint32_t vk_format)
+{
+    uint32_t model;
+    uint32_t block_dimension = 0; // Each byte is the dimension minus 1
+    uint32_t block_bytes;
+    DfdSample samples[4];
+    uint32_t sample_count;
+    switch (vk_format) {
+    case KTX2_FORMAT_R8G8B8A8_SRGB:
+        model = DF_MODEL_RGBSDA;
+        block_bytes = 4;
+        samples[0] = (DfdSample) {0, 8, DF_CHANNEL_RED, 255};
+        samples[1] = (DfdSample) {8, 8, DF_CHANNEL_GREEN, 255};
+        samples[2] = (DfdSample) {16, 8, DF_CHANNEL_BLUE, 255};
+        samples[3] = (DfdSample) {24, 8,
+            DF_CHANNEL_ALPHA | DF_SAMPLE_LINEAR, 255};
+        sample_count = 4;
+        break;
+    case KTX2_FORMAT_BC1_RGB_SRGB:
+        model = DF_MODEL_BC1A;
+        block_dimension = 3 | 3 << 8;
+        block_bytes = 8;
+        samples[0] = (DfdSample) {0, 64, DF_CHANNEL_COLOR, UINT32_MAX};
+        sample_count = 1;
+        break;
+    case KTX2_FORMAT_BC3_SRGB:
+        model = DF_MODEL_BC3;
+        block_dimension = 3 | 3 << 8;
+        block_bytes = 16;
+        samples[0] = (DfdSample) {0, 64,
+            DF_CHANNEL_ALPHA | DF_SAMPLE_LINEAR, UINT32_MAX};
+        samples[1] = (DfdSample) {64, 64, DF_CHANNEL_COLOR, UINT32_MAX};
+        sample_count = 2;
+        break;
+    case KTX2_FORMAT_BC7_SRGB:
+        model = DF_MODEL_BC7;
+        block_dimension = 3 | 3 << 8;
+        block_bytes = 16;
+        samples[0] = (DfdSample) {0, 128, DF_CHANNEL_COLOR, UINT32_MAX};
+        sample_count = 1;
+        break;
+    default:
+        fatal("No KTX2 data format descriptor for the format.");
+        return 0;
+    }
+
+    uint32_t block_size = 24 + 16 * sample_count;
+    if (!dst) return 4 + block_size;
+    memset(dst, 0, 4 + block_size);
+    put_u32(dst, 4 + block_size);
+    put_u32(dst + 4, 0); // Khronos vendor, basic descriptor type
+    put_u32(dst + 8, 2 | block_size << 16);
+    put_u32(dst + 12, model | DF_PRIMARIES_BT709 << 8 |
+            DF_TRANSFER_SRGB << 16);
+    put_u32(dst + 16, block_dimension);
+    put_u32(dst + 20, block_bytes);
+    for (uint32_t s=0; s < sample_count; s++) {
+        uint8_t* sample = dst + 28 + 16 * s;
+        put_u32(sample, samples[s].bit_offset |
+                (samples[s].bit_length - 1) << 16 | samples[s].channel << 24);
+        put_u32(sample + 12, samples[s].upper);
+    }
+    return 4 + block_size;
+}
+
+// Level data offsets are aligned to the block size and to 4 bytes
+static size_t level_alignment(uint32_t vk_format)
+{
+    switch (vk_format) {
+    case KTX2_FORMAT_BC1_RGB_SRGB: return 8;
+    case KTX2_FORMAT_BC3_SRGB: return 16;
+    case KTX2_FORMAT_BC7_SRGB: return 16;
+    default: return 4;
+    }
+}
+
+int ktx2_write(const char* path, const Ktx2* ktx2)
+{
+    DBASSERT(ktx2->level_count >= 1 && ktx2->level_count <= KTX2_MAX_LEVELS);
+    size_t dfd_offset = KTX2_HEADER_SIZE + KTX2_INDEX_SIZE +
+        ktx2->level_count * KTX2_LEVEL_INDEX_ENTRY_SIZE;
+    size_t dfd_size = write_dfd(NULL, ktx2->vk_format);
+
+    // Levels are stored smallest first
+    size_t alignment = level_alignment(ktx2->vk_format);
+    size_t offsets[KTX2_MAX_LEVELS];
+    size_t size = dfd_offset + dfd_size;
+    for (uint32_t l=ktx2->level_count; l-- > 0;) {
+        size = (size + alignment - 1) / alignment * alignment;
+        offsets[l] = size;
+        size += ktx2->levels[l].size;
+    }
+
+    uint8_t* file_data = malloc_nofail(size);
+    memset(file_data, 0, size);
+    memcpy(file_data, KTX2_IDENTIFIER, sizeof(KTX2_IDENTIFIER));
+    uint8_t* header = file_data + sizeof(KTX2_IDENTIFIER);
+    put_u32(header, ktx2->vk_format);
+    put_u32(header + 4, 1); // typeSize, 1 for bytes and blocks alike
+    put_u32(header + 8, ktx2->width);
+    put_u32(header + 12, ktx2->height);
+    put_u32(header + 24, 1); // faceCount
+    put_u32(header + 28, ktx2->level_count);
+
+    uint8_t* index = file_data + KTX2_HEADER_SIZE;
+    put_u32(index, dfd_offset);
+    put_u32(index + 4, dfd_size);
+    uint8_t* level_index = index + KTX2_INDEX_SIZE;
+    for (uint32_t l=0; l < ktx2->level_count; l++) {
+        uint8_t* entry = level_index + l * KTX2_LEVEL_INDEX_ENTRY_SIZE;
+        put_u64(entry, offsets[l]);
+        put_u64(entry + 8, ktx2->levels[l].size);
+        put_u64(entry + 16, ktx2->levels[l].size);
+        memcpy(file_data + offsets[l], ktx2->levels[l].data,
+                ktx2->levels[l].size);
+    }
+    write_dfd(file_data + dfd_offset, ktx2->vk_format);
+
+    FILE* file = fopen(path, "wb");
+    int result = 1;
+    if (file) {
+        result = fwrite(file_data, size, 1, file) != 1;
+        result |= fclose(file) != 0;
+    }
+    mem_free(file_data);
+    return result;
+}
@@ -0,0 +1,42 @@
+#ifndef KTX2_H
+#define KTX2_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// VkFormat values the cook tool writes, kept here so it needs no Vulkan
+#define KTX2_FORMAT_R8G8B8A8_SRGB 43
+#define KTX2_FORMAT_BC1_RGB_SRGB 132
+#define KTX2_FORMAT_BC3_SRGB 138
+#define KTX2_FORMAT_BC7_SRGB 146
+
+#define KTX2_MAX_LEVELS 16
+
+typedef struct Ktx2Level {
+    const uint8_t* data;
+    size_t size;
+} Ktx2Level;
+
+// A 2D texture, levels[0] is the largest
+typedef struct Ktx2 {
+    uint32_t vk_format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t level_count;
+    // Only level 0 is stored, the loader is asked to generate the rest
+    bool generate_levels;
+    Ktx2Level levels[KTX2_MAX_LEVELS];
+} Ktx2;
+
+// Bytes of a level of the given extent, 0 for formats other than the above
+size_t ktx2_level_size(uint32_t vk_format, uint32_t width, uint32_t height);
+// Points o_ktx2 into data, which must outlive it. Fails on anything but a
+// single layer, single face 2D texture without supercompression in one of
+// the formats above, or when a level's size does not match its extent.
+bool ktx2_parse(const void* data, size_t size, Ktx2* o_ktx2);
+// Writes ktx2 with a data format descriptor for the formats above. Returns
+// 0 on success like read_binary_file.
+int ktx2_write(const char* path, const Ktx2* ktx2);
+
+#endif
@@ -5,8 +5,11 @@
 #include "scene.h"
 #include "render.h"
 #include "collision.h"
+#include "transform.h"
+#include "jobs.h"
 
 #include "cglm/cglm.h"
+#include <string.h>
 
 #define MOVEMENT_SPEED 24
 #define ROTATION_SPEED 0.001
@@ -14,6 +17,9 @@
 #define MLOOK_LIMIT (CGLM_PI/16)
 #define OBJECT_MOVE_SPEED 0.015
 
+#define BENCH_CAMERAS 8
+#define BENCH_FRAMES_PER_CAMERA 32
+
 struct EdState {
     bool lmb_pressed;
     bool rmb_pressed;
@@ -37,12 +43,115 @@ void mouse_button_callback(GLFWwindow* window, int button, int action, int mods)
     }
 }
 
-int main()
+#ifndef RELEASE
+// Camera c of BENCH_CAMERAS on a circle around the scene, looking at its
+// center
+static void bench_camera(vec3 center, float radius, int c,
+        vec3 o_pos, vec3 o_dir)
+{
+    float angle = 2.0 * CGLM_PI * c / BENCH_CAMERAS;
+    glm_vec3_copy((vec3) {center[0] + radius * cosf(angle),
+            center[1] + radius * sinf(angle), center[2] + radius * 0.25f},
+            o_pos);
+    glm_vec3_sub(center, o_pos, o_dir);
+    glm_vec3_normalize(o_dir);
+}
+
+// Renders BENCH_FRAMES_PER_CAMERA frames from each bench camera, with full
+// mip chains and then with the base level only. Prints the culling stats
+// and average GPU frame times of each camera. Stats are read back a frame
+// late, the first frame of a camera is not counted.
+static void bench_render()
+{
+    vec3 center = {0.0f, 0.0f, 0.0f};
+    float radius = 10.0f;
+    AABBTree* tree = &collision_mesh.tree;
+    if (tree->root != AABB_NULL) {
+        AABBNode* root = &tree->nodes[tree->root];
+        glm_vec3_center(root->min, root->max, center);
+        radius = MAX(glm_vec3_distance(root->min, root->max) * 0.5f, 1.0f);
+    }
+    vec3 cam_up = {0.0f, 0.0f, 1.0f};
+    RenderStats camera_stats[BENCH_CAMERAS];
+    float gpu_ms[2][BENCH_CAMERAS];
+    for (int base_mip_only=0; base_mip_only < 2; base_mip_only++) {
+        render_set_base_mip_only(base_mip_only);
+        for (int c=0; c < BENCH_CAMERAS; c++) {
+            vec3 cam_pos;
+            vec3 cam_dir;
+            bench_camera(center, radius, c, cam_pos, cam_dir);
+            RenderStats stats;
+            float total_ms = 0.0f;
+            for (int f=0; f < BENCH_FRAMES_PER_CAMERA; f++) {
+                glfwPollEvents();
+                render_draw_frame(cam_pos, cam_dir, cam_up);
+                if (f == 0) continue;
+                render_get_stats(&stats);
+                total_ms += stats.gpu_ms;
+            }
+            gpu_ms[base_mip_only][c] =
+                total_ms / (BENCH_FRAMES_PER_CAMERA - 1);
+            if (!base_mip_only) camera_stats[c] = stats;
+        }
+    }
+    render_set_base_mip_only(false);
+
+    size_t clusters_culled = 0;
+    size_t frustum_culled = 0;
+    size_t backface_culled = 0;
+    size_t cluster_triangles = 0;
+    for (int c=0; c < BENCH_CAMERAS; c++) {
+        RenderStats* stats = &camera_stats[c];
+        printf("camera %d: drawn %u, culled %u, clusters %u of %u culled, "
+                "triangles culled %u by frustum, %u backfacing of %u\n",
+                c, stats->nodes_drawn, stats->nodes_culled,
+                stats->clusters_culled, stats->clusters,
+                stats->frustum_culled_triangles,
+                stats->backface_culled_triangles, stats->cluster_triangles);
+        printf("camera %d: GPU %.3f ms with mip chains, %.3f ms with the "
+                "base level only\n", c, gpu_ms[0][c], gpu_ms[1][c]);
+        clusters_culled += stats->clusters_culled;
+        frustum_culled += stats->frustum_culled_triangles;
+        backface_culled += stats->backface_culled_triangles;
+        cluster_triangles += stats->cluster_triangles;
+    }
+    printf("total: %zu clusters culled, triangles culled %zu by frustum, "
+            "%zu backfacing of %zu\n", clusters_culled, frustum_culled,
+            backface_culled, cluster_triangles);
+}
+#endif
+
+int main(int argc, char** argv)
 {
     mem_init(MBS(24));
 
+#ifndef RELEASE
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        transform_benchmark();
+        mem_shutdown();
+        return EXIT_SUCCESS;
+    }
+#endif
+
+    jobs_init(0);
     render_init();
+    scene.compact_vertices = false;
+    bool bench = false;
+    for (int i=1; i < argc; i++) {
+        if (strcmp(argv[i], "--compact-vertices") == 0) {
+            scene.compact_vertices = true;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            render_set_print_stats(true);
+        }
+#ifndef RELEASE
+        if (strcmp(argv[i], "--bench-render") == 0) bench = true;
+#endif
+    }
     load_scene();
+    collision_build(&collision_mesh, &scene);
+#ifndef RELEASE
+    if (bench) bench_render();
+#endif
 
     vec3 cam_pos = {0.0f, 0.0f, 0.0f};
     vec3 cam_dir = {1.0f, 0.0f, 0.0f};
@@ -52,8 +161,11 @@ int main()
     double mouse_y;
     glfwGetCursorPos(g_window, &mouse_x, &mouse_y);
     glfwSetMouseButtonCallback(g_window, mouse_button_callback);
+#ifndef RELEASE
+    double gpu_pick_request_time = 0.0;
+#endif
     // Main loop
-    while (!render_exit()) {
+    while (!bench && !render_exit()) {
         int frame_width;
         int frame_height;
         glfwGetFramebufferSize(g_window, &frame_width, &frame_height);
@@ -77,29 +189,72 @@ int main()
         vec3 side;
         glm_vec3_cross(cam_dir, cam_up, side);
 
+#ifndef RELEASE
+        PickResult pick_result;
+        while (render_poll_pick(&pick_result)) {
+            printf("GPU pick: %u in %.3f ms\n",
+                    pick_result.code_count ? pick_result.codes[0] : 0,
+                    (glfwGetTime() - gpu_pick_request_time) * 1000.0);
+        }
+#endif
+
         if (ed_state.lmb_pressed) {
             ed_state.lmb_pressed = false;
-            if (!ed_state.sel_object) {
-                uint32_t code = get_object_code(frame_width/2, frame_height/2);
-                if (code > 0) {
+            if (!ed_state.sel_object && !ed_state.sel_light) {
+                uint32_t cursor_x = frame_width/2;
+                uint32_t cursor_y = frame_height/2;
+#ifndef RELEASE
+                double pick_start = glfwGetTime();
+#endif
+                vec3 ray_origin;
+                vec3 ray_dir;
+                render_cursor_ray(cursor_x, cursor_y, cam_pos, cam_dir, cam_up,
+                        ray_origin, ray_dir);
+                uint32_t code = collision_pick(
+                        &collision_mesh, &scene, ray_origin, ray_dir);
+#ifndef RELEASE
+                double cpu_pick_time = glfwGetTime() - pick_start;
+                printf("CPU pick: %u in %.3f ms\n",
+                        code, cpu_pick_time * 1000.0);
+                gpu_pick_request_time = glfwGetTime();
+                render_request_pick(cursor_x, cursor_y, 1, 1);
+#endif
+                if (code >= LIGHT_ID_OFFSET) {
+                    ed_state.sel_light = &scene.lights[code - LIGHT_ID_OFFSET];
+                } else if (code > 0) {
                     ed_state.sel_object = &scene.nodes[code-1];
                 }
             } else {
                 ed_state.sel_object = NULL;
+                ed_state.sel_light = NULL;
             }
         }
 
-        if (ed_state.sel_object) {
+        if (ed_state.sel_object || ed_state.sel_light) {
             vec3 current_up;
             glm_vec3_cross(cam_dir, side, current_up);
             vec3 offset_up;
             glm_vec3_scale(current_up, OBJECT_MOVE_SPEED * mouse_dy, offset_up);
             vec3 offset_side;
             glm_vec3_scale(side, OBJECT_MOVE_SPEED * mouse_dx, offset_side);
-            glm_vec3_add(ed_state.sel_object->translation, offset_up,
-                    ed_state.sel_object->translation);
-            glm_vec3_add(ed_state.sel_object->translation, offset_side,
-                    ed_state.sel_object->translation);
+            bool moved = mouse_dx != 0.0 || mouse_dy != 0.0;
+            if (ed_state.sel_object) {
+                float* translation = scene.hierarchy.translation[
+                    ed_state.sel_object->transform];
+                glm_vec3_add(translation, offset_up, translation);
+                glm_vec3_add(translation, offset_side, translation);
+                if (moved) {
+                    node_mark_dirty(&scene, ed_state.sel_object);
+                    scene_update_transforms(&scene);
+                    collision_update_node(
+                            &collision_mesh, &scene, ed_state.sel_object);
+                }
+            } else {
+                float* pos = ed_state.sel_light->pos;
+                glm_vec3_add(pos, offset_up, pos);
+                glm_vec3_add(pos, offset_side, pos);
+                if (moved) render_update_lights();
+            }
         } else {
             // Mouselook
             glm_vec3_rotate(cam_dir, -mouse_dx * ROTATION_SPEED, cam_up);
@@ -136,7 +291,9 @@ int main()
         render_draw_frame(cam_pos, cam_dir, cam_up);
     }
 
+    destroy_collision_mesh(&collision_mesh);
     render_destroy();
+    jobs_shutdown();
 
     mem_check();
     mem_inspect();
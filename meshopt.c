@@ -0,0 +1,810 @@
+#include <float.h>
+#include <math.h>
+#include <string.h>
+#include "meshopt.h"
+#include "alloc.h"
+#include "sort.h"
+#include "utils.h"
+
+// Valences above this are scored with the last entry
+#define MAX_SCORED_VALENCE 32
+
+// Words of a weld key: position, then the exact bits of uv and normal
+#define WELD_KEY_WORDS 8
+
+static uint32_t hash_weld_key(const uint32_t* key)
+{
+    uint32_t hash = 2166136261u;
+    for (int w=0; w < WELD_KEY_WORDS; w++) {
+        hash ^= key[w];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Grid cells stay clear of the int32 limits so neighbours don't overflow
+#define WELD_MAX_CELL 1073741824.0f
+
+// Index of the vertex stored under key, UINT32_MAX if none. o_slot is where
+// it would go.
+static uint32_t find_weld_key(const uint32_t* table, size_t table_size,
+        const uint32_t* keys, const uint32_t* key, size_t* o_slot)
+{
+    size_t slot = hash_weld_key(key) & (table_size - 1);
+    while (table[slot] != UINT32_MAX && memcmp(key,
+                &keys[table[slot] * WELD_KEY_WORDS],
+                sizeof(uint32_t) * WELD_KEY_WORDS)) {
+        slot = (slot + 1) & (table_size - 1);
+    }
+    *o_slot = slot;
+    return table[slot];
+}
+
+size_t meshopt_weld(Vertex* vertices, size_t vertex_count, uint32_t* indices,
+        size_t index_count, float epsilon)
+{
+    uint32_t* keys =
+        malloc_nofail(sizeof(uint32_t) * WELD_KEY_WORDS * MAX(vertex_count, 1));
+    for (size_t v=0; v < vertex_count; v++) {
+        uint32_t* key = &keys[v * WELD_KEY_WORDS];
+        Vertex* vertex = &vertices[v];
+        if (epsilon > 0.0f) {
+            for (int c=0; c < 3; c++) {
+                float cell = floorf(vertex->position[c] / epsilon);
+                cell = fminf(fmaxf(cell, -WELD_MAX_CELL), WELD_MAX_CELL);
+                key[c] = (uint32_t) (int32_t) cell;
+            }
+        } else {
+            memcpy(&key[0], vertex->position, sizeof(vec3));
+        }
+        memcpy(&key[3], vertex->tex_coord, sizeof(vec2));
+        memcpy(&key[5], vertex->normal, sizeof(vec3));
+    }
+
+    // Open addressing, at most half full. Holds the kept vertices, at most
+    // one per cell since any two in a cell are within epsilon.
+    size_t table_size = 1;
+    while (table_size < vertex_count * 2) table_size *= 2;
+    uint32_t* table = malloc_nofail(sizeof(uint32_t) * table_size);
+    memset(table, 0xff, sizeof(uint32_t) * table_size);
+    uint32_t* remap = malloc_nofail(sizeof(uint32_t) * MAX(vertex_count, 1));
+    // Near duplicates may round to either side of a cell boundary, so the
+    // neighbouring cells are probed too
+    int neighbours = epsilon > 0.0f ? 27 : 1;
+    size_t kept = 0;
+    for (size_t v=0; v < vertex_count; v++) {
+        uint32_t* key = &keys[v * WELD_KEY_WORDS];
+        size_t slot;
+        uint32_t match = find_weld_key(table, table_size, keys, key, &slot);
+        size_t own_slot = slot;
+        for (int n=0; n < neighbours && match == UINT32_MAX; n++) {
+            if (n == 13) continue; // The own cell, probed above
+            uint32_t probe[WELD_KEY_WORDS];
+            memcpy(probe, key, sizeof(probe));
+            probe[0] += n % 3 - 1;
+            probe[1] += n / 3 % 3 - 1;
+            probe[2] += n / 9 - 1;
+            uint32_t found = find_weld_key(table, table_size, keys, probe,
+                    &slot);
+            if (found == UINT32_MAX) continue;
+            const float* a = vertices[remap[found]].position;
+            const float* b = vertices[v].position;
+            if (fabsf(a[0] - b[0]) <= epsilon &&
+                    fabsf(a[1] - b[1]) <= epsilon &&
+                    fabsf(a[2] - b[2]) <= epsilon) match = found;
+        }
+        if (match == UINT32_MAX) {
+            table[own_slot] = v;
+            // Kept vertices only move down, never over one not yet read
+            vertices[kept] = vertices[v];
+            remap[v] = kept++;
+        } else {
+            remap[v] = remap[match];
+        }
+    }
+    for (size_t i=0; i < index_count; i++) indices[i] = remap[indices[i]];
+
+    mem_free(remap);
+    mem_free(table);
+    mem_free(keys);
+    return kept;
+}
+
+float meshopt_acmr(const uint32_t* indices, size_t index_count,
+        size_t vertex_count, uint32_t cache_size)
+{
+    size_t triangle_count = index_count / 3;
+    if (!triangle_count) return 0.0f;
+    // A vertex is cached while fewer than cache_size misses came after it
+    uint32_t* timestamps = malloc_nofail(sizeof(uint32_t) * vertex_count);
+    memset(timestamps, 0, sizeof(uint32_t) * vertex_count);
+    uint32_t time = cache_size + 1;
+    uint32_t misses = 0;
+    for (size_t i=0; i < index_count; i++) {
+        uint32_t v = indices[i];
+        if (time - timestamps[v] > cache_size) {
+            timestamps[v] = time++;
+            misses++;
+        }
+    }
+    mem_free(timestamps);
+    return (float) misses / triangle_count;
+}
+
+void meshopt_optimize_vertex_cache(uint32_t* dst, const uint32_t* indices,
+        size_t index_count, size_t vertex_count)
+{
+    size_t triangle_count = index_count / 3;
+    if (!triangle_count) return;
+
+    // Recently used vertices score higher, except the last triangle's,
+    // which would only yield degenerate strips. Vertices with few
+    // triangles left score higher so no lonely triangles are left behind.
+    float cache_scores[MESHOPT_CACHE_SIZE];
+    for (int c=0; c < MESHOPT_CACHE_SIZE; c++) {
+        cache_scores[c] = c < 3 ? 0.75f : powf(1.0f - (float) (c - 3) /
+                (MESHOPT_CACHE_SIZE - 3), 1.5f);
+    }
+    float valence_scores[MAX_SCORED_VALENCE + 1];
+    valence_scores[0] = 0.0f;
+    for (int v=1; v <= MAX_SCORED_VALENCE; v++) {
+        valence_scores[v] = 2.0f / sqrtf((float) v);
+    }
+
+    // Triangles of every vertex, the first remaining[v] are not emitted
+    uint32_t* remaining = malloc_nofail(sizeof(uint32_t) * vertex_count);
+    uint32_t* offsets = malloc_nofail(sizeof(uint32_t) * (vertex_count + 1));
+    uint32_t* adjacency = malloc_nofail(sizeof(uint32_t) * index_count);
+    memset(remaining, 0, sizeof(uint32_t) * vertex_count);
+    for (size_t i=0; i < index_count; i++) remaining[indices[i]]++;
+    uint32_t offset = 0;
+    for (size_t v=0; v < vertex_count; v++) {
+        offsets[v] = offset;
+        offset += remaining[v];
+        remaining[v] = 0;
+    }
+    offsets[vertex_count] = offset;
+    for (size_t i=0; i < index_count; i++) {
+        uint32_t v = indices[i];
+        adjacency[offsets[v] + remaining[v]++] = i / 3;
+    }
+
+    int32_t* cache_positions = malloc_nofail(sizeof(int32_t) * vertex_count);
+    float* scores = malloc_nofail(sizeof(float) * vertex_count);
+    for (size_t v=0; v < vertex_count; v++) {
+        cache_positions[v] = -1;
+        scores[v] = valence_scores[MIN(remaining[v], MAX_SCORED_VALENCE)];
+    }
+    uint8_t* emitted = malloc_nofail(sizeof(uint8_t) * triangle_count);
+    memset(emitted, 0, sizeof(uint8_t) * triangle_count);
+
+    // Three slots for the vertices pushed in before the oldest drop out
+    uint32_t cache[MESHOPT_CACHE_SIZE + 3];
+    uint32_t new_cache[MESHOPT_CACHE_SIZE + 3];
+    uint32_t cache_count = 0;
+    size_t cursor = 0;
+    int64_t best = -1;
+    for (size_t out=0; out < triangle_count; out++) {
+        // Nothing in the cache has triangles left, take the next in order
+        if (best < 0) {
+            while (emitted[cursor]) cursor++;
+            best = cursor;
+        }
+        const uint32_t* triangle = &indices[best * 3];
+        memcpy(&dst[out * 3], triangle, sizeof(uint32_t) * 3);
+        emitted[best] = 1;
+
+        uint32_t new_count = 0;
+        for (int k=0; k < 3; k++) {
+            uint32_t v = triangle[k];
+            uint32_t* list = &adjacency[offsets[v]];
+            for (uint32_t j=0; j < remaining[v]; j++) {
+                if (list[j] != best) continue;
+                list[j] = list[remaining[v] - 1];
+                break;
+            }
+            remaining[v]--;
+            new_cache[new_count++] = v;
+        }
+        for (uint32_t c=0; c < cache_count; c++) {
+            uint32_t v = cache[c];
+            if (v != triangle[0] && v != triangle[1] && v != triangle[2])
+                new_cache[new_count++] = v;
+        }
+        for (uint32_t c=MESHOPT_CACHE_SIZE; c < new_count; c++) {
+            uint32_t v = new_cache[c];
+            cache_positions[v] = -1;
+            scores[v] = remaining[v] ? valence_scores[
+                MIN(remaining[v], MAX_SCORED_VALENCE)] : -1.0f;
+        }
+        cache_count = MIN(new_count, MESHOPT_CACHE_SIZE);
+        for (uint32_t c=0; c < cache_count; c++) {
+            uint32_t v = new_cache[c];
+            cache[c] = v;
+            cache_positions[v] = c;
+            scores[v] = remaining[v] ? cache_scores[c] + valence_scores[
+                MIN(remaining[v], MAX_SCORED_VALENCE)] : -1.0f;
+        }
+
+        // Only triangles touching the cache changed score
+        best = -1;
+        float best_score = -FLT_MAX;
+        for (uint32_t c=0; c < cache_count; c++) {
+            uint32_t v = cache[c];
+            uint32_t* list = &adjacency[offsets[v]];
+            for (uint32_t j=0; j < remaining[v]; j++) {
+                const uint32_t* t = &indices[list[j] * 3];
+                float score = scores[t[0]] + scores[t[1]] + scores[t[2]];
+                if (score > best_score) {
+                    best_score = score;
+                    best = list[j];
+                }
+            }
+        }
+    }
+
+    mem_free(emitted);
+    mem_free(scores);
+    mem_free(cache_positions);
+    mem_free(adjacency);
+    mem_free(offsets);
+    mem_free(remaining);
+}
+
+// Orders floats as unsigned integers
+static uint32_t float_sort_key(float f)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return bits & 0x80000000u ? ~bits : bits | 0x80000000u;
+}
+
+void meshopt_optimize_overdraw(uint32_t* dst, const uint32_t* indices,
+        size_t index_count, const Vertex* vertices, size_t vertex_count,
+        float threshold)
+{
+    size_t triangle_count = index_count / 3;
+    if (!triangle_count) return;
+
+    // Misses per triangle with the cache warm from the triangles before it
+    uint8_t* misses = malloc_nofail(sizeof(uint8_t) * triangle_count);
+    uint32_t* timestamps = malloc_nofail(sizeof(uint32_t) * vertex_count);
+    memset(timestamps, 0, sizeof(uint32_t) * vertex_count);
+    uint32_t time = MESHOPT_FIFO_SIZE + 1;
+    for (size_t t=0; t < triangle_count; t++) {
+        misses[t] = 0;
+        for (int k=0; k < 3; k++) {
+            uint32_t v = indices[t * 3 + k];
+            if (time - timestamps[v] <= MESHOPT_FIFO_SIZE) continue;
+            timestamps[v] = time++;
+            misses[t]++;
+        }
+    }
+
+    // Hard boundaries are where the cache misses a whole triangle. In
+    // between, a cluster may end wherever its cold cache ACMR is within
+    // threshold of the warm ACMR of its hard cluster.
+    uint32_t* clusters = malloc_nofail(sizeof(uint32_t) * (triangle_count + 1));
+    uint32_t cluster_count = 0;
+    size_t start = 0;
+    while (start < triangle_count) {
+        size_t end = start + 1;
+        uint32_t hard_misses = misses[start];
+        while (end < triangle_count && misses[end] < 3) {
+            hard_misses += misses[end++];
+        }
+        float hard_acmr = (float) hard_misses / (end - start);
+
+        clusters[cluster_count++] = start;
+        time += MESHOPT_FIFO_SIZE + 1;
+        size_t cluster_start = start;
+        uint32_t cluster_misses = 0;
+        for (size_t t=start; t < end; t++) {
+            for (int k=0; k < 3; k++) {
+                uint32_t v = indices[t * 3 + k];
+                if (time - timestamps[v] <= MESHOPT_FIFO_SIZE) continue;
+                timestamps[v] = time++;
+                cluster_misses++;
+            }
+            if (t + 1 < end && cluster_misses <=
+                    threshold * hard_acmr * (t + 1 - cluster_start)) {
+                clusters[cluster_count++] = t + 1;
+                time += MESHOPT_FIFO_SIZE + 1;
+                cluster_start = t + 1;
+                cluster_misses = 0;
+            }
+        }
+        start = end;
+    }
+    clusters[cluster_count] = triangle_count;
+    mem_free(timestamps);
+    mem_free(misses);
+
+    // Area weighted centroids, the mesh's and the clusters'
+    vec3* centroids = malloc_nofail(sizeof(vec3) * cluster_count);
+    vec3* normals = malloc_nofail(sizeof(vec3) * cluster_count);
+    vec3 mesh_centroid = {0.0f, 0.0f, 0.0f};
+    float mesh_area = 0.0f;
+    for (uint32_t c=0; c < cluster_count; c++) {
+        glm_vec3_zero(centroids[c]);
+        glm_vec3_zero(normals[c]);
+        float cluster_area = 0.0f;
+        for (uint32_t t=clusters[c]; t < clusters[c + 1]; t++) {
+            const float* p0 = vertices[indices[t * 3 + 0]].position;
+            const float* p1 = vertices[indices[t * 3 + 1]].position;
+            const float* p2 = vertices[indices[t * 3 + 2]].position;
+            vec3 e1, e2, normal, center;
+            glm_vec3_sub((float*) p1, (float*) p0, e1);
+            glm_vec3_sub((float*) p2, (float*) p0, e2);
+            glm_vec3_cross(e1, e2, normal);
+            float area = glm_vec3_norm(normal);
+            glm_vec3_add((float*) p0, (float*) p1, center);
+            glm_vec3_add(center, (float*) p2, center);
+            glm_vec3_muladds(center, area / 3.0f, centroids[c]);
+            glm_vec3_add(normals[c], normal, normals[c]);
+            cluster_area += area;
+        }
+        glm_vec3_add(mesh_centroid, centroids[c], mesh_centroid);
+        mesh_area += cluster_area;
+        if (cluster_area > 0.0f) {
+            glm_vec3_scale(centroids[c], 1.0f / cluster_area, centroids[c]);
+        }
+    }
+    if (mesh_area > 0.0f) {
+        glm_vec3_scale(mesh_centroid, 1.0f / mesh_area, mesh_centroid);
+    }
+
+    // Clusters facing away from the centroid first
+    uint64_t* keys = malloc_nofail(sizeof(uint64_t) * cluster_count);
+    uint64_t* scratch = malloc_nofail(sizeof(uint64_t) * cluster_count);
+    for (uint32_t c=0; c < cluster_count; c++) {
+        vec3 offset;
+        glm_vec3_sub(centroids[c], mesh_centroid, offset);
+        glm_vec3_normalize(normals[c]);
+        float facing = glm_vec3_dot(offset, normals[c]);
+        keys[c] = (uint64_t) float_sort_key(-facing) << 32 | c;
+    }
+    radix_sort_u64(keys, scratch, cluster_count);
+
+    size_t out = 0;
+    for (uint32_t k=0; k < cluster_count; k++) {
+        uint32_t c = keys[k] & UINT32_MAX;
+        size_t count = (clusters[c + 1] - clusters[c]) * 3;
+        memcpy(&dst[out], &indices[clusters[c] * 3], sizeof(uint32_t) * count);
+        out += count;
+    }
+
+    mem_free(scratch);
+    mem_free(keys);
+    mem_free(normals);
+    mem_free(centroids);
+    mem_free(clusters);
+}
+
+void meshopt_optimize_vertex_fetch(Vertex* vertices, size_t vertex_count,
+        uint32_t* indices, size_t index_count)
+{
+    uint32_t* remap = malloc_nofail(sizeof(uint32_t) * vertex_count);
+    memset(remap, 0xff, sizeof(uint32_t) * vertex_count);
+    uint32_t next = 0;
+    for (size_t i=0; i < index_count; i++) {
+        uint32_t v = indices[i];
+        if (remap[v] == UINT32_MAX) remap[v] = next++;
+        indices[i] = remap[v];
+    }
+    for (size_t v=0; v < vertex_count; v++) {
+        if (remap[v] == UINT32_MAX) remap[v] = next++;
+    }
+
+    Vertex* original = malloc_nofail(sizeof(Vertex) * vertex_count);
+    memcpy(original, vertices, sizeof(Vertex) * vertex_count);
+    for (size_t v=0; v < vertex_count; v++) {
+        vertices[remap[v]] = original[v];
+    }
+    mem_free(original);
+    mem_free(remap);
+}
+
+void meshopt_optimize_primitive(Vertex* vertices, size_t vertex_count,
+        uint32_t* indices, size_t index_count, bool overdraw)
+{
+    if (index_count < 3) return;
+    uint32_t* ordered = malloc_nofail(sizeof(uint32_t) * index_count);
+    meshopt_optimize_vertex_cache(ordered, indices, index_count, vertex_count);
+    if (overdraw) {
+        meshopt_optimize_overdraw(indices, ordered, index_count,
+                vertices, vertex_count, MESHOPT_OVERDRAW_THRESHOLD);
+    } else {
+        memcpy(indices, ordered, sizeof(uint32_t) * index_count);
+    }
+    mem_free(ordered);
+    meshopt_optimize_vertex_fetch(vertices, vertex_count, indices, index_count);
+}
+
+// Sphere around the box of the meshlet's vertices and the cone around its
+// triangle normals
+static void meshlet_bounds(const Vertex* vertices, const uint32_t* indices,
+        Meshlet* meshlet)
+{
+    const uint32_t* tri = &indices[meshlet->first_index];
+    vec3 min = {FLT_MAX, FLT_MAX, FLT_MAX};
+    vec3 max = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    for (uint32_t i=0; i < meshlet->index_count; i++) {
+        glm_vec3_minv(min, (float*) vertices[tri[i]].position, min);
+        glm_vec3_maxv(max, (float*) vertices[tri[i]].position, max);
+    }
+    glm_vec3_center(min, max, meshlet->center);
+    float radius_sq = 0.0f;
+    for (uint32_t i=0; i < meshlet->index_count; i++) {
+        radius_sq = MAX(radius_sq, glm_vec3_distance2(meshlet->center,
+                    (float*) vertices[tri[i]].position));
+    }
+    meshlet->radius = sqrtf(radius_sq);
+
+    uint32_t triangle_count = meshlet->index_count / 3;
+    vec3 normals[MESHLET_MAX_TRIANGLES];
+    vec3 axis = {0.0f, 0.0f, 0.0f};
+    for (uint32_t t=0; t < triangle_count; t++) {
+        const float* a = vertices[tri[t * 3 + 0]].position;
+        const float* b = vertices[tri[t * 3 + 1]].position;
+        const float* c = vertices[tri[t * 3 + 2]].position;
+        vec3 ab, ac;
+        glm_vec3_sub((float*) b, (float*) a, ab);
+        glm_vec3_sub((float*) c, (float*) a, ac);
+        glm_vec3_cross(ab, ac, normals[t]);
+        float length = glm_vec3_norm(normals[t]);
+        if (length > 0.0f) {
+            glm_vec3_scale(normals[t], 1.0f / length, normals[t]);
+        }
+        glm_vec3_add(axis, normals[t], axis);
+    }
+    glm_vec3_normalize(axis);
+    glm_vec3_copy(axis, meshlet->cone_axis);
+
+    // Degenerate triangles have zero normals and spread the cone fully
+    float min_dot = 1.0f;
+    for (uint32_t t=0; t < triangle_count; t++) {
+        min_dot = MIN(min_dot, glm_vec3_dot(axis, normals[t]));
+    }
+    // Wide cones are never culled, 1 keeps the test from ever passing
+    meshlet->cone_cutoff = min_dot <= 0.1f ?
+        1.0f : sqrtf(1.0f - min_dot * min_dot);
+}
+
+size_t meshopt_build_meshlets(const Vertex* vertices, const uint32_t* indices,
+        size_t index_count, Meshlet* o_meshlets)
+{
+    uint32_t meshlet_vertices[MESHLET_MAX_VERTICES];
+    uint32_t vertex_count = 0;
+    size_t count = 0;
+    Meshlet meshlet = {0};
+    for (size_t i=0; i + 3 <= index_count; i += 3) {
+        // Vertices of the triangle that the meshlet does not have yet
+        uint32_t added[3];
+        uint32_t added_count = 0;
+        for (int c=0; c < 3; c++) {
+            uint32_t index = indices[i + c];
+            bool found = false;
+            for (uint32_t v=0; v < vertex_count && !found; v++) {
+                found = meshlet_vertices[v] == index;
+            }
+            for (uint32_t a=0; a < added_count && !found; a++) {
+                found = added[a] == index;
+            }
+            if (!found) added[added_count++] = index;
+        }
+
+        if (vertex_count + added_count > MESHLET_MAX_VERTICES ||
+                meshlet.index_count == MESHLET_MAX_TRIANGLES * 3) {
+            if (o_meshlets) {
+                meshlet.vertex_count = vertex_count;
+                meshlet_bounds(vertices, indices, &meshlet);
+                o_meshlets[count] = meshlet;
+            }
+            count++;
+            meshlet.first_index = i;
+            meshlet.index_count = 0;
+            vertex_count = 0;
+            // The triangle's vertices are all new to the next meshlet
+            added_count = 0;
+            for (int c=0; c < 3; c++) {
+                uint32_t index = indices[i + c];
+                bool found = false;
+                for (uint32_t a=0; a < added_count && !found; a++) {
+                    found = added[a] == index;
+                }
+                if (!found) added[added_count++] = index;
+            }
+        }
+        for (uint32_t a=0; a < added_count; a++) {
+            meshlet_vertices[vertex_count++] = added[a];
+        }
+        meshlet.index_count += 3;
+    }
+    if (meshlet.index_count) {
+        if (o_meshlets) {
+            meshlet.vertex_count = vertex_count;
+            meshlet_bounds(vertices, indices, &meshlet);
+            o_meshlets[count] = meshlet;
+        }
+        count++;
+    }
+    return count;
+}
+
+// Sum of squared distances to planes, weight counts the planes
+typedef struct Quadric {
+    float a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+    float weight;
+} Quadric;
+
+static void quadric_add_plane(Quadric* q, vec3 n, float d)
+{
+    q->a2 += n[0] * n[0];
+    q->ab += n[0] * n[1];
+    q->ac += n[0] * n[2];
+    q->ad += n[0] * d;
+    q->b2 += n[1] * n[1];
+    q->bc += n[1] * n[2];
+    q->bd += n[1] * d;
+    q->c2 += n[2] * n[2];
+    q->cd += n[2] * d;
+    q->d2 += d * d;
+    q->weight += 1.0f;
+}
+
+static void quadric_add(Quadric* dst, const Quadric* src)
+{
+    dst->a2 += src->a2;
+    dst->ab += src->ab;
+    dst->ac += src->ac;
+    dst->ad += src->ad;
+    dst->b2 += src->b2;
+    dst->bc += src->bc;
+    dst->bd += src->bd;
+    dst->c2 += src->c2;
+    dst->cd += src->cd;
+    dst->d2 += src->d2;
+    dst->weight += src->weight;
+}
+
+// Mean squared distance of p to the planes
+static float quadric_error(const Quadric* q, const float* p)
+{
+    float x = p[0];
+    float y = p[1];
+    float z = p[2];
+    float error = q->a2 * x * x + q->b2 * y * y + q->c2 * z * z + q->d2 +
+        2.0f * (q->ab * x * y + q->ac * x * z + q->bc * y * z +
+                q->ad * x + q->bd * y + q->cd * z);
+    return MAX(error, 0.0f) / MAX(q->weight, 1.0f);
+}
+
+static void triangle_normal(const float* a, const float* b, const float* c,
+        vec3 o_normal)
+{
+    vec3 ab, ac;
+    glm_vec3_sub((float*) b, (float*) a, ab);
+    glm_vec3_sub((float*) c, (float*) a, ac);
+    glm_vec3_cross(ab, ac, o_normal);
+}
+
+// Boundary vertices are on an edge of one triangle, seam vertices share
+// their position with another vertex. Moving either would open cracks.
+static void lock_vertices(const uint32_t* indices, size_t index_count,
+        const Vertex* vertices, size_t vertex_count, uint8_t* o_locked)
+{
+    memset(o_locked, 0, vertex_count);
+    size_t key_count = MAX(index_count, vertex_count);
+    uint64_t* keys = malloc_nofail(sizeof(uint64_t) * MAX(key_count, 1));
+    uint64_t* scratch = malloc_nofail(sizeof(uint64_t) * MAX(key_count, 1));
+
+    for (size_t i=0; i < index_count; i++) {
+        uint32_t a = indices[i];
+        uint32_t b = indices[i % 3 == 2 ? i - 2 : i + 1];
+        keys[i] = (uint64_t) MIN(a, b) << 32 | MAX(a, b);
+    }
+    radix_sort_u64(keys, scratch, index_count);
+    for (size_t i=0; i < index_count; ) {
+        size_t run = 1;
+        while (i + run < index_count && keys[i + run] == keys[i]) run++;
+        if (run == 1) {
+            o_locked[keys[i] >> 32] = 1;
+            o_locked[keys[i] & 0xffffffff] = 1;
+        }
+        i += run;
+    }
+
+    for (size_t v=0; v < vertex_count; v++) {
+        uint32_t bits[3];
+        memcpy(bits, vertices[v].position, sizeof(bits));
+        uint32_t hash = 2166136261u;
+        for (int c=0; c < 3; c++) {
+            hash ^= bits[c];
+            hash *= 16777619u;
+        }
+        keys[v] = (uint64_t) hash << 32 | v;
+    }
+    radix_sort_u64(keys, scratch, vertex_count);
+    for (size_t i=0; i + 1 < vertex_count; i++) {
+        if (keys[i] >> 32 != keys[i + 1] >> 32) continue;
+        uint32_t a = keys[i] & 0xffffffff;
+        uint32_t b = keys[i + 1] & 0xffffffff;
+        if (!memcmp(vertices[a].position, vertices[b].position,
+                    sizeof(vec3))) {
+            o_locked[a] = 1;
+            o_locked[b] = 1;
+        }
+    }
+    mem_free(scratch);
+    mem_free(keys);
+}
+
+// Moves from onto to. Sort keys hold the error bits above the candidate
+// index, errors are positive so their bits sort like the floats.
+typedef struct Collapse {
+    uint32_t from;
+    uint32_t to;
+} Collapse;
+
+size_t meshopt_simplify(uint32_t* dst, const uint32_t* indices,
+        size_t index_count, const Vertex* vertices, size_t vertex_count,
+        size_t target_index_count, float target_error, float* o_error)
+{
+    *o_error = 0.0f;
+    if (dst != indices) memmove(dst, indices, sizeof(uint32_t) * index_count);
+    if (index_count <= target_index_count || !vertex_count) return index_count;
+
+    vec3 min = {FLT_MAX, FLT_MAX, FLT_MAX};
+    vec3 max = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    for (size_t v=0; v < vertex_count; v++) {
+        glm_vec3_minv(min, (float*) vertices[v].position, min);
+        glm_vec3_maxv(max, (float*) vertices[v].position, max);
+    }
+    float attribute_scale =
+        MESHOPT_ATTRIBUTE_WEIGHT * glm_vec3_distance(min, max);
+    float max_error_sq = target_error * target_error;
+
+    Quadric* quadrics = malloc_nofail(sizeof(Quadric) * vertex_count);
+    memset(quadrics, 0, sizeof(Quadric) * vertex_count);
+    for (size_t i=0; i + 3 <= index_count; i += 3) {
+        vec3 n;
+        triangle_normal(vertices[dst[i]].position,
+                vertices[dst[i + 1]].position,
+                vertices[dst[i + 2]].position, n);
+        if (glm_vec3_norm(n) == 0.0f) continue;
+        glm_vec3_normalize(n);
+        float d = -glm_vec3_dot(n, (float*) vertices[dst[i]].position);
+        for (int c=0; c < 3; c++) {
+            quadric_add_plane(&quadrics[dst[i + c]], n, d);
+        }
+    }
+
+    uint8_t* locked = malloc_nofail(vertex_count);
+    lock_vertices(dst, index_count, vertices, vertex_count, locked);
+    uint32_t* remap = malloc_nofail(sizeof(uint32_t) * vertex_count);
+    uint8_t* touched = malloc_nofail(vertex_count);
+    uint32_t* adjacency_offsets =
+        malloc_nofail(sizeof(uint32_t) * (vertex_count + 1));
+    uint32_t* adjacency = malloc_nofail(sizeof(uint32_t) * index_count);
+    // Two per index, one for either direction of its edge
+    Collapse* collapses = malloc_nofail(sizeof(Collapse) * 2 * index_count);
+    uint64_t* keys = malloc_nofail(sizeof(uint64_t) * 2 * index_count);
+    uint64_t* scratch = malloc_nofail(sizeof(uint64_t) * 2 * index_count);
+
+    while (index_count > target_index_count) {
+        // Triangles around every vertex
+        memset(adjacency_offsets, 0, sizeof(uint32_t) * (vertex_count + 1));
+        for (size_t i=0; i < index_count; i++) adjacency_offsets[dst[i] + 1]++;
+        for (size_t v=0; v < vertex_count; v++)
+            adjacency_offsets[v + 1] += adjacency_offsets[v];
+        for (size_t i=0; i < index_count; i++)
+            adjacency[adjacency_offsets[dst[i]]++] = i / 3;
+        for (size_t v=vertex_count; v > 0; v--)
+            adjacency_offsets[v] = adjacency_offsets[v - 1];
+        adjacency_offsets[0] = 0;
+
+        // Both directions of every edge, cheapest first
+        uint32_t collapse_count = 0;
+        for (size_t i=0; i < index_count; i++) {
+            uint32_t from = dst[i];
+            uint32_t to = dst[i % 3 == 2 ? i - 2 : i + 1];
+            for (int direction=0; direction < 2; direction++) {
+                if (!locked[from]) {
+                    Quadric q = quadrics[from];
+                    quadric_add(&q, &quadrics[to]);
+                    float error = quadric_error(&q, vertices[to].position);
+                    float attribute =
+                        glm_vec3_distance2((float*) vertices[from].normal,
+                                (float*) vertices[to].normal) +
+                        glm_vec2_distance2((float*) vertices[from].tex_coord,
+                                (float*) vertices[to].tex_coord);
+                    error += attribute * attribute_scale * attribute_scale;
+                    if (error <= max_error_sq) {
+                        uint32_t error_bits;
+                        memcpy(&error_bits, &error, sizeof(error_bits));
+                        collapses[collapse_count].from = from;
+                        collapses[collapse_count].to = to;
+                        keys[collapse_count] =
+                            (uint64_t) error_bits << 32 | collapse_count;
+                        collapse_count++;
+                    }
+                }
+                uint32_t swap = from;
+                from = to;
+                to = swap;
+            }
+        }
+        if (!collapse_count) break;
+        radix_sort_u64(keys, scratch, collapse_count);
+
+        for (size_t v=0; v < vertex_count; v++) remap[v] = v;
+        memset(touched, 0, vertex_count);
+        size_t removed = 0;
+        size_t removable = (index_count - target_index_count) / 3;
+        for (uint32_t k=0; k < collapse_count && removed < removable; k++) {
+            Collapse* collapse = &collapses[keys[k] & 0xffffffff];
+            uint32_t from = collapse->from;
+            uint32_t to = collapse->to;
+            if (touched[from] || touched[to]) continue;
+
+            // Triangles around from must not flip when it moves to to
+            bool flips = false;
+            uint32_t vanishing = 0;
+            for (uint32_t a=adjacency_offsets[from];
+                    a < adjacency_offsets[from + 1] && !flips; a++) {
+                const uint32_t* tri = &dst[adjacency[a] * 3];
+                uint32_t t[3] = {remap[tri[0]], remap[tri[1]], remap[tri[2]]};
+                if (t[0] == t[1] || t[1] == t[2] || t[0] == t[2]) continue;
+                if (t[0] == to || t[1] == to || t[2] == to) {
+                    vanishing++;
+                    continue;
+                }
+                vec3 before, after;
+                triangle_normal(vertices[t[0]].position,
+                        vertices[t[1]].position, vertices[t[2]].position,
+                        before);
+                for (int c=0; c < 3; c++) if (t[c] == from) t[c] = to;
+                triangle_normal(vertices[t[0]].position,
+                        vertices[t[1]].position, vertices[t[2]].position,
+                        after);
+                flips = glm_vec3_dot(before, after) <= 0.0f;
+            }
+            if (flips) continue;
+
+            remap[from] = to;
+            quadric_add(&quadrics[to], &quadrics[from]);
+            touched[from] = 1;
+            touched[to] = 1;
+            removed += vanishing;
+            uint32_t error_bits = keys[k] >> 32;
+            float error;
+            memcpy(&error, &error_bits, sizeof(error));
+            *o_error = MAX(*o_error, sqrtf(error));
+        }
+        if (!removed) break;
+
+        size_t kept = 0;
+        for (size_t i=0; i + 3 <= index_count; i += 3) {
+            uint32_t a = remap[dst[i]];
+            uint32_t b = remap[dst[i + 1]];
+            uint32_t c = remap[dst[i + 2]];
+            if (a == b || b == c || a == c) continue;
+            dst[kept++] = a;
+            dst[kept++] = b;
+            dst[kept++] = c;
+        }
+        index_count = kept;
+    }
+
+    mem_free(scratch);
+    mem_free(keys);
+    mem_free(collapses);
+    mem_free(adjacency);
+    mem_free(adjacency_offsets);
+    mem_free(touched);
+    mem_free(remap);
+    mem_free(locked);
+    mem_free(quadrics);
+    return index_count;
+}
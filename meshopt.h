@@ -0,0 +1,67 @@
+#ifndef MESHOPT_H
+#define MESHOPT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "scene.h"
+
+// Entries of the cache simulated when scoring triangles
+#define MESHOPT_CACHE_SIZE 32
+// Post-transform FIFO size assumed when measuring ACMR
+#define MESHOPT_FIFO_SIZE 16
+// Clusters may be cut where the ACMR stays within this factor
+#define MESHOPT_OVERDRAW_THRESHOLD 1.05f
+// Meshlet limits, 124 triangles leave the index data of a meshlet within
+// 64 vertices and a multiple of 4 bytes
+#define MESHLET_MAX_VERTICES 64
+#define MESHLET_MAX_TRIANGLES 124
+// Normal and uv differences count as this fraction of the primitive's size
+// in the simplification error
+#define MESHOPT_ATTRIBUTE_WEIGHT 0.05f
+
+// Merges vertices with equal normal and uv whose positions are equal, or
+// within epsilon on every axis when it is above zero. A vertex merges into
+// the first kept one in reach. The kept vertices are packed to the front
+// in order, returns their count.
+size_t meshopt_weld(Vertex* vertices, size_t vertex_count, uint32_t* indices,
+        size_t index_count, float epsilon);
+// Average cache misses per triangle with a FIFO of cache_size entries
+float meshopt_acmr(const uint32_t* indices, size_t index_count,
+        size_t vertex_count, uint32_t cache_size);
+// Forsyth's linear speed vertex cache ordering. dst must not alias
+// indices.
+void meshopt_optimize_vertex_cache(uint32_t* dst, const uint32_t* indices,
+        size_t index_count, size_t vertex_count);
+// Reorders cache ordered triangles in clusters, clusters facing away from
+// the mesh center first so they occlude the rest. dst must not alias
+// indices.
+void meshopt_optimize_overdraw(uint32_t* dst, const uint32_t* indices,
+        size_t index_count, const Vertex* vertices, size_t vertex_count,
+        float threshold);
+// Renumbers the vertices in order of first use, unused vertices go last
+void meshopt_optimize_vertex_fetch(Vertex* vertices, size_t vertex_count,
+        uint32_t* indices, size_t index_count);
+
+// Cuts triangles in order into meshlets within the limits above and
+// computes their bounds. Writes them to o_meshlets unless it is NULL,
+// returns their count either way.
+size_t meshopt_build_meshlets(const Vertex* vertices, const uint32_t* indices,
+        size_t index_count, Meshlet* o_meshlets);
+
+// Collapses edges by quadric error until at most target_index_count
+// indices are left or the next collapse would be off by more than
+// target_error. Vertices only collapse onto other vertices, so the result
+// indexes the same vertex array. Boundary and uv seam vertices stay put.
+// Returns the index count written to dst, o_error receives the largest
+// error accepted, a local space distance. dst may alias indices.
+size_t meshopt_simplify(uint32_t* dst, const uint32_t* indices,
+        size_t index_count, const Vertex* vertices, size_t vertex_count,
+        size_t target_index_count, float target_error, float* o_error);
+
+// All of the above but meshlets and simplification on one primitive, in
+// place
+void meshopt_optimize_primitive(Vertex* vertices, size_t vertex_count,
+        uint32_t* indices, size_t index_count, bool overdraw);
+
+#endif
@@ -0,0 +1,72 @@
+#include <math.h>
+#include <string.h>
+#include "quantize.h"
+
+// Rounds to nearest even, too large values become infinity
+uint16_t half_from_float(float f)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000;
+    uint32_t float_exponent = (bits >> 23) & 0xff;
+    uint32_t mantissa = bits & 0x7fffff;
+    if (float_exponent == 0xff) {
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    }
+    int32_t exponent = (int32_t) float_exponent - 127 + 15;
+    if (exponent >= 0x1f) return sign | 0x7c00;
+
+    uint32_t shift = 13;
+    uint32_t half;
+    if (exponent <= 0) {
+        // Subnormal, the implicit bit becomes explicit
+        if (exponent < -10) return sign;
+        mantissa |= 0x800000;
+        shift = 14 - exponent;
+        half = mantissa >> shift;
+    } else {
+        half = (uint32_t) exponent << 10 | mantissa >> shift;
+    }
+    uint32_t rest = mantissa & ((1u << shift) - 1);
+    uint32_t halfway = 1u << (shift - 1);
+    // A carry out of the mantissa correctly bumps the exponent
+    if (rest > halfway || (rest == halfway && (half & 1))) half++;
+    return sign | half;
+}
+
+// Projects onto the octahedron, the lower half folded over the upper
+void octahedral_encode(vec3 normal, int16_t o_encoded[2])
+{
+    float l1 = fabsf(normal[0]) + fabsf(normal[1]) + fabsf(normal[2]);
+    float x = l1 > 0.0f ? normal[0] / l1 : 0.0f;
+    float y = l1 > 0.0f ? normal[1] / l1 : 0.0f;
+    if (normal[2] < 0.0f) {
+        float folded_x = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        float folded_y = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+        x = folded_x;
+        y = folded_y;
+    }
+    o_encoded[0] = (int16_t) roundf(glm_clamp(x, -1.0f, 1.0f) * 32767.0f);
+    o_encoded[1] = (int16_t) roundf(glm_clamp(y, -1.0f, 1.0f) * 32767.0f);
+}
+
+void compact_vertices(const Vertex* vertices, size_t count,
+        vec3 min, vec3 extent, CompactVertex* o_compact)
+{
+    vec3 scale;
+    for (int c=0; c < 3; c++) {
+        scale[c] = extent[c] > 0.0f ? 65535.0f / extent[c] : 0.0f;
+    }
+    for (size_t v=0; v < count; v++) {
+        const Vertex* src = &vertices[v];
+        CompactVertex* dst = &o_compact[v];
+        for (int c=0; c < 3; c++) {
+            float q = (src->position[c] - min[c]) * scale[c];
+            dst->position[c] = (uint16_t) roundf(glm_clamp(q, 0.0f, 65535.0f));
+        }
+        dst->position[3] = 0;
+        octahedral_encode((float*) src->normal, dst->normal);
+        dst->tex_coord[0] = half_from_float(src->tex_coord[0]);
+        dst->tex_coord[1] = half_from_float(src->tex_coord[1]);
+    }
+}
@@ -0,0 +1,23 @@
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#include <cglm/cglm.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "scene.h"
+
+// Half the size of Vertex. Positions are unorm over the bounds they were
+// quantized to, normals octahedral snorm, uvs half floats.
+typedef struct CompactVertex {
+    uint16_t position[4]; // w is padding
+    int16_t normal[2];
+    uint16_t tex_coord[2];
+} CompactVertex;
+
+uint16_t half_from_float(float f);
+void octahedral_encode(vec3 normal, int16_t o_encoded[2]);
+// A vertex at min maps to 0 and one at min + extent to 65535
+void compact_vertices(const Vertex* vertices, size_t count,
+        vec3 min, vec3 extent, CompactVertex* o_compact);
+
+#endif
@@ -3,6 +3,7 @@
 #include <stdbool.h>
 #include <string.h>
 #include <limits.h>
+#include <float.h>
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
 #define CGLM_DEFINE_PRINTS
@@ -19,15 +20,33 @@
 #include "vkhelpers.h"
 
 #include "collision.h"
+#include "jobs.h"
+#include "cull.h"
+#include "sort.h"
+#include "meshopt.h"
+#include "quantize.h"
+#include "accessor.h"
+#include "ktx2.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
+#define SCENE_PATH "res/cube.glb"
+
 #define APP_NAME "Demo"
 #define ENGINE_NAME "None"
 
 #define FRAMES_IN_FLIGHT 2
+// Descriptor sets of the per texture fallback, the bindless array holds up
+// to MAX_BINDLESS_TEXTURES within the device limits
 #define MAX_TEXTURES 50
+#define MAX_BINDLESS_TEXTURES 4096
+// Bindless elements of the cursor and of the first material texture, the
+// other materials follow in order
+#define CURSOR_TEXTURE_INDEX 0
+#define MATERIAL_TEXTURE_OFFSET (CURSOR_TEXTURE_INDEX + 1)
+#define MAX_PICK_REQUESTS 8
+#define PICK_READBACK_SIZE KBS(256)
 
 typedef struct Vertex2D {
     vec2 position;
@@ -43,13 +62,187 @@ typedef struct DeferredUbo {
     uint32_t light_count;
 } DeferredUbo;
 
-typedef struct PushConstants {
+// Per hierarchy entry, read by mrt.vert through the instance index
+typedef struct GpuTransform {
     mat4 model;
+    vec4 normal[3]; // mat3 columns in std430
     uint32_t node_id;
-} PushConstants;
+    uint32_t flags;
+    uint32_t quantization; // Into the quantization buffer
+    uint32_t lod; // Selected this frame, set on the GPU-driven path only
+} GpuTransform;
+
+// Dequantizes compact positions, one per mesh followed by one per static
+// batch
+typedef struct GpuQuantization {
+    vec4 scale;
+    vec4 offset;
+} GpuQuantization;
+
+// The node is drawn by its static batches, the culling shader skips it
+#define TRANSFORM_FLAG_BATCHED 1
+
+// Pre-transformed geometry of static nodes sharing a texture. Members keep
+// their original index ranges so moved nodes can be cut out again.
+typedef struct StaticBatch {
+    uint32_t texture_id;
+    uint32_t vertex_offset;
+    uint32_t vertex_count;
+    uint32_t index_offset;
+    uint32_t index_count; // Of the members still attached
+    uint32_t member_first;
+    uint32_t member_count;
+    vec3 min;
+    vec3 max;
+    bool dirty;
+    bool visible;
+} StaticBatch;
+
+typedef struct BatchMember {
+    uint32_t transform;
+    uint32_t source_first; // Into batch_source_indices
+    uint32_t index_first; // Relative to the batch index offset
+    uint32_t index_count;
+    bool detached;
+    vec3 min;
+    vec3 max;
+} BatchMember;
+
+#define MIN_TRANSFORMS_PER_UPLOAD_JOB 1024
+
+// One visible primitive of a mesh node
+typedef struct DrawCommand {
+    uint32_t transform;
+    uint32_t primitive; // Scene wide primitive index
+    uint32_t lod; // Within the primitive's LODs
+} DrawCommand;
+
+// All visible instances of one primitive, drawn with a single call. The
+// transforms of instance i are at instances[first_instance + i].
+typedef struct DrawGroup {
+    uint32_t texture_id;
+    uint32_t index_count;
+    uint32_t index_offset;
+    uint32_t vertex_offset;
+    uint32_t first_instance;
+    uint32_t instance_count;
+    bool wide_indices;
+} DrawGroup;
+
+// Draw order, most significant first: pipeline, index width, texture, front
+// to back depth. The low bits hold the group index.
+#define SORT_KEY_PIPELINE_SHIFT 57
+#define SORT_KEY_INDEX_SHIFT 56
+#define SORT_KEY_TEXTURE_SHIFT 40
+#define SORT_KEY_DEPTH_SHIFT 24
+#define SORT_KEY_GROUP_MASK 0xffffffull
+#define SORT_KEY_DEPTH_MAX 0xffff
+
+#define FOV_Y 0.6f
+#define Z_NEAR 0.01f
+#define Z_FAR 1000.0f
+
+// Largest projected error in pixels a LOD may have
+#define LOD_PIXEL_ERROR 1.0f
+// A coarser LOD than the current one must stay this far below the limit,
+// so nodes around a switching distance do not flip between LODs
+#define LOD_HYSTERESIS 0.25f
+
+#define MIN_NODES_PER_DRAW_JOB 256
+#define MIN_NODES_PER_CULL_JOB 512
+#define MIN_NODES_PER_LOD_JOB 512
+#define MIN_PRIMITIVES_PER_LOAD_JOB 1
+
+// Static per draw slot record for the GPU culling pass, matches cull.comp
+typedef struct GpuDraw {
+    uint32_t transform;
+    uint32_t primitive;
+    uint32_t pad[2];
+    vec4 min;
+    vec4 max;
+} GpuDraw;
+
+// Per scene primitive followed by one per coarser LOD of each. A record's
+// indirect command goes to the texture bucket and its instances to
+// [instance_offset, instance_offset + instances drawn). Clustered primitives
+// get a command per visible meshlet at LOD 0 instead. LOD l > 0 of primitive
+// p is record primitives[p].lod_first + l - 1.
+typedef struct GpuPrimitive {
+    uint32_t index_count;
+    uint32_t first_index;
+    int32_t vertex_offset;
+    uint32_t bucket;
+    uint32_t bucket_offset;
+    uint32_t instance_offset;
+    uint32_t clustered;
+    uint32_t lod_count;
+    uint32_t lod_first;
+    uint32_t vertex_count; // Distinct vertices of the LOD
+} GpuPrimitive;
+
+// Meshlet bounds with its absolute index range, matches cull_clusters.comp
+typedef struct GpuMeshlet {
+    vec4 sphere;
+    vec4 cone;
+    uint32_t first_index;
+    uint32_t index_count;
+    uint32_t primitive;
+    uint32_t vertex_count;
+} GpuMeshlet;
+
+// One per meshlet of every clustered draw slot. Its instance entry holds
+// the draw's transform.
+typedef struct GpuClusterDraw {
+    uint32_t draw;
+    uint32_t meshlet;
+    uint32_t instance;
+    uint32_t pad;
+} GpuClusterDraw;
+
+// Counted by cull.comp and cull_clusters.comp for the stats
+typedef struct GpuCullStats {
+    uint32_t draws_visible;
+    uint32_t draws_culled;
+    uint32_t vertices;
+    uint32_t clusters_culled;
+    uint32_t frustum_culled_triangles;
+    uint32_t backface_culled_triangles;
+} GpuCullStats;
+
+typedef struct CullPushConstants {
+    vec4 planes[6];
+    vec4 camera;
+    uint32_t draw_count;
+    uint32_t record_count; // Of primitive records, LODs included
+    uint32_t cluster_count;
+    uint32_t pad;
+} CullPushConstants;
+
+#define CULL_GROUP_SIZE 64
 
 
 enum { VALIDATION_ENABLED = 1 };
+// Cull and emit draws on the GPU when the device supports indirect count
+enum { GPU_DRIVEN = 1 };
+// On the GPU-driven path, cull primitives of more than one meshlet meshlet
+// by meshlet against the frustum and their normal cones
+enum { CLUSTER_CULLING = 1 };
+// Index the textures in one update after bind descriptor array by a push
+// constant instead of binding a set per texture
+enum { BINDLESS_TEXTURES = 1 };
+// Merge the geometry of static mesh nodes per texture at load time. Only
+// nodes marked static in their glTF extras whose mesh no other node uses
+// are batched, everything else goes through culling, instancing and LODs.
+enum { STATIC_BATCHING = 1 };
+// Reorder triangle clusters against overdraw after the vertex cache pass
+enum { OVERDRAW_OPTIMIZATION = 1 };
+// Vertex positions this close are welded, 0 welds exact duplicates only
+#define WELD_EPSILON 0.0001f
+// Every LOD aims at half the triangles of the one before, off by at most
+// this fraction of the primitive's size. LODs keeping more than
+// LOD_MAX_KEPT of the indices before them are not worth it.
+#define LOD_MAX_ERROR 0.02f
+#define LOD_MAX_KEPT 0.9f
 
 const char *const VALIDATION_LAYERS[] = {
     "VK_LAYER_KHRONOS_validation"
@@ -60,6 +253,15 @@ const char *const DEVICE_EXTENSIONS[DEVICE_EXTENSION_COUNT] = {
     VK_KHR_SWAPCHAIN_EXTENSION_NAME
 };
 
+typedef struct PickRequest {
+    uint32_t id;
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+    VkDeviceSize offset;
+} PickRequest;
+
 typedef struct Attachment {
     VkImage image;
     VkImageView view;
@@ -77,10 +279,10 @@ void create_attachment(Attachment* att, uint32_t width, uint32_t height,
     };
     usage |= VK_IMAGE_USAGE_SAMPLED_BIT;
 
-    create_2d_image(width, height, VK_SAMPLE_COUNT_1_BIT, format,
+    create_2d_image(width, height, 1, VK_SAMPLE_COUNT_1_BIT, format,
         VK_IMAGE_TILING_OPTIMAL, usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
         &att->image, &att->memory);
-    create_2d_image_view(att->image, format, aspect_mask, &att->view);
+    create_2d_image_view(att->image, format, aspect_mask, 1, &att->view);
 }
 
 void destroy_attachment(Attachment* att)
@@ -106,11 +308,19 @@ typedef struct Render {
     VkRenderPass offscreen_render_pass;
     VkRenderPass lights_ui_render_pass;
     VkRenderPass image_blit_render_pass;
+    VkRenderPass pick_render_pass;
     VkPipelineLayout graphics_pipeline_layout;
     VkPipeline graphics_pipeline;
     VkPipeline offscreen_graphics_pipeline;
     VkPipeline lights_ui_pipeline;
     VkPipeline image_blit_pipeline;
+    VkPipeline pick_pipeline;
+    VkPipeline lights_pick_pipeline;
+    // Variants of the two above for CompactVertex
+    VkPipeline compact_offscreen_pipeline;
+    VkPipeline compact_pick_pipeline;
+    VkPipelineLayout cull_pipeline_layout;
+    VkPipeline cull_pipeline;
     VkCommandPool graphics_command_pool;
 
     Texture cursor;
@@ -122,29 +332,50 @@ typedef struct Render {
     Attachment offscreen_depth;
 
     Attachment object_code;
-    VkImage object_pick_pixel;
-    VkDeviceMemory object_pick_pixel_mem;
+
+    // Picking requests waiting to be recorded, recorded per frame and resolved
+    PickRequest pick_queue[MAX_PICK_REQUESTS];
+    uint32_t pick_queue_count;
+    PickRequest picks_in_flight[FRAMES_IN_FLIGHT][MAX_PICK_REQUESTS];
+    uint32_t picks_in_flight_count[FRAMES_IN_FLIGHT];
+    PickResult pick_results[MAX_PICK_REQUESTS];
+    uint32_t pick_result_count;
+    uint32_t next_pick_id;
+    Buffer pick_readback[FRAMES_IN_FLIGHT];
+    void* pick_readback_mapped[FRAMES_IN_FLIGHT];
 
     VkFramebuffer framebuffers[FRAMES_IN_FLIGHT];
     VkFramebuffer lights_ui_framebuffers[FRAMES_IN_FLIGHT];
     VkFramebuffer offscreen_framebuffer;
+    VkFramebuffer pick_framebuffer;
 
     VkDescriptorPool descriptor_pool;
     VkDescriptorPool gbuf_descriptor_pool;
     VkDescriptorPool texture_descriptor_pool;
+    VkDescriptorPool cull_descriptor_pool;
 
     Buffer ubo_buffer;
     Buffer deferred_ubo_buffer;
 
     VkSampler texture_sampler;
+    VkSampler base_mip_sampler; // Clamped to level 0
+    bool base_mip_only; // Materials use base_mip_sampler
     VkSampler gbuf_sampler;
 
     VkDescriptorSetLayout desc_set_layout;
     VkDescriptorSetLayout gbuf_desc_set_layout;
     VkDescriptorSetLayout texture_set_layout;
+    VkDescriptorSetLayout cull_desc_set_layout;
 
     VkDescriptorSet desc_set;
     VkDescriptorSet gbuf_desc_set;
+    VkDescriptorSet cull_desc_set;
+
+    // Texture set 1 is a single array of max_textures combined image
+    // samplers when bindless
+    bool bindless;
+    uint32_t max_textures;
+    VkDescriptorSet bindless_desc_set;
 
     VkCommandBuffer command_buffer;
 
@@ -155,17 +386,165 @@ typedef struct Render {
     Texture* textures;
     size_t texture_count;
 
-    Buffer vertex_buffer;
+    Buffer vertex_buffer; // Of CompactVertex if scene.compact_vertices
     Buffer index_buffer;
+    Buffer index_buffer32;
+    Buffer quantization;
     Buffer lights_buffer;
 
+    // Node n writes its draws from node_draw_offsets[n]
+    DrawCommand* draws;
+    uint32_t* node_draw_offsets;
+    uint32_t draw_count;
+    // Visible draws grouped by primitive, per instance transform indices
+    // are copied into the mapped instance buffer once the GPU is done
+    Primitive** primitives;
+    uint32_t* primitive_instances;
+    DrawGroup* groups;
+    uint32_t group_count;
+    uint64_t* sort_keys;
+    uint64_t* sort_scratch;
+    uint32_t* instances;
+    Buffer instance_buffer;
+    uint32_t* instance_mapped;
+    uint32_t partial_draw_first[MAX_JOB_THREADS];
+    uint32_t partial_draw_count[MAX_JOB_THREADS];
+    uint32_t partial_nodes_drawn[MAX_JOB_THREADS];
+    uint32_t partial_nodes_culled[MAX_JOB_THREADS];
+
+    // Per hierarchy entry
+    uint8_t* cull_masks;
+    uint8_t* visible;
+    uint8_t* lods;
+    RenderStats stats;
+    bool print_stats; // Every 0.2 s, see render_set_print_stats
+
+    // Persistently mapped, only changed entries are rewritten. Batch
+    // member m has an identity entry at hierarchy count + m.
+    Buffer transforms;
+    GpuTransform* transforms_mapped;
+
+    // Static batches, batched is per hierarchy entry
+    StaticBatch* batches;
+    uint32_t batch_count;
+    BatchMember* batch_members;
+    uint32_t batch_member_count;
+    // 16 or 32-bit for the whole index buffer, whichever the largest batch
+    // needs
+    void* batch_source_indices;
+    void* batch_scratch;
+    uint32_t batch_index_size;
+    uint8_t* batched;
+    bool batches_dirty;
+    uint32_t batch_instance_offset;
+    Buffer batch_vertex_buffer;
+    Buffer batch_index_buffer;
+    Frustum frustum;
+
+    // GPU-driven path. Indirect commands are bucketed by texture, 16-bit
+    // index buckets first. Bucket b owns bucket_sizes[b] command slots from
+    // bucket_offsets[b].
+    bool gpu_driven;
+    VkPipeline emit_draws_pipeline;
+    VkPipeline cull_clusters_pipeline;
+    Buffer gpu_draws;
+    Buffer gpu_primitives;
+    Buffer instance_counts;
+    Buffer indirect_commands;
+    Buffer indirect_counts;
+    void* indirect_counts_mapped;
+    uint32_t gpu_draw_count;
+    uint32_t gpu_record_count;
+    // Meshlets of clustered primitives and the cluster draws over them,
+    // whose instance entries follow the batch members'
+    Buffer gpu_meshlets;
+    Buffer cluster_draws;
+    Buffer draw_visibility;
+    Buffer cull_stats;
+    GpuCullStats* cull_stats_mapped;
+    uint32_t cluster_count;
+    uint32_t cluster_triangles;
+    uint32_t cluster_instance_offset;
+    uint32_t bucket_count;
+    uint32_t* bucket_offsets;
+    uint32_t* bucket_sizes;
+
     size_t current_frame;
     double timestamp;
     uint32_t frames;
+
+    // Timestamps at the start and end of the frame's commands, if the
+    // graphics queue has them. Written once a frame was submitted.
+    bool gpu_timing;
+    bool frame_queries_written;
+    VkQueryPool frame_queries;
+    uint64_t timestamp_mask;
+    float timestamp_period; // Nanoseconds per tick
 } Render;
 static Render render;
 
-void load_texture(void* buffer, size_t len, Texture* texture)
+static void update_texture_descriptor(Texture* texture)
+{
+    VkDescriptorImageInfo texture_info = {
+        .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        .imageView = texture->view,
+        .sampler = render.base_mip_only ? render.base_mip_sampler :
+            render.texture_sampler,
+    };
+    VkWriteDescriptorSet texture_write = {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = texture->desc_set,
+        .dstBinding = 0,
+        .dstArrayElement = texture->descriptor_index,
+        .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        .descriptorCount = 1,
+        .pImageInfo = &texture_info,
+    };
+    vkUpdateDescriptorSets(g_device, 1, &texture_write, 0, NULL);
+}
+
+// descriptor_index is the texture's bindless element, unused otherwise
+static void write_texture_descriptor(Texture* texture,
+        uint32_t descriptor_index)
+{
+    texture->descriptor_index = 0;
+    if (render.bindless) {
+        if (descriptor_index >= render.max_textures) {
+            fatal("Out of bindless texture descriptors.");
+        }
+        texture->desc_set = render.bindless_desc_set;
+        texture->descriptor_index = descriptor_index;
+    } else {
+        VkDescriptorSetAllocateInfo tex_set_alloc_info = {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+            .descriptorPool = render.texture_descriptor_pool,
+            .descriptorSetCount = 1,
+            .pSetLayouts = &render.texture_set_layout,
+        };
+        if (vkAllocateDescriptorSets(g_device, &tex_set_alloc_info,
+                    &texture->desc_set) != VK_SUCCESS) {
+            fatal("Failed to allocate descriptor sets.");
+        }
+    }
+    update_texture_descriptor(texture);
+}
+
+// Whether record_mip_chain can blit levels of the format, which takes
+// linear filtering and blits from and to optimal tiling
+static bool format_blits_mips(VkFormat format)
+{
+    VkFormatProperties format_properties;
+    vkGetPhysicalDeviceFormatProperties(g_physical_device, format,
+            &format_properties);
+    VkFormatFeatureFlags blit_features =
+        VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT |
+        VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT;
+    return (format_properties.optimalTilingFeatures & blit_features) ==
+        blit_features;
+}
+
+void load_texture(void* buffer, size_t len, Texture* texture,
+        uint32_t descriptor_index)
 {
     // Load pixels
     int tex_width, tex_height, tex_channels;
@@ -176,6 +555,9 @@ void load_texture(void* buffer, size_t len, Texture* texture)
 
     texture->width = tex_width;
     texture->height = tex_height;
+    // The levels below 0 are blitted, otherwise only level 0 is kept
+    texture->mip_levels = format_blits_mips(VK_FORMAT_R8G8B8A8_SRGB) ?
+        mip_level_count(tex_width, tex_height) : 1;
 
     // Upload pixels to staging buffer
     Buffer texture_staging = upload_data_to_staging_buffer(pixels, image_size);
@@ -183,10 +565,11 @@ void load_texture(void* buffer, size_t len, Texture* texture)
     stbi_image_free(pixels);
 
     // Create texture image
-    create_2d_image(tex_width, tex_height,
+    create_2d_image(tex_width, tex_height, texture->mip_levels,
             VK_SAMPLE_COUNT_1_BIT, VK_FORMAT_R8G8B8A8_SRGB,
             VK_IMAGE_TILING_OPTIMAL,
-            VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+            VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
+                VK_IMAGE_USAGE_SAMPLED_BIT,
             VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &texture->image, &texture->memory);
 
     {
@@ -204,7 +587,7 @@ void load_texture(void* buffer, size_t len, Texture* texture)
         .image = texture->image,
         .subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
         .subresourceRange.baseMipLevel = 0,
-        .subresourceRange.levelCount = 1,
+        .subresourceRange.levelCount = texture->mip_levels,
         .subresourceRange.baseArrayLayer = 0,
         .subresourceRange.layerCount = 1,
     };
@@ -242,69 +625,137 @@ void load_texture(void* buffer, size_t len, Texture* texture)
     destroy_buffer(&texture_staging);
     }
     {
-    // Transition image layout for shader access
+    // Blit the mip chain, every level ends up ready for shader access
+    VkCommandBuffer cmdbuf = begin_one_time_command_buffer(
+            render.graphics_command_pool);
+    record_mip_chain(cmdbuf, texture->image, tex_width, tex_height,
+            texture->mip_levels);
+    submit_one_time_command_buffer(
+            render.graphics_queue, cmdbuf,
+            render.graphics_command_pool);
+    }
+
+    create_2d_image_view(texture->image, VK_FORMAT_R8G8B8A8_SRGB,
+            VK_IMAGE_ASPECT_COLOR_BIT, texture->mip_levels, &texture->view);
+    write_texture_descriptor(texture, descriptor_index);
+}
+
+// Uploads the levels of a KTX2 texture as they are, block compressed ones
+// included. Returns false if the file or its format is not supported.
+bool load_ktx2_texture(const void* data, size_t size, Texture* texture,
+        uint32_t descriptor_index)
+{
+    Ktx2 ktx2;
+    if (!ktx2_parse(data, size, &ktx2)) return false;
+    VkFormat format = (VkFormat) ktx2.vk_format;
+    VkFormatProperties format_properties;
+    vkGetPhysicalDeviceFormatProperties(g_physical_device, format,
+            &format_properties);
+    if (!(format_properties.optimalTilingFeatures &
+                VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT)) {
+        errprint("KTX2 texture format not supported by the device.\n");
+        return false;
+    }
+    texture->width = ktx2.width;
+    texture->height = ktx2.height;
+    texture->mip_levels = ktx2.level_count;
+    // Levels the file leaves to the loader are blitted from level 0, block
+    // compressed formats can't be blitted to and keep level 0 only
+    if (ktx2.generate_levels) {
+        if (format_blits_mips(format)) {
+            texture->mip_levels = mip_level_count(ktx2.width, ktx2.height);
+        } else {
+            errprint("Can't generate the KTX2 texture's mip levels.\n");
+        }
+    }
+
+    // Levels back to back in one staging buffer, offsets aligned to the
+    // largest block size
+    VkDeviceSize offsets[KTX2_MAX_LEVELS];
+    VkDeviceSize staging_size = 0;
+    for (uint32_t l=0; l < ktx2.level_count; l++) {
+        offsets[l] = staging_size;
+        staging_size += (ktx2.levels[l].size + 15) & ~(VkDeviceSize) 15;
+    }
+    uint8_t* levels = malloc_nofail(MAX(staging_size, 1));
+    VkBufferImageCopy regions[KTX2_MAX_LEVELS];
+    for (uint32_t l=0; l < ktx2.level_count; l++) {
+        memcpy(&levels[offsets[l]], ktx2.levels[l].data, ktx2.levels[l].size);
+        regions[l] = (VkBufferImageCopy) {
+            .bufferOffset = offsets[l],
+            .imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+            .imageSubresource.mipLevel = l,
+            .imageSubresource.baseArrayLayer = 0,
+            .imageSubresource.layerCount = 1,
+            .imageExtent = {
+                MAX(ktx2.width >> l, 1),
+                MAX(ktx2.height >> l, 1),
+                1
+            },
+        };
+    }
+    Buffer texture_staging =
+        upload_data_to_staging_buffer(levels, staging_size);
+    mem_free(levels);
+
+    bool generated = texture->mip_levels > ktx2.level_count;
+    create_2d_image(ktx2.width, ktx2.height, texture->mip_levels,
+            VK_SAMPLE_COUNT_1_BIT, format, VK_IMAGE_TILING_OPTIMAL,
+            VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT |
+                (generated ? VK_IMAGE_USAGE_TRANSFER_SRC_BIT : 0),
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            &texture->image, &texture->memory);
+
     VkCommandBuffer cmdbuf = begin_one_time_command_buffer(
             render.graphics_command_pool);
     VkImageMemoryBarrier barrier = {
         .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-        .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-        .newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
-        .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+        .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+        .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        .srcAccessMask = 0,
+        .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
         .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
         .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
         .image = texture->image,
         .subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
         .subresourceRange.baseMipLevel = 0,
-        .subresourceRange.levelCount = 1,
+        .subresourceRange.levelCount = texture->mip_levels,
         .subresourceRange.baseArrayLayer = 0,
         .subresourceRange.layerCount = 1,
     };
-    vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
-            VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, NULL, 0, NULL, 1,
-            &barrier);
-    submit_one_time_command_buffer(
-            render.graphics_queue, cmdbuf,
-            render.graphics_command_pool);
-    }
-
-    create_2d_image_view(texture->image, VK_FORMAT_R8G8B8A8_SRGB,
-            VK_IMAGE_ASPECT_COLOR_BIT, &texture->view);
-
-    VkDescriptorSetAllocateInfo tex_set_alloc_info = {
-        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
-        .descriptorPool = render.texture_descriptor_pool,
-        .descriptorSetCount = 1,
-        .pSetLayouts = &render.texture_set_layout,
-    };
-    if (vkAllocateDescriptorSets(
-            g_device, &tex_set_alloc_info, &texture->desc_set) != VK_SUCCESS) {
-        fatal("Failed to allocate descriptor sets.");
+    vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+            VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
+    vkCmdCopyBufferToImage(cmdbuf, texture_staging.buffer, texture->image,
+            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, ktx2.level_count, regions);
+    if (generated) {
+        record_mip_chain(cmdbuf, texture->image, ktx2.width, ktx2.height,
+                texture->mip_levels);
+    } else {
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, NULL, 0, NULL, 1,
+                &barrier);
     }
+    submit_one_time_command_buffer(render.graphics_queue, cmdbuf,
+            render.graphics_command_pool);
+    destroy_buffer(&texture_staging);
 
-    VkDescriptorImageInfo texture_info = {
-        .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-        .imageView = texture->view,
-        .sampler = render.texture_sampler,
-    };
-    VkWriteDescriptorSet texture_write = {
-        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-        .dstSet = texture->desc_set,
-        .dstBinding = 0,
-        .dstArrayElement = 0,
-        .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-        .descriptorCount = 1,
-        .pImageInfo = &texture_info,
-    };
-    vkUpdateDescriptorSets(g_device, 1, &texture_write, 0, NULL);
+    create_2d_image_view(texture->image, format, VK_IMAGE_ASPECT_COLOR_BIT,
+            texture->mip_levels, &texture->view);
+    write_texture_descriptor(texture, descriptor_index);
+    return true;
 }
 
-void load_texture_from_file(const char* filename, Texture* texture)
+void load_texture_from_file(const char* filename, Texture* texture,
+        uint32_t descriptor_index)
 {
     char* buf;
     size_t size;
     read_binary_file(filename, &buf, &size);
-    load_texture(buf, size, texture);
+    load_texture(buf, size, texture, descriptor_index);
     mem_free(buf);
 }
 
@@ -506,12 +957,48 @@ void create_logical_device()
         queue_create_infos[1] = present_queue_create_info;
     }
 
+    // Indirect count draws for the GPU-driven path and descriptor indexing
+    // for bindless textures, lavapipe has both
+    VkPhysicalDeviceVulkan12Features supported_features12 = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
+    };
+    VkPhysicalDeviceFeatures2 supported_features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+        .pNext = &supported_features12,
+    };
+    vkGetPhysicalDeviceFeatures2(g_physical_device, &supported_features);
+    render.gpu_driven = GPU_DRIVEN &&
+        supported_features12.drawIndirectCount &&
+        supported_features.features.multiDrawIndirect &&
+        supported_features.features.drawIndirectFirstInstance;
+    if (GPU_DRIVEN && !render.gpu_driven) {
+        errprint("Indirect count draws unsupported, culling on the CPU.\n");
+    }
+    // Push constant indices are dynamically uniform, no non-uniform indexing
+    render.bindless = BINDLESS_TEXTURES &&
+        supported_features12.descriptorBindingPartiallyBound &&
+        supported_features12.descriptorBindingSampledImageUpdateAfterBind &&
+        supported_features.features.shaderSampledImageArrayDynamicIndexing;
+    if (BINDLESS_TEXTURES && !render.bindless) {
+        errprint("Descriptor indexing unsupported, a set per texture.\n");
+    }
+
+    VkPhysicalDeviceVulkan12Features features12 = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
+        .drawIndirectCount = render.gpu_driven,
+        .descriptorBindingPartiallyBound = render.bindless,
+        .descriptorBindingSampledImageUpdateAfterBind = render.bindless,
+    };
     VkPhysicalDeviceFeatures features = {
         .samplerAnisotropy = VK_TRUE,
+        .multiDrawIndirect = render.gpu_driven,
+        .drawIndirectFirstInstance = render.gpu_driven,
+        .shaderSampledImageArrayDynamicIndexing = render.bindless,
     };
 
     VkDeviceCreateInfo device_create_info = {
         .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+        .pNext = &features12,
         .queueCreateInfoCount = queue_count,
         .pQueueCreateInfos = queue_create_infos,
         .pEnabledFeatures = &features,
@@ -564,12 +1051,32 @@ static void setup_main_desc_set()
         .descriptorCount = 1,
         .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
     };
-    VkDescriptorSetLayoutBinding desc_set_bindings[3] = {
+    VkDescriptorSetLayoutBinding mrt_transforms_sbo_binding = {
+        .binding = 3,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = 1,
+        .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+    };
+    VkDescriptorSetLayoutBinding mrt_instances_sbo_binding = {
+        .binding = 4,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = 1,
+        .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+    };
+    VkDescriptorSetLayoutBinding mrt_quantization_sbo_binding = {
+        .binding = 5,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = 1,
+        .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+    };
+    VkDescriptorSetLayoutBinding desc_set_bindings[6] = {
         mrt_ubo_binding, deferred_ubo_binding, deferred_lights_sbo_binding,
+        mrt_transforms_sbo_binding, mrt_instances_sbo_binding,
+        mrt_quantization_sbo_binding,
     };
     VkDescriptorSetLayoutCreateInfo desc_set_info = {
         .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
-        .bindingCount = 3,
+        .bindingCount = 6,
         .pBindings = desc_set_bindings,
     };
     if (vkCreateDescriptorSetLayout(g_device, &desc_set_info, NULL,
@@ -583,7 +1090,7 @@ static void setup_main_desc_set()
     };
     VkDescriptorPoolSize sb_pool_size = {
         .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
-        .descriptorCount = 1,
+        .descriptorCount = 4,
     };
     VkDescriptorPoolSize pool_sizes[2] = {
         ub_pool_size, sb_pool_size,
@@ -758,6 +1265,16 @@ static void setup_gbuffer_desc_set()
 
 static void setup_texture_descriptor()
 {
+    // Trilinear over the full mip chain, as anisotropic as the device goes
+    VkPhysicalDeviceVulkan12Properties properties12 = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_PROPERTIES,
+    };
+    VkPhysicalDeviceProperties2 properties2 = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+        .pNext = &properties12,
+    };
+    vkGetPhysicalDeviceProperties2(g_physical_device, &properties2);
+    VkPhysicalDeviceProperties* properties = &properties2.properties;
     VkSamplerCreateInfo texture_sampler_info = {
         .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
         .magFilter = VK_FILTER_LINEAR,
@@ -766,30 +1283,54 @@ static void setup_texture_descriptor()
         .addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT,
         .addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT,
         .anisotropyEnable = VK_TRUE,
-        .maxAnisotropy = 16.0f,
+        .maxAnisotropy = MIN(16.0f, properties->limits.maxSamplerAnisotropy),
         .borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK,
         .unnormalizedCoordinates = VK_FALSE,
         .compareEnable = VK_FALSE,
         .compareOp = VK_COMPARE_OP_ALWAYS,
         .mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR,
         .minLod = 0.0f,
-        .maxLod = 1.0,
+        .maxLod = VK_LOD_CLAMP_NONE,
         .mipLodBias = 0.0f,
     };
     if (vkCreateSampler(g_device, &texture_sampler_info, NULL,
                 &render.texture_sampler) != VK_SUCCESS) {
         fatal("Failed to create texture sampler.");
     }
+    texture_sampler_info.maxLod = 0.0f;
+    if (vkCreateSampler(g_device, &texture_sampler_info, NULL,
+                &render.base_mip_sampler) != VK_SUCCESS) {
+        fatal("Failed to create texture sampler.");
+    }
+
+    // Half of the update after bind limits, which count every set of the
+    // pipeline layout, for the bindless array
+    render.max_textures = MAX_TEXTURES;
+    if (render.bindless) {
+        uint32_t limit = MIN(
+            MIN(properties12.maxPerStageDescriptorUpdateAfterBindSamplers,
+                properties12.maxPerStageDescriptorUpdateAfterBindSampledImages),
+            MIN(properties12.maxDescriptorSetUpdateAfterBindSamplers,
+                properties12.maxDescriptorSetUpdateAfterBindSampledImages));
+        render.max_textures = MIN(MAX_BINDLESS_TEXTURES, limit / 2);
+        if (render.max_textures < MAX_TEXTURES) {
+            errprint("Bindless texture limits too low, a set per texture.\n");
+            render.bindless = false;
+            render.max_textures = MAX_TEXTURES;
+        }
+    }
 
     VkDescriptorPoolSize texture_pool_size = {
         .type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-        .descriptorCount = MAX_TEXTURES,
+        .descriptorCount = render.max_textures,
     };
     VkDescriptorPoolCreateInfo texture_pool_info = {
         .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        .flags = render.bindless ?
+            VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT : 0,
         .poolSizeCount = 1,
         .pPoolSizes = &texture_pool_size,
-        .maxSets = MAX_TEXTURES,
+        .maxSets = render.bindless ? 1 : MAX_TEXTURES,
     };
     if (vkCreateDescriptorPool(
             g_device, &texture_pool_info, NULL, &render.texture_descriptor_pool)
@@ -797,14 +1338,28 @@ static void setup_texture_descriptor()
         fatal("Failed to create texture descriptor pool.");
     }
 
+    // Unwritten elements stay valid to leave out, and textures loaded later
+    // may be written while the set is bound
+    VkDescriptorBindingFlags bindless_flags =
+        VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT |
+        VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT;
+    VkDescriptorSetLayoutBindingFlagsCreateInfo binding_flags_info = {
+        .sType =
+            VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO,
+        .bindingCount = 1,
+        .pBindingFlags = &bindless_flags,
+    };
     VkDescriptorSetLayoutBinding texture_sampler_binding = {
         .binding = 0,
         .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-        .descriptorCount = 1,
+        .descriptorCount = render.bindless ? render.max_textures : 1,
         .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
     };
     VkDescriptorSetLayoutCreateInfo texture_set_info = {
         .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .pNext = render.bindless ? &binding_flags_info : NULL,
+        .flags = render.bindless ?
+            VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT : 0,
         .bindingCount = 1,
         .pBindings = &texture_sampler_binding,
     };
@@ -812,21 +1367,33 @@ static void setup_texture_descriptor()
             &render.texture_set_layout) != VK_SUCCESS) {
         fatal("Failed to create texture descriptor set layout.");
     }
+
+    if (!render.bindless) return;
+    VkDescriptorSetAllocateInfo bindless_set_alloc_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .descriptorPool = render.texture_descriptor_pool,
+        .descriptorSetCount = 1,
+        .pSetLayouts = &render.texture_set_layout,
+    };
+    if (vkAllocateDescriptorSets(g_device, &bindless_set_alloc_info,
+                &render.bindless_desc_set) != VK_SUCCESS) {
+        fatal("Failed to allocate descriptor sets.");
+    }
 }
 
 static void setup_pipeline_layout()
 {
-    VkPushConstantRange push_constant_range = {
-        .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
-        .offset = 0,
-        .size = sizeof(PushConstants),
-    };
-
     VkDescriptorSetLayout set_layouts[3] = {
         render.desc_set_layout, render.texture_set_layout,
         render.gbuf_desc_set_layout
     };
 
+    // The bindless texture index of the draw
+    VkPushConstantRange push_constant_range = {
+        .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+        .offset = 0,
+        .size = sizeof(uint32_t),
+    };
     const VkPipelineLayoutCreateInfo pipeline_layout_info = {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
         .setLayoutCount = 3,
@@ -844,6 +1411,106 @@ static void setup_pipeline_layout()
     }
 }
 
+// Compute pipelines that cull draw slots into per primitive instance lists
+// and then write an indirect command for every primitive with instances, or
+// for every visible meshlet of clustered primitives
+static void setup_cull_pipeline()
+{
+    enum { cull_binding_count = 11 };
+    VkDescriptorSetLayoutBinding cull_bindings[cull_binding_count];
+    for (uint32_t b=0; b < cull_binding_count; b++) {
+        VkDescriptorSetLayoutBinding binding = {
+            .binding = b,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+        };
+        cull_bindings[b] = binding;
+    }
+    VkDescriptorSetLayoutCreateInfo cull_set_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .bindingCount = cull_binding_count,
+        .pBindings = cull_bindings,
+    };
+    if (vkCreateDescriptorSetLayout(g_device, &cull_set_info, NULL,
+            &render.cull_desc_set_layout) != VK_SUCCESS) {
+        fatal("Failed to create cull descriptor set layout.");
+    }
+
+    VkDescriptorPoolSize cull_pool_size = {
+        .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = cull_binding_count,
+    };
+    VkDescriptorPoolCreateInfo cull_pool_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        .poolSizeCount = 1,
+        .pPoolSizes = &cull_pool_size,
+        .maxSets = 1,
+    };
+    if (vkCreateDescriptorPool(
+            g_device, &cull_pool_info, NULL, &render.cull_descriptor_pool)
+            != VK_SUCCESS) {
+        fatal("Failed to create cull descriptor pool.");
+    }
+
+    VkDescriptorSetAllocateInfo cull_set_alloc_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .descriptorPool = render.cull_descriptor_pool,
+        .descriptorSetCount = 1,
+        .pSetLayouts = &render.cull_desc_set_layout,
+    };
+    if (vkAllocateDescriptorSets(
+            g_device, &cull_set_alloc_info, &render.cull_desc_set
+            ) != VK_SUCCESS) {
+        fatal("Failed to allocate cull descriptor set.");
+    }
+
+    VkPushConstantRange push_constant_range = {
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+        .offset = 0,
+        .size = sizeof(CullPushConstants),
+    };
+    VkPipelineLayoutCreateInfo pipeline_layout_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .setLayoutCount = 1,
+        .pSetLayouts = &render.cull_desc_set_layout,
+        .pushConstantRangeCount = 1,
+        .pPushConstantRanges = &push_constant_range,
+    };
+    if (vkCreatePipelineLayout(g_device, &pipeline_layout_info, NULL,
+            &render.cull_pipeline_layout) != VK_SUCCESS) {
+        fatal("Failed to create cull pipeline layout.");
+    }
+
+    VkComputePipelineCreateInfo pipeline_info = {
+        .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+        .stage = shader_stage_info(VK_SHADER_STAGE_COMPUTE_BIT,
+                create_shader_module("./shaders/cull.comp.spv")),
+        .layout = render.cull_pipeline_layout,
+    };
+    if (vkCreateComputePipelines(g_device, VK_NULL_HANDLE, 1, &pipeline_info,
+            NULL, &render.cull_pipeline) != VK_SUCCESS) {
+        fatal("Failed to create cull pipeline.");
+    }
+    vkDestroyShaderModule(g_device, pipeline_info.stage.module, NULL);
+
+    pipeline_info.stage = shader_stage_info(VK_SHADER_STAGE_COMPUTE_BIT,
+            create_shader_module("./shaders/emit_draws.comp.spv"));
+    if (vkCreateComputePipelines(g_device, VK_NULL_HANDLE, 1, &pipeline_info,
+            NULL, &render.emit_draws_pipeline) != VK_SUCCESS) {
+        fatal("Failed to create draw emit pipeline.");
+    }
+    vkDestroyShaderModule(g_device, pipeline_info.stage.module, NULL);
+
+    pipeline_info.stage = shader_stage_info(VK_SHADER_STAGE_COMPUTE_BIT,
+            create_shader_module("./shaders/cull_clusters.comp.spv"));
+    if (vkCreateComputePipelines(g_device, VK_NULL_HANDLE, 1, &pipeline_info,
+            NULL, &render.cull_clusters_pipeline) != VK_SUCCESS) {
+        fatal("Failed to create cluster cull pipeline.");
+    }
+    vkDestroyShaderModule(g_device, pipeline_info.stage.module, NULL);
+}
+
 static void setup_sync_primitives()
 {
     VkSemaphoreCreateInfo semaphore_info = {
@@ -861,6 +1528,37 @@ static void setup_sync_primitives()
             &render.commands_executed_fence);
 }
 
+static void create_frame_queries()
+{
+    uint32_t family_count;
+    vkGetPhysicalDeviceQueueFamilyProperties(g_physical_device,
+            &family_count, NULL);
+    VkQueueFamilyProperties* families =
+        malloc_nofail(sizeof(VkQueueFamilyProperties) * family_count);
+    vkGetPhysicalDeviceQueueFamilyProperties(g_physical_device,
+            &family_count, families);
+    uint32_t valid_bits = families[render.graphics_family].timestampValidBits;
+    mem_free(families);
+    render.gpu_timing = valid_bits > 0;
+    render.frame_queries_written = false;
+    if (!render.gpu_timing) return;
+    render.timestamp_mask =
+        valid_bits == 64 ? UINT64_MAX : (UINT64_C(1) << valid_bits) - 1;
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(g_physical_device, &properties);
+    render.timestamp_period = properties.limits.timestampPeriod;
+
+    VkQueryPoolCreateInfo query_pool_info = {
+        .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+        .queryType = VK_QUERY_TYPE_TIMESTAMP,
+        .queryCount = 2,
+    };
+    if (vkCreateQueryPool(g_device, &query_pool_info, NULL,
+                &render.frame_queries) != VK_SUCCESS) {
+        fatal("Failed to create query pool.");
+    }
+}
+
 static void allocate_command_buffers()
 {
     VkCommandBufferAllocateInfo cmdbuf_allocate_info = {
@@ -875,12 +1573,24 @@ static void allocate_command_buffers()
     }
 }
 
-void create_object_pick_pixel()
+static void create_pick_readback_buffers()
 {
-    create_2d_image(1, 1, VK_SAMPLE_COUNT_1_BIT, VK_FORMAT_R32_UINT,
-        VK_IMAGE_TILING_LINEAR, VK_IMAGE_USAGE_TRANSFER_DST_BIT,
-        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-        &render.object_pick_pixel, &render.object_pick_pixel_mem);
+    for (size_t i=0; i < FRAMES_IN_FLIGHT; i++) {
+        if (create_buffer(
+                PICK_READBACK_SIZE,
+                VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                    VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                &render.pick_readback[i])) {
+            fatal("Failed to create pick readback buffer.");
+        }
+        vkMapMemory(g_device, render.pick_readback[i].memory, 0,
+                PICK_READBACK_SIZE, 0, &render.pick_readback_mapped[i]);
+        render.picks_in_flight_count[i] = 0;
+    }
+    render.pick_queue_count = 0;
+    render.pick_result_count = 0;
+    render.next_pick_id = 1;
 }
 
 void load_blit_image(const char* filename, VkImage* image, VkDeviceMemory* memory)
@@ -898,7 +1608,7 @@ void load_blit_image(const char* filename, VkImage* image, VkDeviceMemory* memor
     stbi_image_free(pixels);
 
     // Create texture image
-    create_2d_image(tex_width, tex_height,
+    create_2d_image(tex_width, tex_height, 1,
             VK_SAMPLE_COUNT_1_BIT, VK_FORMAT_R8G8B8A8_SRGB,
             VK_IMAGE_TILING_OPTIMAL,
             VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
@@ -999,9 +1709,12 @@ void render_init() {
     setup_gbuffer_desc_set();
     setup_texture_descriptor();
     setup_pipeline_layout();
+    if (render.gpu_driven) setup_cull_pipeline();
     setup_sync_primitives();
-    create_object_pick_pixel();
-    load_texture_from_file("cursor.png", &render.cursor);
+    create_frame_queries();
+    create_pick_readback_buffers();
+    load_texture_from_file("cursor.png", &render.cursor,
+            CURSOR_TEXTURE_INDEX);
 
     Vertex2D cursor_verts[6];
     cursor_verts[0].uv[0] = 0.0;
@@ -1179,7 +1892,7 @@ static void create_swapchain()
 
     for (uint32_t i=0; i < FRAMES_IN_FLIGHT; i++) {
         create_2d_image_view(render.swapchain_images[i],
-            render.swapchain_format, VK_IMAGE_ASPECT_COLOR_BIT,
+            render.swapchain_format, VK_IMAGE_ASPECT_COLOR_BIT, 1,
             &render.swapchain_image_views[i]);
     }
 }
@@ -1334,6 +2047,107 @@ static void setup_final_render_pass()
     vkDestroyShaderModule(g_device, deferred_vertex_shader, NULL);
 }
 
+// Object code pipelines test against the G-buffer depth without writing it
+// and are scissored to the picked pixels
+static const VkDynamicState pick_dynamic_states[1] = {
+    VK_DYNAMIC_STATE_SCISSOR,
+};
+static const VkPipelineDynamicStateCreateInfo pick_dynamic_state = {
+    .sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
+    .dynamicStateCount = 1,
+    .pDynamicStates = pick_dynamic_states,
+};
+static const VkVertexInputBindingDescription compact_vertex_binding = {
+    .binding = 0,
+    .stride = sizeof(CompactVertex),
+    .inputRate = VK_VERTEX_INPUT_RATE_VERTEX,
+};
+static const VkVertexInputAttributeDescription compact_vertex_attributes[3] = {
+    {
+        .location = 0,
+        .binding = 0,
+        .format = VK_FORMAT_R16G16B16A16_UNORM,
+        .offset = offsetof(CompactVertex, position),
+    },
+    {
+        .location = 1,
+        .binding = 0,
+        .format = VK_FORMAT_R16G16_SNORM,
+        .offset = offsetof(CompactVertex, normal),
+    },
+    {
+        .location = 2,
+        .binding = 0,
+        .format = VK_FORMAT_R16G16_SFLOAT,
+        .offset = offsetof(CompactVertex, tex_coord),
+    },
+};
+static const VkPipelineVertexInputStateCreateInfo compact_vertex_input = {
+    .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
+    .vertexBindingDescriptionCount = 1,
+    .pVertexBindingDescriptions = &compact_vertex_binding,
+    .vertexAttributeDescriptionCount = 3,
+    .pVertexAttributeDescriptions = compact_vertex_attributes,
+};
+// Sets the COMPACT_VERTICES constant of mrt.vert
+static const VkBool32 compact_vertices_enabled = VK_TRUE;
+static const VkSpecializationMapEntry compact_vertices_entry = {
+    .constantID = 0,
+    .offset = 0,
+    .size = sizeof(VkBool32),
+};
+static const VkSpecializationInfo compact_vertices_specialization = {
+    .mapEntryCount = 1,
+    .pMapEntries = &compact_vertices_entry,
+    .dataSize = sizeof(VkBool32),
+    .pData = &compact_vertices_enabled,
+};
+
+// Sets the TEXTURE_COUNT and TEXTURE_INDEX constants of mrt.frag and
+// blit.frag, mrt.frag takes its index from a push constant instead
+typedef struct TextureConstants {
+    uint32_t count;
+    uint32_t index;
+} TextureConstants;
+static const VkSpecializationMapEntry texture_constant_entries[2] = {
+    {
+        .constantID = 0,
+        .offset = offsetof(TextureConstants, count),
+        .size = sizeof(uint32_t),
+    },
+    {
+        .constantID = 1,
+        .offset = offsetof(TextureConstants, index),
+        .size = sizeof(uint32_t),
+    },
+};
+
+// Creates the CompactVertex variant of a pipeline described for Vertex.
+// stages[0] must be the mrt.vert stage of pipeline_info.
+static void create_compact_variant(VkGraphicsPipelineCreateInfo* pipeline_info,
+        VkPipelineShaderStageCreateInfo* stages, VkPipeline* o_pipeline)
+{
+    const VkPipelineVertexInputStateCreateInfo* vertex_input =
+        pipeline_info->pVertexInputState;
+    stages[0].pSpecializationInfo = &compact_vertices_specialization;
+    pipeline_info->pVertexInputState = &compact_vertex_input;
+    if (vkCreateGraphicsPipelines(g_device, VK_NULL_HANDLE, 1, pipeline_info,
+                NULL, o_pipeline) != VK_SUCCESS) {
+        fatal("Failed to create graphics pipeline.");
+    }
+    stages[0].pSpecializationInfo = NULL;
+    pipeline_info->pVertexInputState = vertex_input;
+}
+
+static const VkPipelineDepthStencilStateCreateInfo pick_depth_stencil = {
+    .sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
+    .depthTestEnable = VK_TRUE,
+    .depthWriteEnable = VK_FALSE,
+    .depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL,
+    .depthBoundsTestEnable = VK_FALSE,
+    .stencilTestEnable = VK_FALSE,
+};
+
 static void setup_offscreen_render_pass()
 {
     struct VkAttachmentDescription position_attachment = {
@@ -1379,33 +2193,21 @@ static void setup_offscreen_render_pass()
         .finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
     };
 
-    struct VkAttachmentDescription object_code_attachment = {
-        .format = VK_FORMAT_R32_UINT,
-        .samples = VK_SAMPLE_COUNT_1_BIT,
-        .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
-        .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
-        .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
-        .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
-        .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-        .finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-    };
-
-    VkAttachmentDescription offscreen_descs[5] = {
+    VkAttachmentDescription offscreen_descs[4] = {
         position_attachment, normal_attachment, albedo_attachment,
-        offscreen_depth_attachment, object_code_attachment
+        offscreen_depth_attachment,
     };
-    VkAttachmentReference offscreen_color_refs[4] = {
+    VkAttachmentReference offscreen_color_refs[3] = {
         {0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL},
         {1, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL},
         {2, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL},
-        {4, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL},
     };
     VkAttachmentReference offscreen_depth_ref = {
         3, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL};
 
     VkSubpassDescription offscreen_subpass = {
         .pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
-        .colorAttachmentCount = 4,
+        .colorAttachmentCount = 3,
         .pColorAttachments = offscreen_color_refs,
         .pDepthStencilAttachment = &offscreen_depth_ref,
     };
@@ -1416,7 +2218,7 @@ static void setup_offscreen_render_pass()
 
     VkRenderPassCreateInfo offscreen_render_pass_info = {
         .sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
-        .attachmentCount = 5,
+        .attachmentCount = 4,
         .pAttachments = offscreen_descs,
         .subpassCount = 1,
         .pSubpasses = &offscreen_subpass,
@@ -1429,26 +2231,91 @@ static void setup_offscreen_render_pass()
            &render.offscreen_render_pass) != VK_SUCCESS)
         fatal("Failed to create render pass.");
 
-    create_attachment(&render.offscreen_depth, render.swapchain_extent.width,
-            render.swapchain_extent.height, depth_format,
-            VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT);
-    create_attachment(&render.offscreen_position, render.swapchain_extent.width,
-            render.swapchain_extent.height, position_attachment.format,
-            VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT);
-    create_attachment(&render.offscreen_albedo, render.swapchain_extent.width,
-            render.swapchain_extent.height, albedo_attachment.format,
-            VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT);
-    create_attachment(&render.offscreen_normal, render.swapchain_extent.width,
-            render.swapchain_extent.height, normal_attachment.format,
-            VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT);
-    create_attachment(&render.object_code, render.swapchain_extent.width,
-            render.swapchain_extent.height, VK_FORMAT_R32_UINT,
-            VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT);
-
-    // Write G-buffer descriptors
-    VkDescriptorImageInfo gbuf_desc_info = {
-        .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-        .imageView = render.offscreen_position.view,
+    // Object code pass, only run when a pick is pending. It reuses the
+    // G-buffer depth, so only the visible surfaces write their code.
+    struct VkAttachmentDescription object_code_attachment = {
+        .format = VK_FORMAT_R32_UINT,
+        .samples = VK_SAMPLE_COUNT_1_BIT,
+        .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+        .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+        .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+        .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+        .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+        .finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+    };
+    struct VkAttachmentDescription pick_depth_attachment = {
+        .format = depth_format,
+        .samples = VK_SAMPLE_COUNT_1_BIT,
+        .loadOp = VK_ATTACHMENT_LOAD_OP_LOAD,
+        .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+        .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+        .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+        .initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+        .finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+    };
+    VkAttachmentDescription pick_descs[2] = {
+        object_code_attachment, pick_depth_attachment,
+    };
+    VkAttachmentReference pick_color_ref = {
+        0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL};
+    VkAttachmentReference pick_depth_ref = {
+        1, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL};
+
+    VkSubpassDescription pick_subpass = {
+        .pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
+        .colorAttachmentCount = 1,
+        .pColorAttachments = &pick_color_ref,
+        .pDepthStencilAttachment = &pick_depth_ref,
+    };
+
+    // Wait for the G-buffer depth writes
+    VkSubpassDependency pick_dependencies[2] = {
+        default_start_dependency(), default_end_dependency()
+    };
+    pick_dependencies[0].srcStageMask |=
+        VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    pick_dependencies[0].srcAccessMask |=
+        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    pick_dependencies[0].dstStageMask |=
+        VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+    pick_dependencies[0].dstAccessMask |=
+        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT;
+
+    VkRenderPassCreateInfo pick_render_pass_info = {
+        .sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
+        .attachmentCount = 2,
+        .pAttachments = pick_descs,
+        .subpassCount = 1,
+        .pSubpasses = &pick_subpass,
+        .dependencyCount = 2,
+        .pDependencies = pick_dependencies,
+    };
+
+    if (vkCreateRenderPass(
+           g_device, &pick_render_pass_info, NULL,
+           &render.pick_render_pass) != VK_SUCCESS)
+        fatal("Failed to create render pass.");
+
+    create_attachment(&render.offscreen_depth, render.swapchain_extent.width,
+            render.swapchain_extent.height, depth_format,
+            VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT);
+    create_attachment(&render.offscreen_position, render.swapchain_extent.width,
+            render.swapchain_extent.height, position_attachment.format,
+            VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT);
+    create_attachment(&render.offscreen_albedo, render.swapchain_extent.width,
+            render.swapchain_extent.height, albedo_attachment.format,
+            VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT);
+    create_attachment(&render.offscreen_normal, render.swapchain_extent.width,
+            render.swapchain_extent.height, normal_attachment.format,
+            VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT);
+    create_attachment(&render.object_code, render.swapchain_extent.width,
+            render.swapchain_extent.height, VK_FORMAT_R32_UINT,
+            VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT);
+
+    // Write G-buffer descriptors
+    VkDescriptorImageInfo gbuf_desc_info = {
+        .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        .imageView = render.offscreen_position.view,
         .sampler = render.gbuf_sampler,
     };
     VkWriteDescriptorSet gbuf_desc_write = {
@@ -1471,17 +2338,16 @@ static void setup_offscreen_render_pass()
     vkUpdateDescriptorSets(g_device, 1, &gbuf_desc_write, 0, NULL);
 
     // Offscreen framebuffer
-    VkImageView offscreen_attachments[5] = {
+    VkImageView offscreen_attachments[4] = {
         render.offscreen_position.view,
         render.offscreen_normal.view,
         render.offscreen_albedo.view,
         render.offscreen_depth.view,
-        render.object_code.view,
     };
     VkFramebufferCreateInfo offscreen_framebuffer_info = {
         .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
         .renderPass = render.offscreen_render_pass,
-        .attachmentCount = 5,
+        .attachmentCount = 4,
         .pAttachments = offscreen_attachments,
         .width = render.swapchain_extent.width,
         .height = render.swapchain_extent.height,
@@ -1493,6 +2359,26 @@ static void setup_offscreen_render_pass()
         fatal("Failed to create framebuffer.");
     }
 
+    // Pick framebuffer
+    VkImageView pick_attachments[2] = {
+        render.object_code.view,
+        render.offscreen_depth.view,
+    };
+    VkFramebufferCreateInfo pick_framebuffer_info = {
+        .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
+        .renderPass = render.pick_render_pass,
+        .attachmentCount = 2,
+        .pAttachments = pick_attachments,
+        .width = render.swapchain_extent.width,
+        .height = render.swapchain_extent.height,
+        .layers = 1,
+    };
+
+    if (vkCreateFramebuffer(g_device, &pick_framebuffer_info, NULL,
+            &render.pick_framebuffer) != VK_SUCCESS) {
+        fatal("Failed to create framebuffer.");
+    }
+
     // G-buffer write pipeline
     VkPipelineRasterizationStateCreateInfo rasterizer =
                             default_rasterizer(VK_CULL_MODE_BACK_BIT);
@@ -1507,6 +2393,16 @@ static void setup_offscreen_render_pass()
     VkPipelineShaderStageCreateInfo shader_stages[2] = {
         vertex_shader_stage_info, fragment_shader_stage_info,
     };
+    TextureConstants texture_constants = {
+        .count = render.bindless ? render.max_textures : 1,
+    };
+    VkSpecializationInfo texture_specialization = {
+        .mapEntryCount = 2,
+        .pMapEntries = texture_constant_entries,
+        .dataSize = sizeof(TextureConstants),
+        .pData = &texture_constants,
+    };
+    shader_stages[1].pSpecializationInfo = &texture_specialization;
 
     VkVertexInputBindingDescription vertex_input_binding_description = {
         .binding = 0,
@@ -1560,15 +2456,14 @@ static void setup_offscreen_render_pass()
 
     const VkPipelineColorBlendAttachmentState color_blend_attachment =
         default_color_blend_attachment_state();
-    VkPipelineColorBlendAttachmentState blend_states[4] = {
+    VkPipelineColorBlendAttachmentState blend_states[3] = {
         color_blend_attachment, color_blend_attachment, color_blend_attachment, 
-        color_blend_attachment,
     };
 
     VkPipelineColorBlendStateCreateInfo color_blending = {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
         .logicOpEnable = VK_FALSE,
-        .attachmentCount = 4,
+        .attachmentCount = 3,
         .pAttachments = blend_states,
     };
 
@@ -1600,6 +2495,29 @@ static void setup_offscreen_render_pass()
                           &render.offscreen_graphics_pipeline) != VK_SUCCESS) {
         fatal("Failed to create graphics pipeline.");
     }
+    create_compact_variant(&pipeline_info, shader_stages,
+            &render.compact_offscreen_pipeline);
+
+    // Object code pipeline
+    vkDestroyShaderModule(g_device, shader_stages[1].module, NULL);
+    shader_stages[1] = shader_stage_info(VK_SHADER_STAGE_FRAGMENT_BIT,
+                    create_shader_module("./shaders/pick.frag.spv"));
+    color_blending.attachmentCount = 1;
+    pipeline_info.pDepthStencilState = &pick_depth_stencil;
+    pipeline_info.pDynamicState = &pick_dynamic_state;
+    pipeline_info.renderPass = render.pick_render_pass;
+
+    if (vkCreateGraphicsPipelines(
+                          g_device,
+                          VK_NULL_HANDLE,
+                          1,
+                          &pipeline_info,
+                          NULL,
+                          &render.pick_pipeline) != VK_SUCCESS) {
+        fatal("Failed to create graphics pipeline.");
+    }
+    create_compact_variant(&pipeline_info, shader_stages,
+            &render.compact_pick_pipeline);
 
     vkDestroyShaderModule(g_device, shader_stages[0].module, NULL);
     vkDestroyShaderModule(g_device, shader_stages[1].module, NULL);
@@ -1628,40 +2546,22 @@ static void setup_light_indicators_render_pass()
         .finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
     };
 
-    struct VkAttachmentDescription object_code_attachment = {
-        .format = VK_FORMAT_R32_UINT,
-        .samples = VK_SAMPLE_COUNT_1_BIT,
-        .loadOp = VK_ATTACHMENT_LOAD_OP_LOAD,
-        .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
-        .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
-        .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
-        .initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-        .finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-    };
-
     struct VkAttachmentDescription attachments[] = {
-        color_attachment, object_code_attachment, depth_attachment,
+        color_attachment, depth_attachment,
     };
 
     struct VkAttachmentReference color_attachment_ref = {
         .attachment = 0,
         .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
     };
-    struct VkAttachmentReference object_code_attachment_ref = {
-        .attachment = 1,
-        .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-    };
-    VkAttachmentReference color_refs[2] = {
-        color_attachment_ref, object_code_attachment_ref,
-    };
 
     VkAttachmentReference depth_ref = {
-        2, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL};
+        1, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL};
 
     VkSubpassDescription subpass = {
         .pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
-        .colorAttachmentCount = 2,
-        .pColorAttachments = color_refs,
+        .colorAttachmentCount = 1,
+        .pColorAttachments = &color_attachment_ref,
         .pDepthStencilAttachment = &depth_ref,
     };
 
@@ -1671,7 +2571,7 @@ static void setup_light_indicators_render_pass()
 
     VkRenderPassCreateInfo render_pass_info = {
         .sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
-        .attachmentCount = 3,
+        .attachmentCount = 2,
         .pAttachments = attachments,
         .subpassCount = 1,
         .pSubpasses = &subpass,
@@ -1684,15 +2584,14 @@ static void setup_light_indicators_render_pass()
         VK_SUCCESS) fatal("Failed to create render pass.");
 
     for (int i=0; i < FRAMES_IN_FLIGHT; i++) {
-        VkImageView attachments[3] = {
+        VkImageView attachments[2] = {
             render.swapchain_image_views[i],
-            render.object_code.view,
             render.offscreen_depth.view,
         };
         VkFramebufferCreateInfo framebuffer_info = {
             .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
             .renderPass = render.lights_ui_render_pass,
-            .attachmentCount = 3,
+            .attachmentCount = 2,
             .pAttachments = attachments,
             .width = render.swapchain_extent.width,
             .height = render.swapchain_extent.height,
@@ -1754,14 +2653,11 @@ static void setup_light_indicators_render_pass()
     const VkPipelineColorBlendAttachmentState color_blend_attachment =
         default_color_blend_attachment_state();
 
-    VkPipelineColorBlendAttachmentState lights_ui_blend_states[2] = {
-        color_blend_attachment, color_blend_attachment 
-    };
     VkPipelineColorBlendStateCreateInfo lights_ui_color_blending = {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
         .logicOpEnable = VK_FALSE,
-        .attachmentCount = 2,
-        .pAttachments = lights_ui_blend_states,
+        .attachmentCount = 1,
+        .pAttachments = &color_blend_attachment,
     };
 
     const VkViewport viewport = default_viewport
@@ -1808,6 +2704,24 @@ static void setup_light_indicators_render_pass()
         fatal("Failed to create graphics pipeline.");
     }
 
+    // Light codes for the pick pass
+    vkDestroyShaderModule(g_device, shader_stages[1].module, NULL);
+    shader_stages[1] = shader_stage_info(VK_SHADER_STAGE_FRAGMENT_BIT,
+                    create_shader_module("./shaders/pick.frag.spv"));
+    lights_ui_pipeline_info.pDepthStencilState = &pick_depth_stencil;
+    lights_ui_pipeline_info.pDynamicState = &pick_dynamic_state;
+    lights_ui_pipeline_info.renderPass = render.pick_render_pass;
+
+    if (vkCreateGraphicsPipelines(
+                              g_device,
+                              VK_NULL_HANDLE,
+                              1,
+                              &lights_ui_pipeline_info,
+                              NULL,
+                              &render.lights_pick_pipeline) != VK_SUCCESS) {
+        fatal("Failed to create graphics pipeline.");
+    }
+
     vkDestroyShaderModule(g_device, shader_stages[0].module, NULL);
     vkDestroyShaderModule(g_device, shader_stages[1].module, NULL);
 }
@@ -1918,6 +2832,18 @@ static void setup_image_blit_render_pass()
     struct VkPipelineShaderStageCreateInfo shader_stages[2] = {
         vertex_shader_stage_info, fragment_shader_stage_info,
     };
+    // The cursor is the only texture blitted
+    TextureConstants texture_constants = {
+        .count = render.bindless ? render.max_textures : 1,
+        .index = render.bindless ? CURSOR_TEXTURE_INDEX : 0,
+    };
+    VkSpecializationInfo texture_specialization = {
+        .mapEntryCount = 2,
+        .pMapEntries = texture_constant_entries,
+        .dataSize = sizeof(TextureConstants),
+        .pData = &texture_constants,
+    };
+    shader_stages[1].pSpecializationInfo = &texture_specialization;
 
     VkVertexInputBindingDescription vertex_input_binding_description = {
         .binding = 0,
@@ -1989,174 +2915,929 @@ static void render_swapchain_dependent_init()
     setup_image_blit_render_pass();
 }
 
-uint32_t get_object_code(uint32_t x, uint32_t y)
+// Queues a readback of the object codes in a rectangle of the screen.
+// Returns the request id or 0 if the queue is full.
+uint32_t render_request_pick(uint32_t x, uint32_t y,
+        uint32_t width, uint32_t height)
 {
-    // Transition the pixel to transfer dst layout
-    VkCommandBuffer cmdbuf = begin_one_time_command_buffer(
-            render.graphics_command_pool);
-    VkImageMemoryBarrier pixel_transfer_barrier = {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-        .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-        .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-        .srcAccessMask = 0,
-        .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
-        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .image = render.object_pick_pixel,
-        .subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-        .subresourceRange.baseMipLevel = 0,
-        .subresourceRange.levelCount = 1,
-        .subresourceRange.baseArrayLayer = 0,
-        .subresourceRange.layerCount = 1,
-    };
-    vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-            VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1,
-            &pixel_transfer_barrier);
+    if (render.pick_queue_count == MAX_PICK_REQUESTS) return 0;
+    if (x >= render.swapchain_extent.width ||
+            y >= render.swapchain_extent.height) return 0;
+    width = MIN(width, render.swapchain_extent.width - x);
+    height = MIN(height, render.swapchain_extent.height - y);
+    if (width == 0 || height == 0) return 0;
+    if (width * height * sizeof(uint32_t) > PICK_READBACK_SIZE) return 0;
+
+    PickRequest* request = &render.pick_queue[render.pick_queue_count++];
+    request->id = render.next_pick_id++;
+    request->x = x;
+    request->y = y;
+    request->width = width;
+    request->height = height;
+    return request->id;
+}
 
-    // Transition the color code attachment to transfer src layout
-    VkImageMemoryBarrier color_code_transfer_barrier = {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-        .oldLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-        .newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-        .srcAccessMask = 0,
-        .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
-        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .image = render.object_code.image,
-        .subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-        .subresourceRange.baseMipLevel = 0,
-        .subresourceRange.levelCount = 1,
-        .subresourceRange.baseArrayLayer = 0,
-        .subresourceRange.layerCount = 1,
-    };
-    vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-            VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1,
-            &color_code_transfer_barrier);
-
-    // Blit the pixel
-    VkImageCopy copy = {
-        .srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-        .srcSubresource.layerCount = 1,
-        .dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-        .dstSubresource.layerCount = 1,
-        .srcOffset.x = x,
-        .srcOffset.y = y,
-        .srcOffset.z = 0,
-        .dstOffset.x = 0,
-        .dstOffset.y = 0,
-        .dstOffset.z = 0,
-        .extent.width = 1,
-        .extent.height = 1,
-        .extent.depth = 1,
-    };
-    vkCmdCopyImage(cmdbuf, render.object_code.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-        render.object_pick_pixel, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-        1, &copy);
-
-    // Transition the pixel to general layout for reading (?)
-    VkImageMemoryBarrier pixel_general_layout_barrier = {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-        .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-        .newLayout = VK_IMAGE_LAYOUT_GENERAL,
-        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
-        .dstAccessMask = VK_ACCESS_MEMORY_READ_BIT,
-        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .image = render.object_pick_pixel,
-        .subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-        .subresourceRange.baseMipLevel = 0,
-        .subresourceRange.levelCount = 1,
-        .subresourceRange.baseArrayLayer = 0,
-        .subresourceRange.layerCount = 1,
-    };
-    vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
-            VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1,
-            &pixel_general_layout_barrier);
+// Pops the oldest finished pick. Results arrive one or two frames after
+// the request.
+bool render_poll_pick(PickResult* o_result)
+{
+    if (render.pick_result_count == 0) return false;
+    *o_result = render.pick_results[0];
+    render.pick_result_count--;
+    memmove(&render.pick_results[0], &render.pick_results[1],
+            sizeof(PickResult) * render.pick_result_count);
+    return true;
+}
 
+static void resolve_picks(size_t frame)
+{
+    for (uint32_t r=0; r < render.picks_in_flight_count[frame]; r++) {
+        PickRequest* request = &render.picks_in_flight[frame][r];
+        if (render.pick_result_count == MAX_PICK_REQUESTS) {
+            errprint("Pick result dropped, nobody is polling.\n");
+            continue;
+        }
+        PickResult* result = &render.pick_results[render.pick_result_count++];
+        result->id = request->id;
+        result->code_count = 0;
+
+        const uint32_t* codes = (const uint32_t*) (
+                (char*) render.pick_readback_mapped[frame] + request->offset);
+        uint32_t pixel_count = request->width * request->height;
+        uint32_t last_code = 0;
+        for (uint32_t p=0; p < pixel_count; p++) {
+            uint32_t code = codes[p];
+            if (code == 0 || code == last_code) continue;
+            last_code = code;
+
+            bool seen = false;
+            for (uint32_t c=0; c < result->code_count; c++) {
+                if (result->codes[c] == code) {
+                    seen = true;
+                    break;
+                }
+            }
+            if (!seen && result->code_count < MAX_PICK_CODES) {
+                result->codes[result->code_count++] = code;
+            }
+        }
+    }
+    render.picks_in_flight_count[frame] = 0;
+}
 
-    // Transition the color code attachment back to color attachment layout
-    VkImageMemoryBarrier color_code_attachment_barrier = {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-        .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-        .newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-        .srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
-        .dstAccessMask = VK_ACCESS_MEMORY_WRITE_BIT,
-        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .image = render.object_code.image,
-        .subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-        .subresourceRange.baseMipLevel = 0,
-        .subresourceRange.levelCount = 1,
-        .subresourceRange.baseArrayLayer = 0,
-        .subresourceRange.layerCount = 1,
-    };
-    vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
-            VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1,
-            &color_code_attachment_barrier);
+static void build_draws_job(void* data, uint32_t begin, uint32_t end,
+        uint32_t thread)
+{
+    (void) data;
+    uint32_t first = render.node_draw_offsets[begin];
+    DrawCommand* draw = &render.draws[first];
+    uint32_t nodes_drawn = 0;
+    uint32_t nodes_culled = 0;
+    for (uint32_t n=begin; n < end; n++) {
+        Node* node = &scene.nodes[n];
+        if (!node->mesh || render.batched[node->transform]) continue;
+        if (!render.visible[node->transform]) {
+            nodes_culled++;
+            continue;
+        }
+        nodes_drawn++;
+        uint32_t lod = render.lods[node->transform];
+        for (size_t p=0; p < node->mesh->primitives_count; p++) {
+            draw->transform = node->transform;
+            draw->primitive = node->mesh->first_primitive + p;
+            draw->lod = MIN(lod, node->mesh->primitives[p].lod_count - 1);
+            draw++;
+        }
+    }
+    render.partial_draw_first[thread] = first;
+    render.partial_draw_count[thread] = draw - &render.draws[first];
+    render.partial_nodes_drawn[thread] = nodes_drawn;
+    render.partial_nodes_culled[thread] = nodes_culled;
+}
 
-    submit_one_time_command_buffer(
-            render.graphics_queue, cmdbuf,
-            render.graphics_command_pool);
+// Each job thread fills the draw slots of its node slice, then the partial
+// lists are packed together in thread order, which is node order
+static void build_draw_list()
+{
+    memset(render.partial_draw_count, 0, sizeof(render.partial_draw_count));
+    memset(render.partial_nodes_drawn, 0, sizeof(render.partial_nodes_drawn));
+    memset(render.partial_nodes_culled, 0,
+            sizeof(render.partial_nodes_culled));
+    jobs_parallel_for(build_draws_job, NULL, scene.node_count,
+            MIN_NODES_PER_DRAW_JOB);
+
+    render.stats.nodes_drawn = 0;
+    render.stats.nodes_culled = 0;
+    uint32_t count = 0;
+    for (uint32_t t=0; t < MAX_JOB_THREADS; t++) {
+        render.stats.nodes_drawn += render.partial_nodes_drawn[t];
+        render.stats.nodes_culled += render.partial_nodes_culled[t];
+        uint32_t partial_count = render.partial_draw_count[t];
+        if (!partial_count) continue;
+        if (render.partial_draw_first[t] != count) {
+            memmove(&render.draws[count],
+                    &render.draws[render.partial_draw_first[t]],
+                    sizeof(DrawCommand) * partial_count);
+        }
+        count += partial_count;
+    }
+    render.draw_count = count;
+}
 
-    // Read and return the pixel
-    const char* data;
-    vkMapMemory(g_device, render.object_pick_pixel_mem, 0, VK_WHOLE_SIZE,
-            0, (void**) &data);
-    uint32_t value = *((uint32_t*) data);
-    vkUnmapMemory(g_device, render.object_pick_pixel_mem);
-    return value;
+static uint32_t draw_group_key(DrawCommand* draw)
+{
+    return draw->primitive * MAX_LODS + draw->lod;
 }
 
-void render_draw_frame(vec3 cam_pos, vec3 cam_dir, vec3 cam_up) {
-    size_t current_frame = render.current_frame;
+// Counting sort of the visible draws by primitive and LOD. Every LOD of a
+// primitive with visible instances becomes one instanced draw.
+static void group_draws()
+{
+    uint32_t key_count = scene.primitive_count * MAX_LODS;
+    uint32_t* counts = render.primitive_instances;
+    memset(counts, 0, sizeof(uint32_t) * key_count);
+    for (uint32_t d=0; d < render.draw_count; d++) {
+        counts[draw_group_key(&render.draws[d])]++;
+    }
 
-    double time = glfwGetTime();
-    if (time - render.timestamp > 0.2) {
-        //printf("fps: %f\n", render.frames / (time - render.timestamp));
-        render.frames = 0;
-        render.timestamp = time;
+    uint32_t group_count = 0;
+    uint32_t first_instance = 0;
+    render.stats.vertices = 0;
+    for (uint32_t k=0; k < key_count; k++) {
+        uint32_t instance_count = counts[k];
+        if (!instance_count) continue;
+        Primitive* primitive = render.primitives[k / MAX_LODS];
+        Lod* lod = &primitive->lods[k % MAX_LODS];
+        render.stats.vertices += lod->vertex_count * instance_count;
+        DrawGroup* group = &render.groups[group_count];
+        group->texture_id = primitive->texture_id;
+        group->index_count = lod->index_count;
+        group->index_offset = lod->index_offset;
+        group->vertex_offset = primitive->vertex_offset;
+        group->wide_indices = primitive->wide_indices;
+        group->first_instance = first_instance;
+        group->instance_count = 0;
+        first_instance += instance_count;
+        // From here on the key's group
+        counts[k] = group_count++;
     }
 
-    // Upload MRT UBO
-    MrtUbo uniform;
-    mat4 proj;
-    glm_perspective(0.6,
-        render.swapchain_extent.width /
-        (float) render.swapchain_extent.height, 0.01, 1000.0, proj);
-    proj[1][1] *= -1;
-    mat4 view;
-    glm_look(cam_pos, cam_dir, cam_up, view);
-    glm_mat4_mul(proj, view, uniform.view_proj);
-    upload_to_device_local_buffer(
-            (void*) &uniform,
-            sizeof(uniform),
-            &render.ubo_buffer,
-            render.graphics_queue,
-            render.graphics_command_pool
-    );
+    for (uint32_t d=0; d < render.draw_count; d++) {
+        DrawCommand* draw = &render.draws[d];
+        DrawGroup* group = &render.groups[counts[draw_group_key(draw)]];
+        render.instances[group->first_instance + group->instance_count++] =
+            draw->transform;
+    }
+    render.group_count = group_count;
+    render.stats.draws = group_count;
+}
 
-    // Upload deferred fragment shader UBO
-    DeferredUbo defubo;
-    memcpy(&defubo.view_pos, cam_pos, sizeof(vec3));
-    defubo.light_count = LIGHT_COUNT;
-    upload_to_device_local_buffer(
-            (void*) &defubo,
-            sizeof(defubo),
-            &render.deferred_ubo_buffer,
-            render.graphics_queue,
-            render.graphics_command_pool
-    );
+// Orders the groups by sort key so the draw loop only rebinds on change.
+// A group's depth is that of its nearest instance.
+static void sort_draws(vec3 cam_pos, vec3 cam_dir)
+{
+    Hierarchy* h = &scene.hierarchy;
+    vec3 forward;
+    glm_vec3_normalize_to(cam_dir, forward);
+    uint64_t pipeline = 0; // The G-buffer pipeline is the only one for now
+    for (uint32_t g=0; g < render.group_count; g++) {
+        DrawGroup* group = &render.groups[g];
+        float depth = FLT_MAX;
+        for (uint32_t i=0; i < group->instance_count; i++) {
+            uint32_t t = render.instances[group->first_instance + i];
+            vec3 center;
+            glm_vec3_add(h->world_min[t], h->world_max[t], center);
+            glm_vec3_scale(center, 0.5f, center);
+            glm_vec3_sub(center, cam_pos, center);
+            depth = MIN(depth, glm_vec3_dot(center, forward));
+        }
+        float depth_unorm = glm_clamp(depth / Z_FAR, 0.0f, 1.0f);
+        uint64_t depth_bucket =
+            (uint64_t) (depth_unorm * SORT_KEY_DEPTH_MAX);
+        render.sort_keys[g] =
+            pipeline << SORT_KEY_PIPELINE_SHIFT |
+            (uint64_t) group->wide_indices << SORT_KEY_INDEX_SHIFT |
+            (uint64_t) group->texture_id << SORT_KEY_TEXTURE_SHIFT |
+            depth_bucket << SORT_KEY_DEPTH_SHIFT |
+            g;
+    }
+    radix_sort_u64(render.sort_keys, render.sort_scratch, render.group_count);
+}
 
-    uint32_t image_index;
-    VkResult acquire_image_result =
-        vkAcquireNextImageKHR(g_device, render.swapchain, UINT64_MAX,
-                render.image_available_semaphore, VK_NULL_HANDLE,
-                &image_index);
+typedef struct CullJob {
+    Frustum* frustum;
+    uint32_t first;
+} CullJob;
 
-    if (acquire_image_result == VK_ERROR_OUT_OF_DATE_KHR) {
-        recreate_swapchain();
-        return;
-    } else if (acquire_image_result != VK_SUCCESS &&
+static void cull_job(void* data, uint32_t begin, uint32_t end,
+        uint32_t thread)
+{
+    (void) thread;
+    CullJob* job = data;
+    cull_hierarchy(&scene.hierarchy, job->frustum, render.cull_masks,
+            render.visible, job->first + begin, job->first + end);
+}
+
+// Level by level, so each subtree is tested only with the planes its
+// parent still crosses
+static void cull_scene()
+{
+    Hierarchy* h = &scene.hierarchy;
+    for (uint32_t l=0; l < h->level_count; l++) {
+        CullJob job = {&render.frustum, h->level_offsets[l]};
+        jobs_parallel_for(cull_job, &job,
+                h->level_offsets[l + 1] - h->level_offsets[l],
+                MIN_NODES_PER_CULL_JOB);
+    }
+}
+
+typedef struct LodJob {
+    float* cam_pos;
+    float pixel_scale; // Pixels per unit of error at distance 1
+} LodJob;
+
+static void select_lods_job(void* data, uint32_t begin, uint32_t end,
+        uint32_t thread)
+{
+    (void) thread;
+    LodJob* job = data;
+    Hierarchy* h = &scene.hierarchy;
+    for (uint32_t n=begin; n < end; n++) {
+        Node* node = &scene.nodes[n];
+        uint32_t t = node->transform;
+        if (!node->mesh || node->mesh->lod_count == 1 || render.batched[t])
+            continue;
+
+        // Nearest point of the world bounds, the scale turns local errors
+        // into world ones
+        vec3 nearest;
+        glm_vec3_maxv(job->cam_pos, h->world_min[t], nearest);
+        glm_vec3_minv(nearest, h->world_max[t], nearest);
+        float distance = MAX(glm_vec3_distance(nearest, job->cam_pos),
+                Z_NEAR);
+        float scale2 = 0.0f;
+        for (int c=0; c < 3; c++) {
+            scale2 = MAX(scale2, glm_vec3_norm2(h->world[t][c]));
+        }
+        float limit = LOD_PIXEL_ERROR * distance /
+            (job->pixel_scale * sqrtf(scale2));
+
+        // Errors grow with the LOD, take the coarsest within the limit
+        uint32_t current = render.lods[t];
+        uint32_t lod = 0;
+        for (uint32_t l=1; l < node->mesh->lod_count; l++) {
+            float error = node->mesh->lod_errors[l];
+            if (l > current) error /= 1.0f - LOD_HYSTERESIS;
+            if (error > limit) break;
+            lod = l;
+        }
+        render.lods[t] = lod;
+    }
+}
+
+// Picks the LOD of every mesh node from the error it would show on
+// screen. Needs the world bounds of this frame.
+static void select_lods(vec3 cam_pos)
+{
+    LodJob job = {
+        cam_pos,
+        render.swapchain_extent.height / (2.0f * tanf(FOV_Y * 0.5f)),
+    };
+    jobs_parallel_for(select_lods_job, &job, scene.node_count,
+            MIN_NODES_PER_LOD_JOB);
+}
+
+// Hands the selected LODs to the culling shader. The previous frame must
+// have finished.
+static void upload_lods()
+{
+    for (size_t n=0; n < scene.node_count; n++) {
+        Node* node = &scene.nodes[n];
+        if (!node->mesh) continue;
+        render.transforms_mapped[node->transform].lod =
+            render.lods[node->transform];
+    }
+}
+
+void render_get_stats(RenderStats* o_stats)
+{
+    *o_stats = render.stats;
+}
+
+void render_set_print_stats(bool enabled)
+{
+    render.print_stats = enabled;
+}
+
+void render_set_base_mip_only(bool enabled)
+{
+    if (render.base_mip_only == enabled) return;
+    // The descriptors may be in use by the frame in flight
+    vkDeviceWaitIdle(g_device);
+    render.base_mip_only = enabled;
+    for (size_t i=0; i < render.texture_count; i++) {
+        update_texture_descriptor(&render.textures[i]);
+    }
+}
+
+static void upload_transforms_job(void* data, uint32_t begin, uint32_t end,
+        uint32_t thread)
+{
+    (void) data;
+    (void) thread;
+    Hierarchy* h = &scene.hierarchy;
+    for (uint32_t i=begin; i < end; i++) {
+        if (!h->changed[i]) continue;
+        h->changed[i] = 0;
+        GpuTransform* dst = &render.transforms_mapped[i];
+        // Moved nodes were detached from their batches already
+        dst->flags = 0;
+        glm_mat4_copy(h->world[i], dst->model);
+        mat3 normal;
+        glm_mat4_pick3(h->world[i], normal);
+        glm_mat3_inv(normal, normal);
+        glm_mat3_transpose(normal);
+        for (int c=0; c < 3; c++) glm_vec4(normal[c], 0.0f, dst->normal[c]);
+    }
+}
+
+// Writes the entries whose world matrix changed since the last upload into
+// the mapped transform buffer. The previous frame must have finished.
+static void upload_transforms()
+{
+    if (!scene.transforms_changed) return;
+    jobs_parallel_for(upload_transforms_job, NULL, scene.hierarchy.count,
+            MIN_TRANSFORMS_PER_UPLOAD_JOB);
+    scene.transforms_changed = false;
+}
+
+// The previous frame must have finished
+static void upload_instances()
+{
+    memcpy(render.instance_mapped, render.instances,
+            sizeof(uint32_t) * render.draw_count);
+}
+
+// Cuts the nodes whose transform changed out of their batches, they are
+// culled and drawn like any other node from then on
+static void detach_moved_nodes()
+{
+    if (!scene.transforms_changed) return;
+    Hierarchy* h = &scene.hierarchy;
+    for (uint32_t b=0; b < render.batch_count; b++) {
+        StaticBatch* batch = &render.batches[b];
+        for (uint32_t m=0; m < batch->member_count; m++) {
+            BatchMember* member =
+                &render.batch_members[batch->member_first + m];
+            if (member->detached || !h->changed[member->transform]) continue;
+            member->detached = true;
+            render.batched[member->transform] = 0;
+            batch->dirty = true;
+            render.batches_dirty = true;
+        }
+    }
+}
+
+// Compacts the index ranges of the members still attached. The previous
+// frame must have finished.
+static void rebuild_dirty_batches()
+{
+    if (!render.batches_dirty) return;
+    for (uint32_t b=0; b < render.batch_count; b++) {
+        StaticBatch* batch = &render.batches[b];
+        if (!batch->dirty) continue;
+        batch->dirty = false;
+        glm_vec3_copy((vec3) {FLT_MAX, FLT_MAX, FLT_MAX}, batch->min);
+        glm_vec3_copy((vec3) {-FLT_MAX, -FLT_MAX, -FLT_MAX}, batch->max);
+        uint32_t count = 0;
+        for (uint32_t m=0; m < batch->member_count; m++) {
+            BatchMember* member =
+                &render.batch_members[batch->member_first + m];
+            if (member->detached) continue;
+            uint32_t size = render.batch_index_size;
+            memcpy((char*) render.batch_scratch + size * count,
+                    (char*) render.batch_source_indices +
+                        size * member->source_first,
+                    size * member->index_count);
+            member->index_first = count;
+            count += member->index_count;
+            glm_vec3_minv(batch->min, member->min, batch->min);
+            glm_vec3_maxv(batch->max, member->max, batch->max);
+        }
+        batch->index_count = count;
+        if (!count) continue;
+        upload_to_device_local_buffer_at(
+                render.batch_scratch,
+                render.batch_index_size * count,
+                &render.batch_index_buffer,
+                render.batch_index_size * batch->index_offset,
+                render.graphics_queue,
+                render.graphics_command_pool
+        );
+    }
+    render.batches_dirty = false;
+}
+
+// Batches are culled as a whole, their members are not tested on their own
+static void cull_batches()
+{
+    render.stats.batches = 0;
+    for (uint32_t b=0; b < render.batch_count; b++) {
+        StaticBatch* batch = &render.batches[b];
+        batch->visible = batch->index_count && frustum_test_box(
+                &render.frustum, batch->min, batch->max,
+                FRUSTUM_ALL_PLANES) != FRUSTUM_CULLED;
+        if (!batch->visible) continue;
+        render.stats.batches++;
+        render.stats.vertices += batch->vertex_count;
+    }
+}
+
+static void bind_index_buffer(VkCommandBuffer cmdbuf, bool wide)
+{
+    if (wide) {
+        vkCmdBindIndexBuffer(cmdbuf,
+                render.index_buffer32.buffer, 0, VK_INDEX_TYPE_UINT32);
+    } else {
+        vkCmdBindIndexBuffer(cmdbuf,
+                render.index_buffer.buffer, 0, VK_INDEX_TYPE_UINT16);
+    }
+}
+
+// Binds set 0, and with it the bindless texture array when textures are
+// bound. Returns the texture set binds.
+static uint32_t bind_scene_sets(VkCommandBuffer cmdbuf, bool bind_textures)
+{
+    VkDescriptorSet sets[2] = {render.desc_set, render.bindless_desc_set};
+    bool bindless = bind_textures && render.bindless;
+    vkCmdBindDescriptorSets(cmdbuf,
+            VK_PIPELINE_BIND_POINT_GRAPHICS, render.graphics_pipeline_layout,
+            0, bindless ? 2 : 1, sets, 0, NULL);
+    return bindless;
+}
+
+// Selects the texture of the next draws, by index into the bindless array
+// or by binding its own set. Returns the texture set binds.
+static uint32_t bind_texture(VkCommandBuffer cmdbuf, uint32_t texture_id)
+{
+    Texture* texture = &render.textures[texture_id];
+    if (render.bindless) {
+        vkCmdPushConstants(cmdbuf, render.graphics_pipeline_layout,
+                VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(uint32_t),
+                &texture->descriptor_index);
+        return 0;
+    }
+    vkCmdBindDescriptorSets(cmdbuf,
+            VK_PIPELINE_BIND_POINT_GRAPHICS, render.graphics_pipeline_layout,
+            1, 1, &texture->desc_set, 0, NULL);
+    return 1;
+}
+
+static uint32_t draw_nodes(VkCommandBuffer cmdbuf, bool bind_textures)
+{
+    VkDeviceSize offset = 0;
+    vkCmdBindVertexBuffers(cmdbuf, 0, 1, &render.vertex_buffer.buffer, &offset);
+    uint32_t binds = bind_scene_sets(cmdbuf, bind_textures);
+
+    int bound_width = -1;
+    uint32_t bound_texture = UINT32_MAX;
+    for (uint32_t k=0; k < render.group_count; k++) {
+        DrawGroup* group =
+            &render.groups[render.sort_keys[k] & SORT_KEY_GROUP_MASK];
+        if (group->wide_indices != bound_width) {
+            bind_index_buffer(cmdbuf, group->wide_indices);
+            bound_width = group->wide_indices;
+        }
+        if (bind_textures && group->texture_id != bound_texture) {
+            binds += bind_texture(cmdbuf, group->texture_id);
+            bound_texture = group->texture_id;
+        }
+        vkCmdDrawIndexed(cmdbuf,
+            group->index_count, group->instance_count, group->index_offset,
+            group->vertex_offset, group->first_instance);
+    }
+    return binds;
+}
+
+// One indirect count draw per bucket, so the CPU cost depends on the
+// texture count only
+static uint32_t draw_indirect(VkCommandBuffer cmdbuf, bool bind_textures)
+{
+    VkDeviceSize offset = 0;
+    vkCmdBindVertexBuffers(cmdbuf, 0, 1, &render.vertex_buffer.buffer, &offset);
+    uint32_t binds = bind_scene_sets(cmdbuf, bind_textures);
+
+    int bound_width = -1;
+    for (uint32_t b=0; b < render.bucket_count; b++) {
+        if (!render.bucket_sizes[b]) continue;
+        uint32_t t = b % render.texture_count;
+        bool wide = b >= render.texture_count;
+        if (wide != bound_width) {
+            bind_index_buffer(cmdbuf, wide);
+            bound_width = wide;
+        }
+        if (bind_textures) binds += bind_texture(cmdbuf, t);
+        vkCmdDrawIndexedIndirectCount(cmdbuf,
+                render.indirect_commands.buffer,
+                sizeof(VkDrawIndexedIndirectCommand) * render.bucket_offsets[b],
+                render.indirect_counts.buffer,
+                sizeof(uint32_t) * b,
+                render.bucket_sizes[b],
+                sizeof(VkDrawIndexedIndirectCommand));
+    }
+    return binds;
+}
+
+// Batch geometry is in world space already, its instances point at identity
+// transforms. The pick pass draws member by member so every member keeps
+// the node id of its own entry.
+static uint32_t draw_batches(VkCommandBuffer cmdbuf, bool bind_textures)
+{
+    if (!render.stats.batches) return 0;
+    VkDeviceSize offset = 0;
+    vkCmdBindVertexBuffers(cmdbuf, 0, 1,
+            &render.batch_vertex_buffer.buffer, &offset);
+    vkCmdBindIndexBuffer(cmdbuf, render.batch_index_buffer.buffer, 0,
+            render.batch_index_size == sizeof(uint32_t) ?
+                VK_INDEX_TYPE_UINT32 : VK_INDEX_TYPE_UINT16);
+    uint32_t binds = bind_scene_sets(cmdbuf, bind_textures);
+    for (uint32_t b=0; b < render.batch_count; b++) {
+        StaticBatch* batch = &render.batches[b];
+        if (!batch->visible) continue;
+        uint32_t first_instance =
+            render.batch_instance_offset + batch->member_first;
+        if (bind_textures) {
+            binds += bind_texture(cmdbuf, batch->texture_id);
+            vkCmdDrawIndexed(cmdbuf, batch->index_count, 1,
+                    batch->index_offset, batch->vertex_offset, first_instance);
+            continue;
+        }
+        for (uint32_t m=0; m < batch->member_count; m++) {
+            BatchMember* member =
+                &render.batch_members[batch->member_first + m];
+            if (member->detached) continue;
+            vkCmdDrawIndexed(cmdbuf, member->index_count, 1,
+                    batch->index_offset + member->index_first,
+                    batch->vertex_offset, first_instance + m);
+        }
+    }
+    return binds;
+}
+
+static void draw_scene(VkCommandBuffer cmdbuf, bool bind_textures)
+{
+    uint32_t binds = draw_batches(cmdbuf, bind_textures);
+    if (render.gpu_driven) {
+        binds += draw_indirect(cmdbuf, bind_textures);
+    } else {
+        binds += draw_nodes(cmdbuf, bind_textures);
+    }
+    if (bind_textures) render.stats.binds = binds;
+}
+
+// Culls every draw slot against the frustum into the instance list of its
+// primitive's selected LOD record, then emits one instanced command per
+// record with instances into its texture bucket. Meshlets of the visible
+// clustered draws at LOD 0 are culled and emitted alongside. Must be
+// recorded outside a render pass.
+static void record_gpu_cull(VkCommandBuffer cmdbuf, mat4 view_proj,
+        vec3 cam_pos)
+{
+    vkCmdFillBuffer(cmdbuf, render.indirect_counts.buffer, 0,
+            VK_WHOLE_SIZE, 0);
+    vkCmdFillBuffer(cmdbuf, render.cull_stats.buffer, 0,
+            sizeof(GpuCullStats), 0);
+    vkCmdFillBuffer(cmdbuf, render.instance_counts.buffer, 0,
+            VK_WHOLE_SIZE, 0);
+    VkMemoryBarrier clear_barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_SHADER_READ_BIT |
+            VK_ACCESS_SHADER_WRITE_BIT,
+    };
+    vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &clear_barrier,
+            0, NULL, 0, NULL);
+
+    CullPushConstants push_consts;
+    glm_frustum_planes(view_proj, push_consts.planes);
+    glm_vec4(cam_pos, 1.0f, push_consts.camera);
+    push_consts.draw_count = render.gpu_draw_count;
+    push_consts.record_count = render.gpu_record_count;
+    push_consts.cluster_count = render.cluster_count;
+    push_consts.pad = 0;
+    vkCmdBindDescriptorSets(cmdbuf,
+            VK_PIPELINE_BIND_POINT_COMPUTE, render.cull_pipeline_layout,
+            0, 1, &render.cull_desc_set, 0, NULL);
+    vkCmdPushConstants(cmdbuf, render.cull_pipeline_layout,
+            VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(CullPushConstants),
+            &push_consts);
+    vkCmdBindPipeline(cmdbuf,
+            VK_PIPELINE_BIND_POINT_COMPUTE, render.cull_pipeline);
+    vkCmdDispatch(cmdbuf,
+            (render.gpu_draw_count + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE,
+            1, 1);
+
+    VkMemoryBarrier cull_barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_SHADER_READ_BIT |
+            VK_ACCESS_SHADER_WRITE_BIT,
+    };
+    vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &cull_barrier,
+            0, NULL, 0, NULL);
+
+    vkCmdBindPipeline(cmdbuf,
+            VK_PIPELINE_BIND_POINT_COMPUTE, render.emit_draws_pipeline);
+    vkCmdDispatch(cmdbuf,
+            (render.gpu_record_count + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE,
+            1, 1);
+    if (render.cluster_count) {
+        // Shares the bucket counters with the emit pass through atomics
+        vkCmdBindPipeline(cmdbuf,
+                VK_PIPELINE_BIND_POINT_COMPUTE, render.cull_clusters_pipeline);
+        vkCmdDispatch(cmdbuf,
+                (render.cluster_count + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE,
+                1, 1);
+    }
+
+    // Commands and counts feed the draws, instances the vertex shader and
+    // the counts also the stats once the frame is done
+    VkMemoryBarrier emit_barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT |
+            VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_HOST_READ_BIT,
+    };
+    vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+                VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+                VK_PIPELINE_STAGE_HOST_BIT,
+            0, 1, &emit_barrier, 0, NULL, 0, NULL);
+}
+
+// GPU time of the last finished frame
+static void read_frame_time()
+{
+    render.stats.gpu_ms = 0.0f;
+    if (!render.frame_queries_written) return;
+    uint64_t ticks[2];
+    if (vkGetQueryPoolResults(g_device, render.frame_queries, 0, 2,
+                sizeof(ticks), ticks, sizeof(uint64_t),
+                VK_QUERY_RESULT_64_BIT) != VK_SUCCESS) return;
+    uint64_t elapsed = (ticks[1] - ticks[0]) & render.timestamp_mask;
+    render.stats.gpu_ms = elapsed * render.timestamp_period / 1e6f;
+}
+
+// Draw counts of the last finished GPU-driven frame
+static void read_gpu_stats()
+{
+    const uint32_t* counts = render.indirect_counts_mapped;
+    uint32_t draws = 0;
+    for (uint32_t b=0; b < render.bucket_count; b++) draws += counts[b];
+    const GpuCullStats* cull_stats = render.cull_stats_mapped;
+    render.stats.nodes_drawn = cull_stats->draws_visible;
+    render.stats.nodes_culled = cull_stats->draws_culled;
+    render.stats.draws = draws;
+    render.stats.vertices = cull_stats->vertices;
+    render.stats.clusters = render.cluster_count;
+    render.stats.cluster_triangles = render.cluster_triangles;
+    render.stats.clusters_culled = cull_stats->clusters_culled;
+    render.stats.frustum_culled_triangles =
+        cull_stats->frustum_culled_triangles;
+    render.stats.backface_culled_triangles =
+        cull_stats->backface_culled_triangles;
+}
+
+// Renders object codes for the queued pick rectangles and copies them into
+// this frame's readback buffer. Runs after the G-buffer pass, whose depth
+// limits the code writes to visible surfaces.
+static void record_picks(VkCommandBuffer cmdbuf, size_t frame)
+{
+    VkDeviceSize readback_offset = 0;
+    uint32_t taken = 0;
+    while (taken < render.pick_queue_count) {
+        PickRequest* request = &render.pick_queue[taken];
+        VkDeviceSize size =
+            request->width * request->height * sizeof(uint32_t);
+        if (readback_offset + size > PICK_READBACK_SIZE) break;
+        request->offset = readback_offset;
+        render.picks_in_flight[frame][taken] = *request;
+        readback_offset += size;
+        taken++;
+    }
+    render.picks_in_flight_count[frame] = taken;
+    render.pick_queue_count -= taken;
+    memmove(&render.pick_queue[0], &render.pick_queue[taken],
+            sizeof(PickRequest) * render.pick_queue_count);
+    if (taken == 0) return;
+
+    // Only rasterize the bounding rectangle of the picks
+    uint32_t min_x = UINT32_MAX;
+    uint32_t min_y = UINT32_MAX;
+    uint32_t max_x = 0;
+    uint32_t max_y = 0;
+    for (uint32_t r=0; r < taken; r++) {
+        PickRequest* request = &render.picks_in_flight[frame][r];
+        min_x = MIN(min_x, request->x);
+        min_y = MIN(min_y, request->y);
+        max_x = MAX(max_x, request->x + request->width);
+        max_y = MAX(max_y, request->y + request->height);
+    }
+    VkRect2D pick_area = {
+        .offset = {min_x, min_y},
+        .extent = {max_x - min_x, max_y - min_y},
+    };
+
+    VkClearValue pick_clear_values[2] = {
+        { .color.uint32 = {0, 0, 0, 0} },
+        { .depthStencil = {1.0f, 0} },
+    };
+    VkRenderPassBeginInfo pick_pass_info = {
+        .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+        .renderPass = render.pick_render_pass,
+        .framebuffer = render.pick_framebuffer,
+        .renderArea = pick_area,
+        .clearValueCount = 2,
+        .pClearValues = pick_clear_values,
+    };
+    vkCmdBeginRenderPass(cmdbuf, &pick_pass_info, VK_SUBPASS_CONTENTS_INLINE);
+    vkCmdSetScissor(cmdbuf, 0, 1, &pick_area);
+
+    vkCmdBindPipeline(cmdbuf, VK_PIPELINE_BIND_POINT_GRAPHICS,
+            scene.compact_vertices ?
+                render.compact_pick_pipeline : render.pick_pipeline);
+    draw_scene(cmdbuf, false);
+
+    VkDeviceSize offset = 0;
+    vkCmdBindVertexBuffers(cmdbuf, 0, 1, &render.lights_buffer.buffer, &offset);
+    vkCmdBindPipeline(cmdbuf,
+            VK_PIPELINE_BIND_POINT_GRAPHICS, render.lights_pick_pipeline);
+    vkCmdDraw(cmdbuf, LIGHT_COUNT, 1, 0, 0);
+    vkCmdEndRenderPass(cmdbuf);
+
+    VkImageMemoryBarrier code_transfer_barrier = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .oldLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+        .newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = render.object_code.image,
+        .subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .subresourceRange.baseMipLevel = 0,
+        .subresourceRange.levelCount = 1,
+        .subresourceRange.baseArrayLayer = 0,
+        .subresourceRange.layerCount = 1,
+    };
+    vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+            VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1,
+            &code_transfer_barrier);
+
+    VkBufferImageCopy regions[MAX_PICK_REQUESTS];
+    for (uint32_t r=0; r < taken; r++) {
+        PickRequest* request = &render.picks_in_flight[frame][r];
+        VkBufferImageCopy region = {
+            .bufferOffset = request->offset,
+            .bufferRowLength = 0,
+            .bufferImageHeight = 0,
+            .imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+            .imageSubresource.mipLevel = 0,
+            .imageSubresource.baseArrayLayer = 0,
+            .imageSubresource.layerCount = 1,
+            .imageOffset = {request->x, request->y, 0},
+            .imageExtent = {request->width, request->height, 1},
+        };
+        regions[r] = region;
+    }
+    vkCmdCopyImageToBuffer(cmdbuf, render.object_code.image,
+            VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            render.pick_readback[frame].buffer, taken, regions);
+
+    VkBufferMemoryBarrier readback_barrier = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_HOST_READ_BIT,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .buffer = render.pick_readback[frame].buffer,
+        .offset = 0,
+        .size = VK_WHOLE_SIZE,
+    };
+    vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_PIPELINE_STAGE_HOST_BIT, 0, 0, NULL, 1, &readback_barrier,
+            0, NULL);
+}
+
+static void make_view_proj(vec3 cam_pos, vec3 cam_dir, vec3 cam_up, mat4 dest)
+{
+    mat4 proj;
+    glm_perspective(FOV_Y,
+        render.swapchain_extent.width /
+        (float) render.swapchain_extent.height, Z_NEAR, Z_FAR, proj);
+    proj[1][1] *= -1;
+    mat4 view;
+    glm_look(cam_pos, cam_dir, cam_up, view);
+    glm_mat4_mul(proj, view, dest);
+}
+
+void render_cursor_ray(uint32_t x, uint32_t y,
+        vec3 cam_pos, vec3 cam_dir, vec3 cam_up, vec3 o_origin, vec3 o_dir)
+{
+    mat4 view_proj;
+    make_view_proj(cam_pos, cam_dir, cam_up, view_proj);
+    mat4 inv_view_proj;
+    glm_mat4_inv(view_proj, inv_view_proj);
+
+    // Unproject the pixel center on the far plane
+    vec4 far_point = {
+        (x + 0.5f) / render.swapchain_extent.width * 2.0f - 1.0f,
+        (y + 0.5f) / render.swapchain_extent.height * 2.0f - 1.0f,
+        1.0f,
+        1.0f,
+    };
+    glm_mat4_mulv(inv_view_proj, far_point, far_point);
+    glm_vec4_scale(far_point, 1.0f / far_point[3], far_point);
+
+    glm_vec3_copy(cam_pos, o_origin);
+    glm_vec3_sub(far_point, cam_pos, o_dir);
+    glm_vec3_normalize(o_dir);
+}
+
+static void print_stats()
+{
+    printf("%s drawn: %u, culled: %u, draws: %u, batches: %u, "
+            "binds: %u\n", render.gpu_driven ? "node primitives" : "nodes",
+            render.stats.nodes_drawn, render.stats.nodes_culled,
+            render.stats.draws, render.stats.batches, render.stats.binds);
+    printf("vertex fetch: %zu KB as Vertex, %zu KB as CompactVertex\n",
+            sizeof(Vertex) * render.stats.vertices / 1024,
+            sizeof(CompactVertex) * render.stats.vertices / 1024);
+    printf("clusters: %u of %u culled, triangles culled: %u by frustum, "
+            "%u backfacing of %u\n",
+            render.stats.clusters_culled, render.stats.clusters,
+            render.stats.frustum_culled_triangles,
+            render.stats.backface_culled_triangles,
+            render.stats.cluster_triangles);
+}
+
+void render_draw_frame(vec3 cam_pos, vec3 cam_dir, vec3 cam_up) {
+    size_t current_frame = render.current_frame;
+
+    double time = glfwGetTime();
+    if (time - render.timestamp > 0.2) {
+        //printf("fps: %f\n", render.frames / (time - render.timestamp));
+        if (render.print_stats) print_stats();
+        render.frames = 0;
+        render.timestamp = time;
+    }
+
+    // Upload MRT UBO
+    MrtUbo uniform;
+    make_view_proj(cam_pos, cam_dir, cam_up, uniform.view_proj);
+
+    scene_update_transforms(&scene);
+    detach_moved_nodes();
+    frustum_from_matrix(uniform.view_proj, &render.frustum);
+    select_lods(cam_pos);
+    if (!render.gpu_driven) {
+        cull_scene();
+        build_draw_list();
+        group_draws();
+        sort_draws(cam_pos, cam_dir);
+    }
+    upload_to_device_local_buffer(
+            (void*) &uniform,
+            sizeof(uniform),
+            &render.ubo_buffer,
+            render.graphics_queue,
+            render.graphics_command_pool
+    );
+
+    // Upload deferred fragment shader UBO
+    DeferredUbo defubo;
+    memcpy(&defubo.view_pos, cam_pos, sizeof(vec3));
+    defubo.light_count = LIGHT_COUNT;
+    upload_to_device_local_buffer(
+            (void*) &defubo,
+            sizeof(defubo),
+            &render.deferred_ubo_buffer,
+            render.graphics_queue,
+            render.graphics_command_pool
+    );
+
+    uint32_t image_index;
+    VkResult acquire_image_result =
+        vkAcquireNextImageKHR(g_device, render.swapchain, UINT64_MAX,
+                render.image_available_semaphore, VK_NULL_HANDLE,
+                &image_index);
+
+    if (acquire_image_result == VK_ERROR_OUT_OF_DATE_KHR) {
+        recreate_swapchain();
+        return;
+    } else if (acquire_image_result != VK_SUCCESS &&
             acquire_image_result != VK_SUBOPTIMAL_KHR) {
         fatal("Failed to acquire swapchain image.");
     }
@@ -2164,6 +3845,20 @@ void render_draw_frame(vec3 cam_pos, vec3 cam_dir, vec3 cam_up) {
     vkWaitForFences(
             g_device, 1, &render.commands_executed_fence,
             VK_TRUE, UINT64_MAX);
+
+    // All frames share one fence, so every recorded pick is complete here
+    for (size_t i=0; i < FRAMES_IN_FLIGHT; i++) resolve_picks(i);
+    read_frame_time();
+    if (render.gpu_driven) {
+        read_gpu_stats();
+        upload_lods();
+    } else {
+        upload_instances();
+    }
+    upload_transforms();
+    rebuild_dirty_batches();
+    cull_batches();
+
     VkCommandBufferBeginInfo begin_info = {
         .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
         .flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT,
@@ -2172,12 +3867,21 @@ void render_draw_frame(vec3 cam_pos, vec3 cam_dir, vec3 cam_up) {
             VK_SUCCESS) {
         fatal("Failed to begin recording command buffer.");
     }
-    VkClearValue clear_values[5] = {
+    if (render.gpu_timing) {
+        vkCmdResetQueryPool(render.command_buffer, render.frame_queries,
+                0, 2);
+        vkCmdWriteTimestamp(render.command_buffer,
+                VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, render.frame_queries, 0);
+    }
+    if (render.gpu_driven) {
+        record_gpu_cull(render.command_buffer, uniform.view_proj, cam_pos);
+    }
+
+    VkClearValue clear_values[4] = {
         { .color = {0.0f, 0.0f, 0.0f, 1.0f} },
         { .color = {0.0f, 0.0f, 0.0f, 1.0f} },
         { .color = {0.0f, 0.0f, 0.0f, 1.0f} },
         { .depthStencil = {1.0f, 0} },
-        { .color = {0.0f, 0.0f, 0.0f, 0.0f} },
     };
     VkRenderPassBeginInfo render_pass_info = {
         .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
@@ -2185,171 +3889,1022 @@ void render_draw_frame(vec3 cam_pos, vec3 cam_dir, vec3 cam_up) {
         .framebuffer = render.offscreen_framebuffer,
         .renderArea.offset = {0, 0},
         .renderArea.extent = render.swapchain_extent,
-        .clearValueCount = 5,
+        .clearValueCount = 4,
         .pClearValues = clear_values,
     };
 
     vkCmdBeginRenderPass(render.command_buffer, &render_pass_info,
                              VK_SUBPASS_CONTENTS_INLINE);
 
+    vkCmdBindPipeline(render.command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+            scene.compact_vertices ? render.compact_offscreen_pipeline :
+                render.offscreen_graphics_pipeline);
+
+    // Draw the nodes
+    draw_scene(render.command_buffer, true);
+
+    vkCmdEndRenderPass(render.command_buffer);
+
+    record_picks(render.command_buffer, current_frame);
+
+    render_pass_info.renderPass = render.render_pass;
+    render_pass_info.framebuffer = render.framebuffers[current_frame];
+    VkClearValue deferred_clear_values[2] = {
+        { .color = {0.0f, 0.0f, 0.0f, 0.0f} },
+        { .depthStencil = {1.0f, 0} },
+    };
+    render_pass_info.clearValueCount = 2;
+    render_pass_info.pClearValues = deferred_clear_values;
+
+    vkCmdBeginRenderPass(render.command_buffer, &render_pass_info,
+                         VK_SUBPASS_CONTENTS_INLINE);
+    vkCmdBindDescriptorSets(render.command_buffer,
+            VK_PIPELINE_BIND_POINT_GRAPHICS, render.graphics_pipeline_layout,
+            0, 1, &render.desc_set, 0, NULL);
+    vkCmdBindDescriptorSets(render.command_buffer,
+            VK_PIPELINE_BIND_POINT_GRAPHICS, render.graphics_pipeline_layout,
+            2, 1, &render.gbuf_desc_set, 0, NULL);
     vkCmdBindPipeline(render.command_buffer,
-            VK_PIPELINE_BIND_POINT_GRAPHICS, render.offscreen_graphics_pipeline);
+            VK_PIPELINE_BIND_POINT_GRAPHICS, render.graphics_pipeline);
+    vkCmdDraw(render.command_buffer, 3, 1, 0, 0);
+    vkCmdEndRenderPass(render.command_buffer);
 
+    render_pass_info.renderPass = render.lights_ui_render_pass;
+    render_pass_info.framebuffer = render.lights_ui_framebuffers[current_frame];
+    render_pass_info.clearValueCount = 2;
+    VkClearValue lights_ui_clear_values[2] = {
+        { .color = {0.0f, 0.0f, 0.0f, 0.0f} },
+        { .color = {0.0f, 0.0f, 0.0f, 0.0f} },
+    };
+    render_pass_info.pClearValues = lights_ui_clear_values;
+    vkCmdBeginRenderPass(render.command_buffer, &render_pass_info,
+            VK_SUBPASS_CONTENTS_INLINE);
     VkDeviceSize offset = 0;
     vkCmdBindVertexBuffers(render.command_buffer, 0, 1,
-            &render.vertex_buffer.buffer, &offset);
-    vkCmdBindIndexBuffer(
-            render.command_buffer, render.index_buffer.buffer, 0,
-            VK_INDEX_TYPE_UINT16);
+            &render.lights_buffer.buffer, &offset);
     vkCmdBindDescriptorSets(render.command_buffer,
             VK_PIPELINE_BIND_POINT_GRAPHICS, render.graphics_pipeline_layout,
             0, 1, &render.desc_set, 0, NULL);
+    vkCmdBindPipeline(render.command_buffer,
+            VK_PIPELINE_BIND_POINT_GRAPHICS, render.lights_ui_pipeline);
+    vkCmdDraw(render.command_buffer, LIGHT_COUNT, 1, 0, 0);
+    vkCmdEndRenderPass(render.command_buffer);
+
+    render_pass_info.renderPass = render.image_blit_render_pass;
+    render_pass_info.framebuffer = render.framebuffers[current_frame];
+    render_pass_info.clearValueCount = 0;
+    vkCmdBeginRenderPass(render.command_buffer, &render_pass_info,
+            VK_SUBPASS_CONTENTS_INLINE);
+
+    // Draw the cursor
+
+    vkCmdBindDescriptorSets(
+        render.command_buffer,
+        VK_PIPELINE_BIND_POINT_GRAPHICS, render.graphics_pipeline_layout,
+        1, 1, &render.cursor.desc_set, 0, NULL);
+    vkCmdBindVertexBuffers(render.command_buffer, 0, 1,
+            &render.cursor_vertex_buffer.buffer, &offset);
+    vkCmdBindPipeline(render.command_buffer,
+            VK_PIPELINE_BIND_POINT_GRAPHICS, render.image_blit_pipeline);
+    vkCmdDraw(render.command_buffer, 6, 1, 0, 0);
+
+    vkCmdEndRenderPass(render.command_buffer);
+
+    if (render.gpu_timing) {
+        vkCmdWriteTimestamp(render.command_buffer,
+                VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, render.frame_queries, 1);
+    }
+    if (vkEndCommandBuffer(render.command_buffer) != VK_SUCCESS) {
+        fatal("Failed to record command buffer.");
+    }
+
+    VkPipelineStageFlags wait_mask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    VkSubmitInfo submit_info = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .waitSemaphoreCount = 1,
+        .pWaitSemaphores = &render.image_available_semaphore,
+        .pWaitDstStageMask = &wait_mask,
+        .commandBufferCount = 1,
+        .pCommandBuffers = &render.command_buffer,
+        .signalSemaphoreCount = 1,
+        .pSignalSemaphores = &render.draw_finished_semaphore,
+    };
+
+    vkResetFences(g_device, 1, &render.commands_executed_fence);
+
+    if (vkQueueSubmit(render.graphics_queue, 1, &submit_info,
+            render.commands_executed_fence) != VK_SUCCESS) {
+        fatal("Failed to submit draw command buffer.");
+    }
+    render.frame_queries_written = render.gpu_timing;
+
+    VkPresentInfoKHR present_info = {
+        .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+        .waitSemaphoreCount = 1,
+        .pWaitSemaphores = &render.draw_finished_semaphore,
+        .swapchainCount = 1,
+        .pSwapchains = &render.swapchain,
+        .pImageIndices = &image_index,
+    };
+    VkResult present_result = vkQueuePresentKHR(render.present_queue, &present_info);
+    if (present_result == VK_ERROR_OUT_OF_DATE_KHR ||
+            present_result == VK_SUBOPTIMAL_KHR) {
+        recreate_swapchain();
+    } else if (present_result != VK_SUCCESS) {
+        fatal("Failed to present swapchain image.");
+    }
+
+    render.current_frame = (current_frame + 1) % 2;
+    render.frames++;
+}
+
+bool render_exit() {
+    return glfwWindowShouldClose(g_window);
+}
+
+static void write_storage_descriptor(VkDescriptorSet set, uint32_t binding,
+        Buffer* buffer)
+{
+    VkDescriptorBufferInfo buffer_info = {
+        .buffer = buffer->buffer,
+        .offset = 0,
+        .range = VK_WHOLE_SIZE,
+    };
+    VkWriteDescriptorSet write = {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = set,
+        .dstBinding = binding,
+        .dstArrayElement = 0,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = 1,
+        .pBufferInfo = &buffer_info,
+    };
+    vkUpdateDescriptorSets(g_device, 1, &write, 0, NULL);
+}
+
+static uint32_t primitive_bucket(Primitive* primitive)
+{
+    return primitive->wide_indices * render.texture_count +
+        primitive->texture_id;
+}
+
+static bool primitive_clustered(Primitive* primitive)
+{
+    return CLUSTER_CULLING && primitive->meshlet_count > 1;
+}
+
+// Cluster draws of every mesh node, counted before the instance buffer is
+// created
+static void count_cluster_draws()
+{
+    render.cluster_count = 0;
+    render.cluster_triangles = 0;
+    if (!render.gpu_driven) return;
+    for (size_t n=0; n < scene.node_count; n++) {
+        Mesh* mesh = scene.nodes[n].mesh;
+        if (!mesh) continue;
+        for (size_t p=0; p < mesh->primitives_count; p++) {
+            Primitive* primitive = &mesh->primitives[p];
+            if (!primitive_clustered(primitive)) continue;
+            render.cluster_count += primitive->meshlet_count;
+            render.cluster_triangles += primitive->index_count / 3;
+        }
+    }
+}
+
+// Uploads the meshlets of clustered primitives and a cluster draw with its
+// instance entry per meshlet of every draw slot of them
+static void create_cluster_draws(GpuDraw* gpu_draws)
+{
+    uint32_t* meshlet_base =
+        malloc_nofail(sizeof(uint32_t) * MAX(scene.primitive_count, 1));
+    uint32_t meshlet_count = 0;
+    for (size_t p=0; p < scene.primitive_count; p++) {
+        meshlet_base[p] = meshlet_count;
+        if (primitive_clustered(render.primitives[p]))
+            meshlet_count += render.primitives[p]->meshlet_count;
+    }
+    GpuMeshlet* gpu_meshlets =
+        malloc_nofail(sizeof(GpuMeshlet) * MAX(meshlet_count, 1));
+    for (size_t p=0; p < scene.primitive_count; p++) {
+        Primitive* primitive = render.primitives[p];
+        if (!primitive_clustered(primitive)) continue;
+        for (uint32_t m=0; m < primitive->meshlet_count; m++) {
+            Meshlet* meshlet = &scene.meshlets[primitive->meshlet_offset + m];
+            GpuMeshlet* dst = &gpu_meshlets[meshlet_base[p] + m];
+            glm_vec4(meshlet->center, meshlet->radius, dst->sphere);
+            glm_vec4(meshlet->cone_axis, meshlet->cone_cutoff, dst->cone);
+            dst->first_index = primitive->index_offset + meshlet->first_index;
+            dst->index_count = meshlet->index_count;
+            dst->primitive = p;
+            dst->vertex_count = meshlet->vertex_count;
+        }
+    }
+
+    GpuClusterDraw* cluster_draws =
+        malloc_nofail(sizeof(GpuClusterDraw) * MAX(render.cluster_count, 1));
+    uint32_t* cluster_instances =
+        malloc_nofail(sizeof(uint32_t) * MAX(render.cluster_count, 1));
+    uint32_t c = 0;
+    for (uint32_t d=0; d < render.gpu_draw_count; d++) {
+        uint32_t p = gpu_draws[d].primitive;
+        if (!primitive_clustered(render.primitives[p])) continue;
+        for (uint32_t m=0; m < render.primitives[p]->meshlet_count; m++) {
+            cluster_draws[c].draw = d;
+            cluster_draws[c].meshlet = meshlet_base[p] + m;
+            cluster_draws[c].instance = render.cluster_instance_offset + c;
+            cluster_draws[c].pad = 0;
+            cluster_instances[c] = gpu_draws[d].transform;
+            c++;
+        }
+    }
+    DBASSERT(c == render.cluster_count);
+
+    device_local_buffer_from_data(
+            (void*) gpu_meshlets,
+            sizeof(GpuMeshlet) * MAX(meshlet_count, 1),
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            render.graphics_queue,
+            render.graphics_command_pool,
+            &render.gpu_meshlets
+    );
+    device_local_buffer_from_data(
+            (void*) cluster_draws,
+            sizeof(GpuClusterDraw) * MAX(render.cluster_count, 1),
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            render.graphics_queue,
+            render.graphics_command_pool,
+            &render.cluster_draws
+    );
+    if (render.cluster_count) {
+        upload_to_device_local_buffer_at(
+                (void*) cluster_instances,
+                sizeof(uint32_t) * render.cluster_count,
+                &render.instance_buffer,
+                sizeof(uint32_t) * render.cluster_instance_offset,
+                render.graphics_queue,
+                render.graphics_command_pool
+        );
+    }
+    mem_free(cluster_instances);
+    mem_free(cluster_draws);
+    mem_free(gpu_meshlets);
+    mem_free(meshlet_base);
+
+    // Written by cull.comp for every draw slot before the clusters read it
+    create_buffer(
+            sizeof(uint32_t) * MAX(render.gpu_draw_count, 1),
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            &render.draw_visibility);
+    if (create_buffer(
+            sizeof(GpuCullStats),
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            &render.cull_stats)) {
+        fatal("Failed to create cull stats buffer.");
+    }
+    vkMapMemory(g_device, render.cull_stats.memory, 0,
+            sizeof(GpuCullStats), 0, (void**) &render.cull_stats_mapped);
+    memset(render.cull_stats_mapped, 0, sizeof(GpuCullStats));
+}
+
+// Instance entries ahead of the batch members'. On the GPU-driven path
+// every LOD of a draw slot's primitive reserves one, as any may be picked.
+static uint32_t count_instance_slots(uint32_t draw_capacity)
+{
+    if (!render.gpu_driven) return draw_capacity;
+    uint32_t slots = 0;
+    for (size_t n=0; n < scene.node_count; n++) {
+        Mesh* mesh = scene.nodes[n].mesh;
+        if (!mesh) continue;
+        for (size_t p=0; p < mesh->primitives_count; p++) {
+            slots += mesh->primitives[p].lod_count;
+        }
+    }
+    return slots;
+}
+
+// Uploads one record per draw slot and per primitive and LOD, sizes the
+// texture buckets of the indirect command buffer and reserves every record
+// room for all instances of its primitive
+static void create_gpu_scene(uint32_t draw_capacity)
+{
+    if (!render.gpu_driven) return;
+    uint32_t record_count = scene.primitive_count;
+    for (size_t p=0; p < scene.primitive_count; p++) {
+        record_count += render.primitives[p]->lod_count - 1;
+    }
+    render.gpu_record_count = record_count;
+    GpuPrimitive* gpu_primitives =
+        malloc_nofail(sizeof(GpuPrimitive) * MAX(record_count, 1));
+    // Instance counts of the primitives until their offsets are known
+    uint32_t* instance_counts =
+        malloc_nofail(sizeof(uint32_t) * MAX(scene.primitive_count, 1));
+    memset(instance_counts, 0, sizeof(uint32_t) * scene.primitive_count);
+    render.bucket_count = render.texture_count * 2;
+    render.bucket_offsets =
+        malloc_nofail(sizeof(uint32_t) * MAX(render.bucket_count, 1));
+    render.bucket_sizes =
+        malloc_nofail(sizeof(uint32_t) * MAX(render.bucket_count, 1));
+    memset(render.bucket_sizes, 0, sizeof(uint32_t) * render.bucket_count);
+    for (size_t p=0; p < scene.primitive_count; p++) {
+        Primitive* primitive = render.primitives[p];
+        render.bucket_sizes[primitive_bucket(primitive)] +=
+            primitive->lod_count;
+    }
+    // Every cluster draw may emit a command of its own
+    for (size_t n=0; n < scene.node_count; n++) {
+        Mesh* mesh = scene.nodes[n].mesh;
+        if (!mesh) continue;
+        for (size_t p=0; p < mesh->primitives_count; p++) {
+            Primitive* primitive = &mesh->primitives[p];
+            if (!primitive_clustered(primitive)) continue;
+            render.bucket_sizes[primitive_bucket(primitive)] +=
+                primitive->meshlet_count;
+        }
+    }
+    uint32_t bucket_offset = 0;
+    for (size_t b=0; b < render.bucket_count; b++) {
+        render.bucket_offsets[b] = bucket_offset;
+        bucket_offset += render.bucket_sizes[b];
+    }
+
+    GpuDraw* gpu_draws = malloc_nofail(sizeof(GpuDraw) * MAX(draw_capacity, 1));
+    GpuDraw* draw = gpu_draws;
+    for (size_t n=0; n < scene.node_count; n++) {
+        Node* node = &scene.nodes[n];
+        if (!node->mesh) continue;
+        for (size_t p=0; p < node->mesh->primitives_count; p++) {
+            Primitive* primitive = &node->mesh->primitives[p];
+            draw->transform = node->transform;
+            draw->primitive = node->mesh->first_primitive + p;
+            draw->pad[0] = 0;
+            draw->pad[1] = 0;
+            glm_vec4(primitive->min, 1.0f, draw->min);
+            glm_vec4(primitive->max, 1.0f, draw->max);
+            instance_counts[draw->primitive]++;
+            draw++;
+        }
+    }
+    render.gpu_draw_count = draw_capacity;
+
+    uint32_t instance_offset = 0;
+    uint32_t lod_first = scene.primitive_count;
+    for (size_t p=0; p < scene.primitive_count; p++) {
+        Primitive* primitive = render.primitives[p];
+        for (uint32_t l=0; l < primitive->lod_count; l++) {
+            GpuPrimitive* gpu_primitive =
+                &gpu_primitives[l == 0 ? p : lod_first + l - 1];
+            gpu_primitive->index_count = primitive->lods[l].index_count;
+            gpu_primitive->first_index = primitive->lods[l].index_offset;
+            gpu_primitive->vertex_offset = primitive->vertex_offset;
+            gpu_primitive->bucket = primitive_bucket(primitive);
+            gpu_primitive->bucket_offset =
+                render.bucket_offsets[gpu_primitive->bucket];
+            gpu_primitive->instance_offset = instance_offset;
+            gpu_primitive->clustered =
+                l == 0 && primitive_clustered(primitive);
+            gpu_primitive->lod_count = primitive->lod_count;
+            gpu_primitive->lod_first = lod_first;
+            gpu_primitive->vertex_count = primitive->lods[l].vertex_count;
+            instance_offset += instance_counts[p];
+        }
+        lod_first += primitive->lod_count - 1;
+    }
+    DBASSERT(lod_first == record_count);
+    mem_free(instance_counts);
+    create_cluster_draws(gpu_draws);
+
+    device_local_buffer_from_data(
+            (void*) gpu_draws,
+            sizeof(GpuDraw) * MAX(draw_capacity, 1),
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            render.graphics_queue,
+            render.graphics_command_pool,
+            &render.gpu_draws
+    );
+    device_local_buffer_from_data(
+            (void*) gpu_primitives,
+            sizeof(GpuPrimitive) * MAX(record_count, 1),
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            render.graphics_queue,
+            render.graphics_command_pool,
+            &render.gpu_primitives
+    );
+    mem_free(gpu_draws);
+    mem_free(gpu_primitives);
+
+    create_buffer(
+            sizeof(VkDrawIndexedIndirectCommand) * MAX(bucket_offset, 1),
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            &render.indirect_commands);
+    create_buffer(
+            sizeof(uint32_t) * MAX(record_count, 1),
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            &render.instance_counts);
+
+    // Host visible so the counts of a finished frame can go into the stats
+    size_t counts_size = sizeof(uint32_t) * MAX(render.bucket_count, 1);
+    if (create_buffer(
+            counts_size,
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            &render.indirect_counts)) {
+        fatal("Failed to create indirect count buffer.");
+    }
+    vkMapMemory(g_device, render.indirect_counts.memory, 0, counts_size, 0,
+            &render.indirect_counts_mapped);
+    memset(render.indirect_counts_mapped, 0, counts_size);
+
+    write_storage_descriptor(render.cull_desc_set, 0, &render.transforms);
+    write_storage_descriptor(render.cull_desc_set, 1, &render.gpu_draws);
+    write_storage_descriptor(render.cull_desc_set, 2,
+            &render.indirect_commands);
+    write_storage_descriptor(render.cull_desc_set, 3, &render.indirect_counts);
+    write_storage_descriptor(render.cull_desc_set, 4, &render.gpu_primitives);
+    write_storage_descriptor(render.cull_desc_set, 5, &render.instance_buffer);
+    write_storage_descriptor(render.cull_desc_set, 6, &render.instance_counts);
+    write_storage_descriptor(render.cull_desc_set, 7, &render.gpu_meshlets);
+    write_storage_descriptor(render.cull_desc_set, 8, &render.cluster_draws);
+    write_storage_descriptor(render.cull_desc_set, 9, &render.draw_visibility);
+    write_storage_descriptor(render.cull_desc_set, 10, &render.cull_stats);
+}
+
+static void destroy_gpu_scene()
+{
+    if (!render.gpu_driven) return;
+    vkUnmapMemory(g_device, render.indirect_counts.memory);
+    destroy_buffer(&render.indirect_counts);
+    destroy_buffer(&render.indirect_commands);
+    destroy_buffer(&render.instance_counts);
+    destroy_buffer(&render.gpu_primitives);
+    destroy_buffer(&render.gpu_draws);
+    vkUnmapMemory(g_device, render.cull_stats.memory);
+    destroy_buffer(&render.cull_stats);
+    destroy_buffer(&render.draw_visibility);
+    destroy_buffer(&render.cluster_draws);
+    destroy_buffer(&render.gpu_meshlets);
+    mem_free(render.bucket_offsets);
+    mem_free(render.bucket_sizes);
+}
+
+// Written by the culling shader on the GPU-driven path, otherwise copied
+// from the grouped CPU draw list every frame. The batch members' instances
+// follow the instance slots and never change, the cluster draws' ones are
+// uploaded with the GPU scene.
+static void create_instance_buffer(uint32_t slot_count)
+{
+    uint32_t member_count = render.batch_member_count;
+    size_t size = sizeof(uint32_t) *
+        MAX(slot_count + member_count + render.cluster_count, 1);
+    uint32_t* member_instances =
+        malloc_nofail(sizeof(uint32_t) * MAX(member_count, 1));
+    for (uint32_t m=0; m < member_count; m++) {
+        member_instances[m] = scene.hierarchy.count + m;
+    }
+    render.batch_instance_offset = slot_count;
+    render.cluster_instance_offset = slot_count + member_count;
+
+    if (render.gpu_driven) {
+        create_buffer(size,
+                VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                    VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &render.instance_buffer);
+        if (member_count) {
+            upload_to_device_local_buffer_at(
+                    (void*) member_instances,
+                    sizeof(uint32_t) * member_count,
+                    &render.instance_buffer,
+                    sizeof(uint32_t) * slot_count,
+                    render.graphics_queue,
+                    render.graphics_command_pool
+            );
+        }
+    } else {
+        if (create_buffer(
+                size,
+                VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                    VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                &render.instance_buffer)) {
+            fatal("Failed to create instance buffer.");
+        }
+        vkMapMemory(g_device, render.instance_buffer.memory, 0, size, 0,
+                (void**) &render.instance_mapped);
+        memcpy(&render.instance_mapped[slot_count], member_instances,
+                sizeof(uint32_t) * member_count);
+    }
+    mem_free(member_instances);
+    write_storage_descriptor(render.desc_set, 4, &render.instance_buffer);
+}
+
+static void destroy_instance_buffer()
+{
+    if (!render.gpu_driven) {
+        vkUnmapMemory(g_device, render.instance_buffer.memory);
+    }
+    destroy_buffer(&render.instance_buffer);
+}
+
+// Uploads every entry, then marks the batched ones and appends an identity
+// entry per batch member
+static void create_transform_buffer()
+{
+    size_t size = sizeof(GpuTransform) *
+        MAX(scene.hierarchy.count + render.batch_member_count, 1);
+    if (create_buffer(
+            size,
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            &render.transforms)) {
+        fatal("Failed to create transform buffer.");
+    }
+    vkMapMemory(g_device, render.transforms.memory, 0, size, 0,
+            (void**) &render.transforms_mapped);
+
+    Hierarchy* h = &scene.hierarchy;
+    for (uint32_t i=0; i < h->count; i++) {
+        Node* node = &scene.nodes[h->node[i]];
+        render.transforms_mapped[i].node_id = node->id;
+        render.transforms_mapped[i].quantization =
+            node->mesh ? (uint32_t) (node->mesh - scene.meshes) : 0;
+        render.transforms_mapped[i].lod = 0;
+        h->changed[i] = 1;
+    }
+    scene.transforms_changed = true;
+    upload_transforms();
+
+    for (uint32_t b=0; b < render.batch_count; b++) {
+        StaticBatch* batch = &render.batches[b];
+        for (uint32_t m=batch->member_first;
+                m < batch->member_first + batch->member_count; m++) {
+            uint32_t t = render.batch_members[m].transform;
+            GpuTransform* dst = &render.transforms_mapped[h->count + m];
+            glm_mat4_identity(dst->model);
+            glm_vec4((vec3) {1.0f, 0.0f, 0.0f}, 0.0f, dst->normal[0]);
+            glm_vec4((vec3) {0.0f, 1.0f, 0.0f}, 0.0f, dst->normal[1]);
+            glm_vec4((vec3) {0.0f, 0.0f, 1.0f}, 0.0f, dst->normal[2]);
+            dst->node_id = render.transforms_mapped[t].node_id;
+            dst->flags = 0;
+            // Batch vertices are quantized to the batch bounds
+            dst->quantization = scene.mesh_count + b;
+            dst->lod = 0;
+            render.transforms_mapped[t].flags = TRANSFORM_FLAG_BATCHED;
+            render.batched[t] = 1;
+        }
+    }
+    write_storage_descriptor(render.desc_set, 3, &render.transforms);
+}
+
+static void destroy_transform_buffer()
+{
+    vkUnmapMemory(g_device, render.transforms.memory);
+    destroy_buffer(&render.transforms);
+}
+
+// compact holds the vertices already quantized when the scene uses the
+// compact format, NULL otherwise
+static void upload_vertices(Vertex* vertices, CompactVertex* compact,
+        size_t count, Buffer* o_buffer)
+{
+    void* data = compact ? (void*) compact : (void*) vertices;
+    size_t stride = compact ? sizeof(CompactVertex) : sizeof(Vertex);
+    device_local_buffer_from_data(
+            data,
+            stride * MAX(count, 1),
+            VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+            render.graphics_queue,
+            render.graphics_command_pool,
+            o_buffer
+    );
+}
 
-    // Draw the nodes
+// Per mesh bounds, then the bounds each static batch was quantized to
+static void create_quantization_buffer()
+{
+    size_t count = scene.mesh_count + render.batch_count;
+    GpuQuantization* entries =
+        malloc_nofail(sizeof(GpuQuantization) * MAX(count, 1));
+    for (size_t m=0; m < scene.mesh_count; m++) {
+        Mesh* mesh = &scene.meshes[m];
+        vec3 extent;
+        glm_vec3_sub(mesh->max, mesh->min, extent);
+        glm_vec4(extent, 0.0f, entries[m].scale);
+        glm_vec4(mesh->min, 0.0f, entries[m].offset);
+    }
+    for (uint32_t b=0; b < render.batch_count; b++) {
+        StaticBatch* batch = &render.batches[b];
+        GpuQuantization* entry = &entries[scene.mesh_count + b];
+        vec3 extent;
+        glm_vec3_sub(batch->max, batch->min, extent);
+        glm_vec4(extent, 0.0f, entry->scale);
+        glm_vec4(batch->min, 0.0f, entry->offset);
+    }
+    device_local_buffer_from_data(
+            entries,
+            sizeof(GpuQuantization) * MAX(count, 1),
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            render.graphics_queue,
+            render.graphics_command_pool,
+            &render.quantization
+    );
+    mem_free(entries);
+    write_storage_descriptor(render.desc_set, 5, &render.quantization);
+}
+
+// Concatenates the world space geometry of every static, uninstanced mesh
+// node into one batch per texture. World matrices and scene geometry must
+// be loaded already.
+static void build_static_batches()
+{
+    Hierarchy* h = &scene.hierarchy;
+    render.batched = malloc_nofail(sizeof(uint8_t) * MAX(h->count, 1));
+    memset(render.batched, 0, sizeof(uint8_t) * MAX(h->count, 1));
+    render.batches_dirty = false;
+
+    size_t batched_nodes = STATIC_BATCHING ? scene.node_count : 0;
+    // Instanced meshes stay instanced rather than copied per node
+    uint32_t* mesh_users =
+        malloc_nofail(sizeof(uint32_t) * MAX(scene.mesh_count, 1));
+    memset(mesh_users, 0, sizeof(uint32_t) * scene.mesh_count);
     for (size_t n=0; n < scene.node_count; n++) {
         Mesh* mesh = scene.nodes[n].mesh;
-        if (!mesh) continue;
-
-        PushConstants push_consts;
-        node_make_matrix(&scene.nodes[n], push_consts.model);
-        Node* parent = scene.nodes[n].parent;
-        while (parent) {
-            mat4 parent_transform;
-            node_make_matrix(parent, parent_transform);
-            glm_mat4_mul(parent_transform, push_consts.model, push_consts.model);
-            parent = parent->parent;
-        }
-        push_consts.node_id = scene.nodes[n].id;
-
-        vkCmdPushConstants(
-                render.command_buffer,
-                render.graphics_pipeline_layout,
-                VK_SHADER_STAGE_VERTEX_BIT,
-                0,
-                sizeof(PushConstants),
-                &push_consts);
-
+        if (mesh) mesh_users[mesh - scene.meshes]++;
+    }
+    bool* node_batched =
+        malloc_nofail(sizeof(bool) * MAX(scene.node_count, 1));
+    for (size_t n=0; n < scene.node_count; n++) {
+        Node* node = &scene.nodes[n];
+        node_batched[n] = n < batched_nodes && node->mesh && node->is_static &&
+            mesh_users[node->mesh - scene.meshes] == 1;
+    }
+    mem_free(mesh_users);
+    // Per texture vertex, index and member counts and batch index
+    size_t texture_count = MAX(render.texture_count, 1);
+    uint32_t* per_texture =
+        malloc_nofail(sizeof(uint32_t) * texture_count * 4);
+    memset(per_texture, 0, sizeof(uint32_t) * texture_count * 3);
+    uint32_t* vertex_counts = per_texture;
+    uint32_t* index_counts = per_texture + texture_count;
+    uint32_t* member_counts = per_texture + texture_count * 2;
+    uint32_t* texture_batch = per_texture + texture_count * 3;
+    for (size_t n=0; n < scene.node_count; n++) {
+        if (!node_batched[n]) continue;
+        Mesh* mesh = scene.nodes[n].mesh;
         for (size_t p=0; p < mesh->primitives_count; p++) {
             Primitive* primitive = &mesh->primitives[p];
-            vkCmdBindDescriptorSets(
-                render.command_buffer,
-                VK_PIPELINE_BIND_POINT_GRAPHICS, render.graphics_pipeline_layout,
-                1, 1, &render.textures[primitive->texture_id].desc_set, 0, NULL);
-            vkCmdDrawIndexed(render.command_buffer,
-                primitive->index_count, 1, primitive->index_offset,
-                primitive->vertex_offset, 0);
+            vertex_counts[primitive->texture_id] += primitive->vertex_count;
+            index_counts[primitive->texture_id] += primitive->index_count;
+            member_counts[primitive->texture_id]++;
         }
     }
 
-    vkCmdEndRenderPass(render.command_buffer);
-
-    render_pass_info.renderPass = render.render_pass;
-    render_pass_info.framebuffer = render.framebuffers[current_frame];
-    VkClearValue deferred_clear_values[2] = {
-        { .color = {0.0f, 0.0f, 0.0f, 0.0f} },
-        { .depthStencil = {1.0f, 0} },
-    };
-    render_pass_info.clearValueCount = 2;
-    render_pass_info.pClearValues = deferred_clear_values;
-
-    vkCmdBeginRenderPass(render.command_buffer, &render_pass_info,
-                         VK_SUBPASS_CONTENTS_INLINE);
-    vkCmdBindDescriptorSets(render.command_buffer,
-            VK_PIPELINE_BIND_POINT_GRAPHICS, render.graphics_pipeline_layout,
-            0, 1, &render.desc_set, 0, NULL);
-    vkCmdBindDescriptorSets(render.command_buffer,
-            VK_PIPELINE_BIND_POINT_GRAPHICS, render.graphics_pipeline_layout,
-            2, 1, &render.gbuf_desc_set, 0, NULL);
-    vkCmdBindPipeline(render.command_buffer,
-            VK_PIPELINE_BIND_POINT_GRAPHICS, render.graphics_pipeline);
-    vkCmdDraw(render.command_buffer, 3, 1, 0, 0);
-    vkCmdEndRenderPass(render.command_buffer);
-
-    render_pass_info.renderPass = render.lights_ui_render_pass;
-    render_pass_info.framebuffer = render.lights_ui_framebuffers[current_frame];
-    render_pass_info.clearValueCount = 2;
-    VkClearValue lights_ui_clear_values[2] = {
-        { .color = {0.0f, 0.0f, 0.0f, 0.0f} },
-        { .color = {0.0f, 0.0f, 0.0f, 0.0f} },
-    };
-    render_pass_info.pClearValues = lights_ui_clear_values;
-    vkCmdBeginRenderPass(render.command_buffer, &render_pass_info,
-            VK_SUBPASS_CONTENTS_INLINE);
-    vkCmdBindVertexBuffers(render.command_buffer, 0, 1,
-            &render.lights_buffer.buffer, &offset);
-    vkCmdBindDescriptorSets(render.command_buffer,
-            VK_PIPELINE_BIND_POINT_GRAPHICS, render.graphics_pipeline_layout,
-            0, 1, &render.desc_set, 0, NULL);
-    vkCmdBindPipeline(render.command_buffer,
-            VK_PIPELINE_BIND_POINT_GRAPHICS, render.lights_ui_pipeline);
-    vkCmdDraw(render.command_buffer, LIGHT_COUNT, 1, 0, 0);
-    vkCmdEndRenderPass(render.command_buffer);
-
-    render_pass_info.renderPass = render.image_blit_render_pass;
-    render_pass_info.framebuffer = render.framebuffers[current_frame];
-    render_pass_info.clearValueCount = 0;
-    vkCmdBeginRenderPass(render.command_buffer, &render_pass_info,
-            VK_SUBPASS_CONTENTS_INLINE);
+    render.batches = malloc_nofail(sizeof(StaticBatch) * texture_count);
+    render.batch_count = 0;
+    uint32_t vertex_total = 0;
+    uint32_t index_total = 0;
+    uint32_t member_total = 0;
+    for (uint32_t t=0; t < render.texture_count; t++) {
+        if (!member_counts[t]) continue;
+        texture_batch[t] = render.batch_count;
+        StaticBatch* batch = &render.batches[render.batch_count++];
+        batch->texture_id = t;
+        batch->vertex_offset = vertex_total;
+        batch->vertex_count = vertex_counts[t];
+        batch->index_offset = index_total;
+        batch->index_count = index_counts[t];
+        batch->member_first = member_total;
+        batch->member_count = 0;
+        glm_vec3_copy((vec3) {FLT_MAX, FLT_MAX, FLT_MAX}, batch->min);
+        glm_vec3_copy((vec3) {-FLT_MAX, -FLT_MAX, -FLT_MAX}, batch->max);
+        batch->dirty = false;
+        batch->visible = false;
+        vertex_total += vertex_counts[t];
+        index_total += index_counts[t];
+        member_total += member_counts[t];
+    }
 
-    // Draw the cursor
+    uint32_t max_batch_vertices = 0;
+    for (uint32_t t=0; t < render.texture_count; t++) {
+        max_batch_vertices = MAX(max_batch_vertices, vertex_counts[t]);
+    }
+    render.batch_index_size = max_batch_vertices > MAX_INDEX16_VERTICES ?
+        sizeof(uint32_t) : sizeof(uint16_t);
+
+    Vertex* batch_vertices = malloc_nofail(sizeof(Vertex) * MAX(vertex_total, 1));
+    render.batch_source_indices =
+        malloc_nofail(render.batch_index_size * MAX(index_total, 1));
+    render.batch_members =
+        malloc_nofail(sizeof(BatchMember) * MAX(member_total, 1));
+    render.batch_member_count = member_total;
+
+    // From here on the vertices and indices written to each texture's batch
+    memset(vertex_counts, 0, sizeof(uint32_t) * texture_count);
+    memset(index_counts, 0, sizeof(uint32_t) * texture_count);
+    for (size_t n=0; n < scene.node_count; n++) {
+        if (!node_batched[n]) continue;
+        Node* node = &scene.nodes[n];
+        uint32_t t = node->transform;
+        mat3 normal_matrix;
+        glm_mat4_pick3(h->world[t], normal_matrix);
+        glm_mat3_inv(normal_matrix, normal_matrix);
+        glm_mat3_transpose(normal_matrix);
+
+        for (size_t p=0; p < node->mesh->primitives_count; p++) {
+            Primitive* primitive = &node->mesh->primitives[p];
+            uint32_t texture = primitive->texture_id;
+            StaticBatch* batch = &render.batches[texture_batch[texture]];
+            BatchMember* member = &render.batch_members[
+                batch->member_first + batch->member_count++];
+            uint32_t base = vertex_counts[texture];
+            member->transform = t;
+            member->source_first = batch->index_offset + index_counts[texture];
+            member->index_first = index_counts[texture];
+            member->index_count = primitive->index_count;
+            member->detached = false;
+            glm_vec3_copy((vec3) {FLT_MAX, FLT_MAX, FLT_MAX}, member->min);
+            glm_vec3_copy((vec3) {-FLT_MAX, -FLT_MAX, -FLT_MAX}, member->max);
+
+            for (uint32_t v=0; v < primitive->vertex_count; v++) {
+                Vertex* src = &scene.vertices[primitive->vertex_offset + v];
+                Vertex* dst = &batch_vertices[batch->vertex_offset + base + v];
+                glm_mat4_mulv3(h->world[t], src->position, 1.0f,
+                        dst->position);
+                glm_mat3_mulv(normal_matrix, src->normal, dst->normal);
+                glm_vec3_normalize(dst->normal);
+                glm_vec2_copy(src->tex_coord, dst->tex_coord);
+                glm_vec3_minv(member->min, dst->position, member->min);
+                glm_vec3_maxv(member->max, dst->position, member->max);
+            }
+            for (uint32_t i=0; i < primitive->index_count; i++) {
+                uint32_t index = base + primitive_index(&scene, primitive, i);
+                uint32_t slot = member->source_first + i;
+                if (render.batch_index_size == sizeof(uint32_t)) {
+                    ((uint32_t*) render.batch_source_indices)[slot] = index;
+                } else {
+                    ((uint16_t*) render.batch_source_indices)[slot] = index;
+                }
+            }
+            vertex_counts[texture] += primitive->vertex_count;
+            index_counts[texture] += primitive->index_count;
+            glm_vec3_minv(batch->min, member->min, batch->min);
+            glm_vec3_maxv(batch->max, member->max, batch->max);
+        }
+    }
+    mem_free(per_texture);
+    mem_free(node_batched);
 
-    vkCmdBindDescriptorSets(
-        render.command_buffer,
-        VK_PIPELINE_BIND_POINT_GRAPHICS, render.graphics_pipeline_layout,
-        1, 1, &render.cursor.desc_set, 0, NULL);
-    vkCmdBindVertexBuffers(render.command_buffer, 0, 1,
-            &render.cursor_vertex_buffer.buffer, &offset);
-    vkCmdBindPipeline(render.command_buffer,
-            VK_PIPELINE_BIND_POINT_GRAPHICS, render.image_blit_pipeline);
-    vkCmdDraw(render.command_buffer, 6, 1, 0, 0);
+    uint32_t scratch_count = 1;
+    for (uint32_t b=0; b < render.batch_count; b++) {
+        scratch_count = MAX(scratch_count, render.batches[b].index_count);
+    }
+    render.batch_scratch =
+        malloc_nofail(render.batch_index_size * scratch_count);
+
+    CompactVertex* compact = NULL;
+    if (scene.compact_vertices) {
+        compact = malloc_nofail(sizeof(CompactVertex) * MAX(vertex_total, 1));
+        for (uint32_t b=0; b < render.batch_count; b++) {
+            StaticBatch* batch = &render.batches[b];
+            vec3 extent;
+            glm_vec3_sub(batch->max, batch->min, extent);
+            compact_vertices(&batch_vertices[batch->vertex_offset],
+                    batch->vertex_count, batch->min, extent,
+                    &compact[batch->vertex_offset]);
+        }
+    }
+    upload_vertices(batch_vertices, compact, vertex_total,
+            &render.batch_vertex_buffer);
+    if (compact) mem_free(compact);
+    device_local_buffer_from_data(
+            render.batch_source_indices,
+            render.batch_index_size * MAX(index_total, 1),
+            VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+            render.graphics_queue,
+            render.graphics_command_pool,
+            &render.batch_index_buffer
+    );
+    mem_free(batch_vertices);
+}
 
-    vkCmdEndRenderPass(render.command_buffer);
+static void destroy_static_batches()
+{
+    mem_free(render.batched);
+    mem_free(render.batches);
+    mem_free(render.batch_members);
+    mem_free(render.batch_source_indices);
+    mem_free(render.batch_scratch);
+    destroy_buffer(&render.batch_index_buffer);
+    destroy_buffer(&render.batch_vertex_buffer);
+}
 
-    if (vkEndCommandBuffer(render.command_buffer) != VK_SUCCESS) {
-        fatal("Failed to record command buffer.");
+static size_t primitive_position_count(cgltf_primitive* gltf_primitive)
+{
+    for (size_t a=0; a < gltf_primitive->attributes_count; a++) {
+        cgltf_attribute* attribute = &gltf_primitive->attributes[a];
+        if (attribute->type == cgltf_attribute_type_position)
+            return attribute->data->count;
     }
+    return 0;
+}
 
-    VkPipelineStageFlags wait_mask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-    VkSubmitInfo submit_info = {
-        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-        .waitSemaphoreCount = 1,
-        .pWaitSemaphores = &render.image_available_semaphore,
-        .pWaitDstStageMask = &wait_mask,
-        .commandBufferCount = 1,
-        .pCommandBuffers = &render.command_buffer,
-        .signalSemaphoreCount = 1,
-        .pSignalSemaphores = &render.draw_finished_semaphore,
-    };
+typedef struct PrimitiveLoad {
+    cgltf_primitive* gltf_primitive;
+    Mesh* mesh;
+    Primitive* primitive;
+#ifndef RELEASE
+    // Of the welded primitive before and after meshopt_optimize_primitive
+    float acmr_before;
+    float acmr_after;
+#endif
+} PrimitiveLoad;
+
+typedef struct LoadJob {
+    PrimitiveLoad* loads;
+    Vertex* vertices;
+    uint32_t* indices;
+    Meshlet* meshlets;
+} LoadJob;
+
+// Unpacks, welds and optimizes primitives within the vertex and index
+// ranges reserved for them, then shrinks vertex_count to the welded count,
+// simplifies the LODs into the index room left and counts the meshlets
+static void load_primitives_job(void* data, uint32_t begin, uint32_t end,
+        uint32_t thread)
+{
+    (void) thread;
+    LoadJob* job = data;
+    for (uint32_t i=begin; i < end; i++) {
+        cgltf_primitive* gltf_primitive = job->loads[i].gltf_primitive;
+        Primitive* primitive = job->loads[i].primitive;
+        Vertex* vertices = &job->vertices[primitive->vertex_offset];
+        uint32_t* indices = &job->indices[primitive->index_offset];
+
+        // Attributes the primitive lacks stay zero
+        memset(vertices, 0, sizeof(Vertex) * primitive->vertex_count);
+        for (size_t a=0; a < gltf_primitive->attributes_count; a++) {
+            cgltf_attribute* attribute = &gltf_primitive->attributes[a];
+            float* dst = NULL;
+            uint32_t components = 0;
+            if (attribute->type == cgltf_attribute_type_position) {
+                dst = vertices->position;
+                components = 3;
+            } else if (attribute->type == cgltf_attribute_type_normal) {
+                dst = vertices->normal;
+                components = 3;
+            } else if (attribute->type == cgltf_attribute_type_texcoord &&
+                    attribute->index == 0) {
+                dst = vertices->tex_coord;
+                components = 2;
+            }
+            if (!dst) continue;
+            DBASSERT(attribute->data->count == primitive->vertex_count);
+            accessor_unpack_floats(attribute->data, components, dst,
+                    sizeof(Vertex) / sizeof(float));
+        }
 
-    vkResetFences(g_device, 1, &render.commands_executed_fence);
+        // Bounds
+        glm_vec3_copy((vec3) {FLT_MAX, FLT_MAX, FLT_MAX}, primitive->min);
+        glm_vec3_copy((vec3) {-FLT_MAX, -FLT_MAX, -FLT_MAX}, primitive->max);
+        for (size_t v=0; v < primitive->vertex_count; v++) {
+            glm_vec3_minv(primitive->min, vertices[v].position,
+                    primitive->min);
+            glm_vec3_maxv(primitive->max, vertices[v].position,
+                    primitive->max);
+        }
 
-    if (vkQueueSubmit(render.graphics_queue, 1, &submit_info,
-            render.commands_executed_fence) != VK_SUCCESS) {
-        fatal("Failed to submit draw command buffer.");
+        // Indices, 8, 16 or 32-bit in the file
+        accessor_unpack_indices(gltf_primitive->indices, indices);
+        primitive->vertex_count = meshopt_weld(vertices,
+                primitive->vertex_count, indices, primitive->index_count,
+                WELD_EPSILON);
+#ifndef RELEASE
+        job->loads[i].acmr_before = meshopt_acmr(indices,
+                primitive->index_count, primitive->vertex_count,
+                MESHOPT_FIFO_SIZE);
+#endif
+        meshopt_optimize_primitive(vertices, primitive->vertex_count,
+                indices, primitive->index_count, OVERDRAW_OPTIMIZATION);
+#ifndef RELEASE
+        job->loads[i].acmr_after = meshopt_acmr(indices,
+                primitive->index_count, primitive->vertex_count,
+                MESHOPT_FIFO_SIZE);
+#endif
+        primitive->wide_indices =
+            primitive->vertex_count > MAX_INDEX16_VERTICES;
+        primitive->meshlet_count = meshopt_build_meshlets(vertices, indices,
+                primitive->index_count, NULL);
+
+        // Each LOD is simplified from the one before, its error adds up
+        primitive->lods[0] = (Lod) {primitive->index_offset,
+            primitive->index_count, primitive->vertex_count, 0.0f};
+        primitive->lod_count = 1;
+        uint32_t lod_offset = primitive->index_offset + primitive->index_count;
+        uint32_t lod_end = primitive->index_offset + 2 * primitive->index_count;
+        float max_error = LOD_MAX_ERROR *
+            glm_vec3_distance(primitive->min, primitive->max);
+        uint32_t* scratch =
+            malloc_nofail(sizeof(uint32_t) * MAX(primitive->index_count, 1));
+        uint8_t* referenced =
+            malloc_nofail(sizeof(uint8_t) * MAX(primitive->vertex_count, 1));
+        while (primitive->lod_count < MAX_LODS) {
+            Lod* previous = &primitive->lods[primitive->lod_count - 1];
+            float error = 0.0f;
+            size_t count = meshopt_simplify(scratch,
+                    &job->indices[previous->index_offset],
+                    previous->index_count, vertices, primitive->vertex_count,
+                    previous->index_count / 2, max_error, &error);
+            if (count == 0 || count > previous->index_count * LOD_MAX_KEPT ||
+                    lod_offset + count > lod_end) break;
+            meshopt_optimize_vertex_cache(&job->indices[lod_offset], scratch,
+                    count, primitive->vertex_count);
+            memset(referenced, 0, sizeof(uint8_t) * primitive->vertex_count);
+            uint32_t lod_vertices = 0;
+            for (size_t i=0; i < count; i++) {
+                lod_vertices += !referenced[scratch[i]];
+                referenced[scratch[i]] = 1;
+            }
+            primitive->lods[primitive->lod_count++] = (Lod) {
+                lod_offset, count, lod_vertices, previous->error + error};
+            lod_offset += count;
+        }
+        mem_free(referenced);
+        mem_free(scratch);
     }
+}
 
-    VkPresentInfoKHR present_info = {
-        .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
-        .waitSemaphoreCount = 1,
-        .pWaitSemaphores = &render.draw_finished_semaphore,
-        .swapchainCount = 1,
-        .pSwapchains = &render.swapchain,
-        .pImageIndices = &image_index,
-    };
-    VkResult present_result = vkQueuePresentKHR(render.present_queue, &present_info);
-    if (present_result == VK_ERROR_OUT_OF_DATE_KHR ||
-            present_result == VK_SUBOPTIMAL_KHR) {
-        recreate_swapchain();
-    } else if (present_result != VK_SUCCESS) {
-        fatal("Failed to present swapchain image.");
+// Fills the meshlets counted by load_primitives_job, once the vertices are
+// packed
+static void build_meshlets_job(void* data, uint32_t begin, uint32_t end,
+        uint32_t thread)
+{
+    (void) thread;
+    LoadJob* job = data;
+    for (uint32_t i=begin; i < end; i++) {
+        Primitive* primitive = job->loads[i].primitive;
+        meshopt_build_meshlets(&job->vertices[primitive->vertex_offset],
+                &job->indices[primitive->index_offset],
+                primitive->index_count,
+                &job->meshlets[primitive->meshlet_offset]);
     }
+}
 
-    render.current_frame = (current_frame + 1) % 2;
-    render.frames++;
+typedef struct CompactJob {
+    PrimitiveLoad* loads;
+    Vertex* vertices;
+    CompactVertex* compact;
+} CompactJob;
+
+// Quantizes primitives to the bounds of their mesh
+static void compact_vertices_job(void* data, uint32_t begin, uint32_t end,
+        uint32_t thread)
+{
+    (void) thread;
+    CompactJob* job = data;
+    for (uint32_t i=begin; i < end; i++) {
+        Mesh* mesh = job->loads[i].mesh;
+        Primitive* primitive = job->loads[i].primitive;
+        vec3 extent;
+        glm_vec3_sub(mesh->max, mesh->min, extent);
+        compact_vertices(&job->vertices[primitive->vertex_offset],
+                primitive->vertex_count, mesh->min, extent,
+                &job->compact[primitive->vertex_offset]);
+    }
 }
 
-bool render_exit() {
-    return glfwWindowShouldClose(g_window);
+// True when the extras object of a glTF element has key set to true
+static bool extras_flag(cgltf_data* data, cgltf_extras* extras,
+        const char* key)
+{
+    cgltf_size size = 0;
+    if (extras->end_offset <= extras->start_offset ||
+            cgltf_copy_extras_json(data, extras, NULL, &size) !=
+            cgltf_result_success) return false;
+    char* json = malloc_nofail(size);
+    cgltf_copy_extras_json(data, extras, json, &size);
+    char quoted[64];
+    snprintf(quoted, sizeof(quoted), "\"%s\"", key);
+    bool set = false;
+    const char* found = strstr(json, quoted);
+    if (found) {
+        found += strlen(quoted);
+        while (*found == ' ' || *found == '\t' || *found == '\n' ||
+                *found == '\r' || *found == ':') found++;
+        set = !strncmp(found, "true", 4);
+    }
+    mem_free(json);
+    return set;
 }
 
 void load_scene()
@@ -2358,14 +4913,21 @@ void load_scene()
     cgltf_options gltf_options = {0};
     cgltf_data* gltf_data = NULL;
     cgltf_result gltf_result = cgltf_parse_file(
-                            &gltf_options, "res/cube.glb", &gltf_data);
+                            &gltf_options, SCENE_PATH, &gltf_data);
     if (gltf_result != cgltf_result_success) fatal("Failed to load GLTF.");
-    gltf_result = cgltf_load_buffers(&gltf_options, gltf_data, "res/cube.glb");
+    gltf_result = cgltf_load_buffers(&gltf_options, gltf_data, SCENE_PATH);
     if (gltf_result != cgltf_result_success) fatal("Failed to load GLTF buffers.");
+    if (extras_flag(gltf_data, &gltf_data->extras, "compact_vertices")) {
+        scene.compact_vertices = true;
+    }
     
     // Load materials
     render.texture_count = gltf_data->materials_count;
-    DBASSERT(render.texture_count <= MAX_TEXTURES);
+    // Counts the fallback's sets the same way, the cursor has one of them
+    if (MATERIAL_TEXTURE_OFFSET + render.texture_count >
+            render.max_textures) {
+        fatal("Too many materials for the texture descriptors.");
+    }
     render.textures = malloc_nofail(sizeof(Texture) * render.texture_count);
     for (size_t i=0; i < render.texture_count; i++) {
         cgltf_material* gltf_material = &gltf_data->materials[i];
@@ -2374,125 +4936,201 @@ void load_scene()
             &gltf_material->pbr_metallic_roughness.base_color_texture;
         cgltf_texture* gltf_texture = gltf_texture_view->texture;
         cgltf_image* gltf_image = gltf_texture->image;
-        DBASSERT(!strcmp(gltf_image->mime_type, "image/jpeg"));
+
+        // Images cooked next to the scene skip the decode
+        char cooked_path[256];
+        snprintf(cooked_path, sizeof(cooked_path), "%s.%zu.ktx2", SCENE_PATH,
+                (size_t) (gltf_image - gltf_data->images));
+        char* cooked;
+        size_t cooked_size;
+        if (!read_binary_file(cooked_path, &cooked, &cooked_size)) {
+            bool loaded = load_ktx2_texture(cooked, cooked_size,
+                    &render.textures[i], MATERIAL_TEXTURE_OFFSET + i);
+            mem_free(cooked);
+            if (loaded) continue;
+        }
+
         cgltf_buffer_view* image_buffer_view = gltf_image->buffer_view;
         cgltf_buffer* image_buffer = image_buffer_view->buffer;
         void* image_data = image_buffer->data + image_buffer_view->offset;
         size_t image_size = image_buffer_view->size;
-
-        load_texture(image_data, image_size, &render.textures[i]);
+        if (!strcmp(gltf_image->mime_type, "image/ktx2")) {
+            if (!load_ktx2_texture(image_data, image_size,
+                        &render.textures[i], MATERIAL_TEXTURE_OFFSET + i))
+                fatal("Failed to load KTX2 texture.");
+            continue;
+        }
+        DBASSERT(!strcmp(gltf_image->mime_type, "image/jpeg"));
+        load_texture(image_data, image_size, &render.textures[i],
+                MATERIAL_TEXTURE_OFFSET + i);
     }
 
     scene.meshes = malloc_nofail(sizeof(Mesh) * gltf_data->meshes_count);
     scene.mesh_count = gltf_data->meshes_count;
 
-    // Precalculate index and vertex buffer sizes
+    // Precalculate index and vertex buffer sizes, before welding
     size_t index_count = 0;
     size_t vertex_count = 0;
+    size_t primitive_count = 0;
     for (size_t i=0; i < gltf_data->meshes_count; i++) {
         cgltf_mesh* gltf_mesh = &gltf_data->meshes[i];
         for (size_t p=0; p < gltf_mesh->primitives_count; p++) {
             cgltf_primitive* gltf_primitive = &gltf_mesh->primitives[p];
             DBASSERT(gltf_primitive->type == cgltf_primitive_type_triangles);
-
-            for (size_t a=0; a < gltf_primitive->attributes_count; a++) {
-                cgltf_attribute* attribute = &gltf_primitive->attributes[a];
-                cgltf_accessor* accessor = attribute->data;
-                if (attribute->type == cgltf_attribute_type_position) {
-                    vertex_count += accessor->count;
-                }
-            }
-            DBASSERT(gltf_primitive->indices->component_type ==
-                    cgltf_component_type_r_16u);
+            vertex_count += primitive_position_count(gltf_primitive);
+            DBASSERT(gltf_primitive->indices);
             index_count += gltf_primitive->indices->count;
         }
+        primitive_count += gltf_mesh->primitives_count;
     }
-    Vertex* vertices = malloc_nofail(vertex_count * sizeof(Vertex));
-    uint16_t* indices = malloc_nofail(index_count * sizeof(uint16_t));
-
-    // Load meshes
+    Vertex* vertices = malloc_nofail(MAX(vertex_count, 1) * sizeof(Vertex));
+    // Twice the indices, for the LODs
+    uint32_t* loaded_indices =
+        malloc_nofail(MAX(2 * index_count, 1) * sizeof(uint32_t));
+    PrimitiveLoad* loads =
+        malloc_nofail(MAX(primitive_count, 1) * sizeof(PrimitiveLoad));
+
+    // Load meshes. Every primitive gets its vertex and index ranges up
+    // front, then they are loaded in parallel. Until all primitives are
+    // loaded index_offset is into loaded_indices.
     size_t index_offset = 0;
     size_t vertex_offset = 0;
+    scene.primitive_count = 0;
     for (size_t i=0; i < gltf_data->meshes_count; i++) {
         cgltf_mesh* gltf_mesh = &gltf_data->meshes[i];
         Mesh* mesh = &scene.meshes[i];
         mesh->primitives_count = gltf_mesh->primitives_count;
         mesh->primitives = malloc_nofail(
                         sizeof(Primitive) * mesh->primitives_count);
+        mesh->first_primitive = scene.primitive_count;
+        mesh->lod_count = 1;
+        memset(mesh->lod_errors, 0, sizeof(mesh->lod_errors));
+        glm_vec3_copy((vec3) {FLT_MAX, FLT_MAX, FLT_MAX}, mesh->min);
+        glm_vec3_copy((vec3) {-FLT_MAX, -FLT_MAX, -FLT_MAX}, mesh->max);
         // Primitives
         for (size_t p=0; p < gltf_mesh->primitives_count; p++) {
             cgltf_primitive* gltf_primitive = &gltf_mesh->primitives[p];
+            Primitive* primitive = &mesh->primitives[p];
 
             // Material
             size_t material_index = (size_t)(((char*)gltf_primitive->material -
                     (char*) gltf_data->materials) / sizeof(cgltf_material));
-            mesh->primitives[p].texture_id = material_index;
-
-            // Vertices
-            mesh->primitives[p].vertex_offset = vertex_offset;
-            size_t primitive_vertex_count;
-            for (size_t a=0; a < gltf_primitive->attributes_count; a++) {
-                cgltf_attribute* attribute = &gltf_primitive->attributes[a];
-                cgltf_accessor* accessor = attribute->data;
-                size_t count = accessor->count;
-                size_t stride = accessor->stride;
-                cgltf_buffer_view* buffer_view = accessor->buffer_view;
-                cgltf_buffer* buffer = buffer_view->buffer;
-                char* data = (char*) buffer->data +
-                            buffer_view->offset + accessor->offset;
-                
-                if (attribute->type == cgltf_attribute_type_position) {
-                    for (size_t v=0; v < count; v++) {
-                        vec3* pos = (vec3*) data;
-                        vertices[vertex_offset + v].position[0] = (*pos)[0];
-                        vertices[vertex_offset + v].position[1] = (*pos)[1];
-                        vertices[vertex_offset + v].position[2] = (*pos)[2];
-                        data += stride;
-                    }
-                    primitive_vertex_count = count;
-                }
-                
-                if (attribute->type == cgltf_attribute_type_normal) {
-                    for (size_t v=0; v < count; v++) {
-                        vec3* normal = (vec3*) data;
-                        vertices[vertex_offset + v].normal[0] = (*normal)[0];
-                        vertices[vertex_offset + v].normal[1] = (*normal)[1];
-                        vertices[vertex_offset + v].normal[2] = (*normal)[2];
-                        data += stride;
-                    }
+            primitive->texture_id = material_index;
+
+            primitive->vertex_offset = vertex_offset;
+            primitive->vertex_count = primitive_position_count(gltf_primitive);
+            primitive->index_offset = index_offset;
+            primitive->index_count = gltf_primitive->indices->count;
+            vertex_offset += primitive->vertex_count;
+            index_offset += 2 * primitive->index_count;
+
+            PrimitiveLoad* load = &loads[scene.primitive_count + p];
+            load->gltf_primitive = gltf_primitive;
+            load->mesh = mesh;
+            load->primitive = primitive;
+        }
+        scene.primitive_count += mesh->primitives_count;
+    }
+    LoadJob load_job = {loads, vertices, loaded_indices, NULL};
+    jobs_parallel_for(load_primitives_job, &load_job, scene.primitive_count,
+            MIN_PRIMITIVES_PER_LOAD_JOB);
+
+    // Welding only shrinks primitives, pack them to the front
+    vertex_offset = 0;
+    scene.meshlet_count = 0;
+    for (size_t i=0; i < scene.primitive_count; i++) {
+        Primitive* primitive = loads[i].primitive;
+        Mesh* mesh = loads[i].mesh;
+        memmove(&vertices[vertex_offset], &vertices[primitive->vertex_offset],
+                sizeof(Vertex) * primitive->vertex_count);
+        primitive->vertex_offset = vertex_offset;
+        vertex_offset += primitive->vertex_count;
+        glm_vec3_minv(mesh->min, primitive->min, mesh->min);
+        glm_vec3_maxv(mesh->max, primitive->max, mesh->max);
+        mesh->lod_count = MAX(mesh->lod_count, primitive->lod_count);
+        for (uint32_t l=0; l < MAX_LODS; l++) {
+            Lod* lod = &primitive->lods[MIN(l, primitive->lod_count - 1)];
+            mesh->lod_errors[l] = MAX(mesh->lod_errors[l], lod->error);
+        }
+        primitive->meshlet_offset = scene.meshlet_count;
+        scene.meshlet_count += primitive->meshlet_count;
+#ifndef RELEASE
+        printf("Primitive %zu: %u triangles, ACMR %.3f -> %.3f\n", i,
+                primitive->index_count / 3, loads[i].acmr_before,
+                loads[i].acmr_after);
+#endif
+    }
+    vertex_count = vertex_offset;
+    scene.meshlets =
+        malloc_nofail(sizeof(Meshlet) * MAX(scene.meshlet_count, 1));
+    load_job.meshlets = scene.meshlets;
+    jobs_parallel_for(build_meshlets_job, &load_job, scene.primitive_count,
+            MIN_PRIMITIVES_PER_LOAD_JOB);
+
+    // Primitives that fit get 16-bit indices, the rest 32-bit. Their LODs
+    // follow them.
+    size_t index16_count = 0;
+    size_t index32_count = 0;
+    for (size_t i=0; i < scene.mesh_count; i++) {
+        Mesh* mesh = &scene.meshes[i];
+        for (size_t p=0; p < mesh->primitives_count; p++) {
+            Primitive* primitive = &mesh->primitives[p];
+            for (uint32_t l=0; l < primitive->lod_count; l++) {
+                if (primitive->wide_indices) {
+                    index32_count += primitive->lods[l].index_count;
+                } else {
+                    index16_count += primitive->lods[l].index_count;
                 }
-                
-                if (attribute->type == cgltf_attribute_type_texcoord) {
-                    for (size_t v=0; v < count; v++) {
-                        vec2* texcoord = (vec2*) data;
-                        vertices[vertex_offset + v].tex_coord[0] = (*texcoord)[0];
-                        vertices[vertex_offset + v].tex_coord[1] = (*texcoord)[1];
-                        data += stride;
+            }
+        }
+    }
+    uint16_t* indices =
+        malloc_nofail(MAX(index16_count, 1) * sizeof(uint16_t));
+    uint32_t* indices32 =
+        malloc_nofail(MAX(index32_count, 1) * sizeof(uint32_t));
+    index16_count = 0;
+    index32_count = 0;
+    for (size_t i=0; i < scene.mesh_count; i++) {
+        Mesh* mesh = &scene.meshes[i];
+        for (size_t p=0; p < mesh->primitives_count; p++) {
+            Primitive* primitive = &mesh->primitives[p];
+            for (uint32_t l=0; l < primitive->lod_count; l++) {
+                Lod* lod = &primitive->lods[l];
+                uint32_t* src = &loaded_indices[lod->index_offset];
+                if (primitive->wide_indices) {
+                    memcpy(&indices32[index32_count], src,
+                            sizeof(uint32_t) * lod->index_count);
+                    lod->index_offset = index32_count;
+                    index32_count += lod->index_count;
+                } else {
+                    for (size_t j=0; j < lod->index_count; j++) {
+                        indices[index16_count + j] = src[j];
                     }
+                    lod->index_offset = index16_count;
+                    index16_count += lod->index_count;
                 }
             }
-            vertex_offset += primitive_vertex_count;
-
-            // Indices
-            mesh->primitives[p].index_offset = index_offset;
-            cgltf_accessor* index_accessor = gltf_primitive->indices;
-            size_t count = index_accessor->count;
-            size_t stride = index_accessor->stride;
-            cgltf_buffer_view* buffer_view = index_accessor->buffer_view;
-            cgltf_buffer* buffer = buffer_view->buffer;
-            char* data = (char*) buffer->data +
-                        buffer_view->offset + index_accessor->offset;
-            
-            for (size_t i=0; i < count; i++) {
-                uint16_t* index = (uint16_t*) data;
-                indices[index_offset + i] = *index;
-                data += stride;
-            }
-            mesh->primitives[p].index_count = count;
-            index_offset += count;
+            primitive->index_offset = primitive->lods[0].index_offset;
         }
     }
-    
+    mem_free(loaded_indices);
+
+    scene.vertices = vertices;
+    scene.vertex_count = vertex_count;
+    scene.indices = indices;
+    scene.index_count = index16_count;
+    scene.indices32 = indices32;
+    scene.index32_count = index32_count;
+
+    render.primitives =
+        malloc_nofail(sizeof(Primitive*) * scene.primitive_count);
+    for (size_t i=0; i < scene.mesh_count; i++) {
+        Mesh* mesh = &scene.meshes[i];
+        for (size_t p=0; p < mesh->primitives_count; p++) {
+            render.primitives[mesh->first_primitive + p] = &mesh->primitives[p];
+        }
+    }
+
     // Load nodes
     cgltf_node* gltf_nodes = gltf_data->nodes;
     scene.node_count = gltf_data->nodes_count;
@@ -2503,23 +5141,7 @@ void load_scene()
         node->id = n + 1;
         cgltf_node* gltf_node = &gltf_nodes[n];
 
-        DBASSERT(!gltf_node->has_matrix);
-        if (gltf_node->has_translation) {
-            glm_vec3_copy(gltf_node->translation, node->translation);
-        } else {
-            glm_vec3_zero(node->translation);
-        }
-        if (gltf_node->has_rotation) {
-            memcpy(node->rotation, gltf_node->rotation, sizeof(versor));
-        } else {
-            glm_quat_identity(node->rotation);
-        }
-        if (gltf_node->has_scale) {
-            glm_vec3_copy(gltf_node->scale, node->scale);
-        } else {
-            glm_vec3_one(node->scale);
-        }
-
+        node->is_static = extras_flag(gltf_data, &gltf_node->extras, "static");
         node->mesh = NULL;
         if (gltf_node->mesh) {
             size_t mesh_index = (size_t) (((char*) gltf_node->mesh -
@@ -2543,28 +5165,102 @@ void load_scene()
         }
     }
 
+    // Node transforms
+    scene_build_hierarchy(&scene);
+    Hierarchy* hierarchy = &scene.hierarchy;
+    for (size_t n=0; n < scene.node_count; n++) {
+        cgltf_node* gltf_node = &gltf_nodes[n];
+        uint32_t t = scene.nodes[n].transform;
+
+        DBASSERT(!gltf_node->has_matrix);
+        if (gltf_node->has_translation) {
+            glm_vec3_copy(gltf_node->translation, hierarchy->translation[t]);
+        } else {
+            glm_vec3_zero(hierarchy->translation[t]);
+        }
+        if (gltf_node->has_rotation) {
+            memcpy(hierarchy->rotation[t], gltf_node->rotation, sizeof(versor));
+        } else {
+            glm_quat_identity(hierarchy->rotation[t]);
+        }
+        if (gltf_node->has_scale) {
+            glm_vec3_copy(gltf_node->scale, hierarchy->scale[t]);
+        } else {
+            glm_vec3_one(hierarchy->scale[t]);
+        }
+    }
+    scene_update_transforms(&scene);
+
+    // Draw list slots
+    render.node_draw_offsets =
+        malloc_nofail(sizeof(uint32_t) * (scene.node_count + 1));
+    uint32_t draw_capacity = 0;
+    for (size_t n=0; n < scene.node_count; n++) {
+        render.node_draw_offsets[n] = draw_capacity;
+        if (scene.nodes[n].mesh)
+            draw_capacity += scene.nodes[n].mesh->primitives_count;
+    }
+    render.node_draw_offsets[scene.node_count] = draw_capacity;
+    render.draws = malloc_nofail(sizeof(DrawCommand) * draw_capacity);
+    render.draw_count = 0;
+    render.cull_masks = malloc_nofail(sizeof(uint8_t) * scene.node_count);
+    render.visible = malloc_nofail(sizeof(uint8_t) * scene.node_count);
+    render.lods = malloc_nofail(sizeof(uint8_t) * scene.node_count);
+    memset(render.lods, 0, sizeof(uint8_t) * scene.node_count);
+    // Groups are per primitive and LOD
+    size_t group_capacity = scene.primitive_count * MAX_LODS;
+    render.primitive_instances =
+        malloc_nofail(sizeof(uint32_t) * group_capacity);
+    render.groups = malloc_nofail(sizeof(DrawGroup) * group_capacity);
+    render.group_count = 0;
+    render.sort_keys = malloc_nofail(sizeof(uint64_t) * group_capacity);
+    render.sort_scratch = malloc_nofail(sizeof(uint64_t) * group_capacity);
+    render.instances = malloc_nofail(sizeof(uint32_t) * draw_capacity);
+    build_static_batches();
+    create_transform_buffer();
+    count_cluster_draws();
+    create_instance_buffer(count_instance_slots(draw_capacity));
+    create_gpu_scene(draw_capacity);
+    create_quantization_buffer();
+
+    CompactVertex* compact = NULL;
+    if (scene.compact_vertices) {
+        compact = malloc_nofail(sizeof(CompactVertex) * MAX(vertex_count, 1));
+        CompactJob compact_job = {loads, vertices, compact};
+        jobs_parallel_for(compact_vertices_job, &compact_job,
+                scene.primitive_count, MIN_PRIMITIVES_PER_LOAD_JOB);
+    }
+    upload_vertices(vertices, compact, vertex_count, &render.vertex_buffer);
+    if (compact) mem_free(compact);
+    mem_free(loads);
+#ifndef RELEASE
+    size_t total_vertices = vertex_count;
+    for (uint32_t b=0; b < render.batch_count; b++) {
+        total_vertices += render.batches[b].vertex_count;
+    }
+    printf("Vertex memory: %zu KB as Vertex, %zu KB as CompactVertex, "
+            "using %s\n",
+            total_vertices * sizeof(Vertex) / 1024,
+            total_vertices * sizeof(CompactVertex) / 1024,
+            scene.compact_vertices ? "CompactVertex" : "Vertex");
+#endif
     device_local_buffer_from_data(
-            (void*) vertices,
-            sizeof(Vertex) * vertex_count,
-            VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+            (void*) indices,
+            sizeof(uint16_t) * MAX(index16_count, 1),
+            VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
             render.graphics_queue,
             render.graphics_command_pool,
-            &render.vertex_buffer
+            &render.index_buffer
     );
     device_local_buffer_from_data(
-            (void*) indices,
-            sizeof(uint16_t) * index_count,
+            (void*) indices32,
+            sizeof(uint32_t) * MAX(index32_count, 1),
             VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
             render.graphics_queue,
             render.graphics_command_pool,
-            &render.index_buffer
+            &render.index_buffer32
     );
 
-    scene.vertices = vertices;
-    scene.vertex_count = vertex_count;
-    scene.indices = indices;
-    scene.index_count = index_count;
-
     // Load lights
     Light light1 = {
         .pos = { 3.0, 6.0, 12.0 },
@@ -2590,13 +5286,7 @@ void load_scene()
             VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
             &render.lights_buffer
     );
-    upload_to_device_local_buffer(
-            (void*) lights,
-            sizeof(Light) * LIGHT_COUNT,
-            &render.lights_buffer,
-            render.graphics_queue,
-            render.graphics_command_pool
-    );
+    render_update_lights();
 
     // Deferred lights SBO
     VkDescriptorBufferInfo lights_sbo_info = {
@@ -2619,9 +5309,35 @@ void load_scene()
     cgltf_free(gltf_data);
 }
 
+void render_update_lights()
+{
+    upload_to_device_local_buffer(
+            (void*) scene.lights,
+            sizeof(Light) * scene.light_count,
+            &render.lights_buffer,
+            render.graphics_queue,
+            render.graphics_command_pool
+    );
+}
+
 void unload_scene()
 {
     destroy_scene(&scene);
+    mem_free(render.draws);
+    mem_free(render.node_draw_offsets);
+    mem_free(render.cull_masks);
+    mem_free(render.visible);
+    mem_free(render.lods);
+    mem_free(render.primitives);
+    mem_free(render.primitive_instances);
+    mem_free(render.groups);
+    mem_free(render.sort_keys);
+    mem_free(render.sort_scratch);
+    mem_free(render.instances);
+    destroy_gpu_scene();
+    destroy_instance_buffer();
+    destroy_transform_buffer();
+    destroy_static_batches();
 
     for (size_t i=0; i < render.texture_count; i++) {     
         destroy_texture(&render.textures[i]);
@@ -2629,8 +5345,10 @@ void unload_scene()
     mem_free(render.textures);
 
     destroy_buffer(&render.lights_buffer);
+    destroy_buffer(&render.index_buffer32);
     destroy_buffer(&render.index_buffer);
     destroy_buffer(&render.vertex_buffer);
+    destroy_buffer(&render.quantization);
 }
 
 static void cleanup_swapchain()
@@ -2649,6 +5367,7 @@ static void cleanup_swapchain()
         vkDestroyFramebuffer(g_device, render.lights_ui_framebuffers[i], NULL);
     }
     vkDestroyFramebuffer(g_device, render.offscreen_framebuffer, NULL);
+    vkDestroyFramebuffer(g_device, render.pick_framebuffer, NULL);
     
     destroy_attachment(&render.offscreen_position);
     destroy_attachment(&render.offscreen_normal);
@@ -2658,14 +5377,19 @@ static void cleanup_swapchain()
 
     vkDestroyPipeline(g_device, render.graphics_pipeline, NULL);
     vkDestroyPipeline(g_device, render.offscreen_graphics_pipeline, NULL);
+    vkDestroyPipeline(g_device, render.compact_offscreen_pipeline, NULL);
     vkDestroyPipeline(g_device, render.lights_ui_pipeline, NULL);
     vkDestroyPipeline(g_device, render.image_blit_pipeline, NULL);
+    vkDestroyPipeline(g_device, render.pick_pipeline, NULL);
+    vkDestroyPipeline(g_device, render.compact_pick_pipeline, NULL);
+    vkDestroyPipeline(g_device, render.lights_pick_pipeline, NULL);
     vkDestroyPipelineLayout(g_device, render.graphics_pipeline_layout, NULL);
 
     vkDestroyRenderPass(g_device, render.render_pass, NULL);
     vkDestroyRenderPass(g_device, render.offscreen_render_pass, NULL);
     vkDestroyRenderPass(g_device, render.lights_ui_render_pass, NULL);
     vkDestroyRenderPass(g_device, render.image_blit_render_pass, NULL);
+    vkDestroyRenderPass(g_device, render.pick_render_pass, NULL);
 
     for (uint32_t i=0; i < FRAMES_IN_FLIGHT; i++) {
         vkDestroyImageView(g_device, render.swapchain_image_views[i], NULL);
@@ -2683,8 +5407,10 @@ void render_destroy()
 
     destroy_buffer(&render.cursor_vertex_buffer);
 
-    vkDestroyImage(g_device, render.object_pick_pixel, NULL);
-    vkFreeMemory(g_device, render.object_pick_pixel_mem, NULL);
+    for (size_t i=0; i < FRAMES_IN_FLIGHT; i++) {
+        vkUnmapMemory(g_device, render.pick_readback[i].memory);
+        destroy_buffer(&render.pick_readback[i]);
+    }
 
     destroy_texture(&render.cursor);
 
@@ -2692,9 +5418,22 @@ void render_destroy()
     destroy_buffer(&render.deferred_ubo_buffer);
 
     vkDestroySampler(g_device, render.texture_sampler, NULL);
+    vkDestroySampler(g_device, render.base_mip_sampler, NULL);
+    if (render.gpu_timing) {
+        vkDestroyQueryPool(g_device, render.frame_queries, NULL);
+    }
     vkDestroySampler(g_device, render.gbuf_sampler, NULL);
 
     vkDestroyDescriptorPool(g_device, render.texture_descriptor_pool, NULL);
+    if (render.gpu_driven) {
+        vkDestroyPipeline(g_device, render.cull_pipeline, NULL);
+        vkDestroyPipeline(g_device, render.emit_draws_pipeline, NULL);
+        vkDestroyPipeline(g_device, render.cull_clusters_pipeline, NULL);
+        vkDestroyPipelineLayout(g_device, render.cull_pipeline_layout, NULL);
+        vkDestroyDescriptorPool(g_device, render.cull_descriptor_pool, NULL);
+        vkDestroyDescriptorSetLayout(
+                g_device, render.cull_desc_set_layout, NULL);
+    }
 
     vkDestroyDescriptorSetLayout(g_device, render.desc_set_layout, NULL);
     vkDestroyDescriptorSetLayout(g_device, render.gbuf_desc_set_layout, NULL);
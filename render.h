@@ -3,13 +3,58 @@
 
 #include <cglm/cglm.h>
 
+#define MAX_PICK_CODES 64
+
+// Unique object codes found in a picked screen rectangle
+typedef struct PickResult {
+    uint32_t id;
+    uint32_t code_count;
+    uint32_t codes[MAX_PICK_CODES];
+} PickResult;
+
+// Counts for the last recorded frame
+typedef struct RenderStats {
+    // Nodes, or on the GPU-driven path node primitives, which it culls one
+    // by one. Statically batched ones are not counted.
+    uint32_t nodes_drawn;
+    uint32_t nodes_culled;
+    uint32_t draws;
+    uint32_t binds; // Texture descriptor set binds in the G-buffer pass
+    uint32_t batches; // Static batches drawn
+    // Vertices of the selected LODs times instances drawn, for vertex fetch
+    // estimates. Those of the meshlets drawn for clustered primitives.
+    uint32_t vertices;
+    // Cluster culling of the draws that passed node culling, GPU-driven
+    // path only. clusters and cluster_triangles are those of every
+    // clustered draw slot.
+    uint32_t clusters;
+    uint32_t cluster_triangles;
+    uint32_t clusters_culled;
+    uint32_t frustum_culled_triangles;
+    uint32_t backface_culled_triangles;
+    // GPU time of the frame's commands, 0 without timestamp support
+    float gpu_ms;
+} RenderStats;
+
 void render_init();
 bool render_exit();
 void render_draw_frame(vec3 cam_pos, vec3 cam_dir, vec3 cam_up);
 void render_destroy();
-uint32_t get_object_code(uint32_t x, uint32_t y);
+uint32_t render_request_pick(uint32_t x, uint32_t y,
+        uint32_t width, uint32_t height);
+bool render_poll_pick(PickResult* o_result);
+void render_cursor_ray(uint32_t x, uint32_t y,
+        vec3 cam_pos, vec3 cam_dir, vec3 cam_up, vec3 o_origin, vec3 o_dir);
+void render_get_stats(RenderStats* o_stats);
+// Prints the stats to stdout every 0.2 s while enabled
+void render_set_print_stats(bool enabled);
+// Clamps material textures to their base level, for measuring what the
+// mip chains save. Waits for the device to go idle.
+void render_set_base_mip_only(bool enabled);
 void load_scene();
 void unload_scene();
+// Uploads scene.lights after they were moved
+void render_update_lights();
 
 #define LIGHT_ID_OFFSET 100000
 
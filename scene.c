@@ -1,18 +1,234 @@
+#include <float.h>
+#include <string.h>
 #include "alloc.h"
 #include "globals.h"
+#include "utils.h"
 #include "scene.h"
+#include "transform.h"
+#include "jobs.h"
+
+#define MIN_TRANSFORMS_PER_JOB 512
 
 void destroy_mesh(Mesh* mesh)
 {
     mem_free(mesh->primitives);
 }
 
-void node_make_matrix(Node* node, mat4 dest)
+// Orders the nodes breadth first and assigns their transform entries. The
+// TRS arrays are left for the caller to fill.
+void scene_build_hierarchy(Scene* scene)
+{
+    Hierarchy* h = &scene->hierarchy;
+    uint32_t count = scene->node_count;
+    h->count = count;
+    h->translation = malloc_nofail(sizeof(vec3) * count);
+    h->rotation = malloc_nofail(sizeof(versor) * count);
+    h->scale = malloc_nofail(sizeof(vec3) * count);
+    h->local = malloc_nofail(sizeof(mat4) * count);
+    h->world = malloc_nofail(sizeof(mat4) * count);
+    h->parent = malloc_nofail(sizeof(uint32_t) * count);
+    h->node = malloc_nofail(sizeof(uint32_t) * count);
+    h->dirty = malloc_nofail(sizeof(uint8_t) * count);
+    h->changed = malloc_nofail(sizeof(uint8_t) * count);
+    h->local_min = malloc_nofail(sizeof(vec3) * count);
+    h->local_max = malloc_nofail(sizeof(vec3) * count);
+    h->world_min = malloc_nofail(sizeof(vec3) * count);
+    h->world_max = malloc_nofail(sizeof(vec3) * count);
+    h->subtree_min = malloc_nofail(sizeof(vec3) * count);
+    h->subtree_max = malloc_nofail(sizeof(vec3) * count);
+
+    uint32_t* depth = malloc_nofail(sizeof(uint32_t) * count);
+    uint32_t tail = 0;
+    for (uint32_t n=0; n < count; n++) {
+        if (scene->nodes[n].parent) continue;
+        h->node[tail] = n;
+        h->parent[tail] = HIERARCHY_ROOT;
+        depth[tail] = 0;
+        tail++;
+    }
+    for (uint32_t i=0; i < tail; i++) {
+        Node* node = &scene->nodes[h->node[i]];
+        node->transform = i;
+        for (uint32_t c=0; c < node->children_count; c++) {
+            h->node[tail] = node->children[c] - scene->nodes;
+            h->parent[tail] = i;
+            depth[tail] = depth[i] + 1;
+            tail++;
+        }
+    }
+    DBASSERT(tail == count);
+
+    h->level_count = count ? depth[count - 1] + 1 : 0;
+    h->level_offsets = malloc_nofail(sizeof(uint32_t) * (h->level_count + 1));
+    uint32_t level = 0;
+    for (uint32_t i=0; i < count; i++) {
+        while (level <= depth[i]) h->level_offsets[level++] = i;
+    }
+    h->level_offsets[h->level_count] = count;
+    mem_free(depth);
+
+    for (uint32_t i=0; i < count; i++) {
+        Mesh* mesh = scene->nodes[h->node[i]].mesh;
+        if (mesh) {
+            glm_vec3_copy(mesh->min, h->local_min[i]);
+            glm_vec3_copy(mesh->max, h->local_max[i]);
+        } else {
+            glm_vec3_copy((vec3) {FLT_MAX, FLT_MAX, FLT_MAX}, h->local_min[i]);
+            glm_vec3_copy((vec3) {-FLT_MAX, -FLT_MAX, -FLT_MAX},
+                    h->local_max[i]);
+        }
+    }
+
+    memset(h->dirty, TRANSFORM_LOCAL_DIRTY, sizeof(uint8_t) * count);
+    memset(h->changed, 0, sizeof(uint8_t) * count);
+    scene->transforms_dirty = true;
+    scene->transforms_changed = false;
+}
+
+// Call after changing a node's translation, rotation or scale
+void node_mark_dirty(Scene* scene, Node* node)
+{
+    scene->hierarchy.dirty[node->transform] |= TRANSFORM_LOCAL_DIRTY;
+    scene->transforms_dirty = true;
+}
+
+// Transforms the box center and extents, giving a box that encloses the
+// rotated one
+static void transform_bounds(mat4 m, vec3 min, vec3 max,
+        vec3 o_min, vec3 o_max)
+{
+    if (min[0] > max[0]) {
+        glm_vec3_copy(min, o_min);
+        glm_vec3_copy(max, o_max);
+        return;
+    }
+    vec3 center;
+    vec3 extent;
+    glm_vec3_add(min, max, center);
+    glm_vec3_scale(center, 0.5f, center);
+    glm_vec3_sub(max, center, extent);
+
+    vec3 world_center;
+    glm_mat4_mulv3(m, center, 1.0f, world_center);
+    for (int i=0; i < 3; i++) {
+        float world_extent = fabsf(m[0][i]) * extent[0] +
+            fabsf(m[1][i]) * extent[1] + fabsf(m[2][i]) * extent[2];
+        o_min[i] = world_center[i] - world_extent;
+        o_max[i] = world_center[i] + world_extent;
+    }
+}
+
+// Runs of consecutive dirty entries are handed to the batched kernels
+static void update_level(Hierarchy* h, uint32_t begin, uint32_t end)
+{
+    for (uint32_t i=begin; i < end; i++) {
+        uint32_t parent = h->parent[i];
+        if (parent != HIERARCHY_ROOT && h->dirty[parent])
+            h->dirty[i] |= TRANSFORM_WORLD_DIRTY;
+    }
+
+    uint32_t i = begin;
+    while (i < end) {
+        if (!(h->dirty[i] & TRANSFORM_LOCAL_DIRTY)) {
+            i++;
+            continue;
+        }
+        uint32_t run = i;
+        while (i < end && (h->dirty[i] & TRANSFORM_LOCAL_DIRTY)) i++;
+        transform_compose(&h->translation[run], &h->rotation[run],
+                &h->scale[run], &h->local[run], i - run);
+    }
+
+    i = begin;
+    while (i < end) {
+        if (!h->dirty[i]) {
+            i++;
+            continue;
+        }
+        if (h->parent[i] == HIERARCHY_ROOT) {
+            glm_mat4_copy(h->local[i], h->world[i]);
+            i++;
+            continue;
+        }
+        uint32_t run = i;
+        while (i < end && h->dirty[i]) i++;
+        transform_multiply(h->world, h->parent, h->local, run, i - run);
+    }
+
+    for (i=begin; i < end; i++) {
+        if (!h->dirty[i]) continue;
+        h->changed[i] = 1;
+        transform_bounds(h->world[i], h->local_min[i], h->local_max[i],
+                h->world_min[i], h->world_max[i]);
+    }
+}
+
+// Children come after their parents, so a reverse pass folds every subtree
+// into its root
+static void update_subtree_bounds(Hierarchy* h)
+{
+    memcpy(h->subtree_min, h->world_min, sizeof(vec3) * h->count);
+    memcpy(h->subtree_max, h->world_max, sizeof(vec3) * h->count);
+    for (uint32_t i=h->count; i-- > 0;) {
+        uint32_t parent = h->parent[i];
+        if (parent == HIERARCHY_ROOT) continue;
+        glm_vec3_minv(h->subtree_min[parent], h->subtree_min[i],
+                h->subtree_min[parent]);
+        glm_vec3_maxv(h->subtree_max[parent], h->subtree_max[i],
+                h->subtree_max[parent]);
+    }
+}
+
+typedef struct LevelJob {
+    Hierarchy* h;
+    uint32_t first;
+} LevelJob;
+
+static void update_level_job(void* data, uint32_t begin, uint32_t end,
+        uint32_t thread)
+{
+    (void) thread;
+    LevelJob* job = data;
+    update_level(job->h, job->first + begin, job->first + end);
+}
+
+// One pass per level in hierarchy order. Parents are updated before their
+// children, so a dirty parent marks its children's world matrices dirty.
+// Entries within a level are independent and split across the job threads.
+void scene_update_transforms(Scene* scene)
+{
+    if (!scene->transforms_dirty) return;
+    Hierarchy* h = &scene->hierarchy;
+    for (uint32_t l=0; l < h->level_count; l++) {
+        LevelJob job = {h, h->level_offsets[l]};
+        jobs_parallel_for(update_level_job, &job,
+                h->level_offsets[l + 1] - h->level_offsets[l],
+                MIN_TRANSFORMS_PER_JOB);
+    }
+    update_subtree_bounds(h);
+    memset(h->dirty, 0, sizeof(uint8_t) * h->count);
+    scene->transforms_dirty = false;
+    scene->transforms_changed = true;
+}
+
+static void destroy_hierarchy(Hierarchy* h)
 {
-    glm_mat4_identity(dest);
-    glm_translate(dest, node->translation);
-    glm_quat_rotate(dest, node->rotation, dest);
-    glm_scale(dest, node->scale);
+    mem_free(h->translation);
+    mem_free(h->rotation);
+    mem_free(h->scale);
+    mem_free(h->local);
+    mem_free(h->world);
+    mem_free(h->parent);
+    mem_free(h->node);
+    mem_free(h->dirty);
+    mem_free(h->changed);
+    mem_free(h->local_min);
+    mem_free(h->local_max);
+    mem_free(h->world_min);
+    mem_free(h->world_max);
+    mem_free(h->subtree_min);
+    mem_free(h->subtree_max);
+    mem_free(h->level_offsets);
 }
 
 void destroy_scene(Scene* scene)
@@ -27,6 +243,9 @@ void destroy_scene(Scene* scene)
 
     mem_free(scene->vertices);
     mem_free(scene->indices);
+    mem_free(scene->indices32);
+    mem_free(scene->meshlets);
+    destroy_hierarchy(&scene->hierarchy);
 }
 
 Scene scene;
@@ -2,17 +2,60 @@
 #define SCENE_H
 
 #include <cglm/cglm.h>
+#include <stdbool.h>
+
+// Primitives with more vertices keep 32-bit indices
+#define MAX_INDEX16_VERTICES 65536
+
+#define MAX_LODS 4
+
+// Index range over the primitive's vertices, in its index buffer
+typedef struct Lod {
+    uint32_t index_offset;
+    uint32_t index_count;
+    uint32_t vertex_count; // Distinct vertices its indices reference
+    float error; // Local space distance the surface may be off by
+} Lod;
 
 typedef struct Primitive {
     uint32_t texture_id;
     uint32_t vertex_offset;
-    uint32_t index_offset;
+    uint32_t vertex_count;
+    uint32_t index_offset; // Into scene.indices32 if wide_indices is set
     uint32_t index_count;
+    uint32_t meshlet_offset;
+    uint32_t meshlet_count; // Of lods[0]
+    // lods[0] is index_offset and index_count, coarser ones follow
+    Lod lods[MAX_LODS];
+    uint32_t lod_count;
+    bool wide_indices;
+    vec3 min;
+    vec3 max;
 } Primitive;
 
+// A run of a primitive's triangles culled as one cluster
+typedef struct Meshlet {
+    uint32_t first_index; // Relative to the primitive
+    uint32_t index_count;
+    uint32_t vertex_count; // Distinct vertices of its triangles
+    vec3 center; // Local space bounding sphere
+    float radius;
+    // Normal cone, every triangle faces away from an eye where
+    // dot(center - eye, cone_axis) >= cone_cutoff * |center - eye| + radius
+    vec3 cone_axis;
+    float cone_cutoff;
+} Meshlet;
+
 typedef struct Mesh {
     Primitive* primitives;
     uint32_t primitives_count;
+    uint32_t first_primitive; // Scene wide index of primitives[0]
+    // Largest error of the primitives at each LOD, primitives with fewer
+    // LODs use their last
+    float lod_errors[MAX_LODS];
+    uint32_t lod_count;
+    vec3 min;
+    vec3 max;
 } Mesh;
 void destroy_mesh(Mesh* mesh);
 
@@ -21,14 +64,43 @@ typedef struct Node {
     Node* parent;
     Node** children;
     uint32_t children_count;
-    vec3 translation;
-    versor rotation;
-    vec3 scale;
     Mesh* mesh;
     uint32_t id;
+    uint32_t transform; // Index into the scene hierarchy
+    // Marked static in the glTF extras, a candidate for static batching
+    bool is_static;
 } Node;
 
-void node_make_matrix(Node* node, mat4 dest);
+#define HIERARCHY_ROOT UINT32_MAX
+#define TRANSFORM_LOCAL_DIRTY 1
+#define TRANSFORM_WORLD_DIRTY 2
+
+// Node transforms in separate arrays, sorted by depth so parents always come
+// before their children. Level d occupies
+// [level_offsets[d], level_offsets[d+1]).
+typedef struct Hierarchy {
+    vec3* translation;
+    versor* rotation;
+    vec3* scale;
+    mat4* local;
+    mat4* world;
+    uint32_t* parent;
+    uint32_t* node; // Index into scene.nodes
+    uint8_t* dirty;
+    // Set when the world matrix is recomputed, cleared by its consumer
+    uint8_t* changed;
+    // Mesh bounds in local and world space, empty (min > max) without a
+    // mesh. Subtree bounds also enclose all descendants.
+    vec3* local_min;
+    vec3* local_max;
+    vec3* world_min;
+    vec3* world_max;
+    vec3* subtree_min;
+    vec3* subtree_max;
+    uint32_t count;
+    uint32_t* level_offsets;
+    uint32_t level_count;
+} Hierarchy;
 
 typedef struct Light {
     vec3 pos;
@@ -47,6 +119,7 @@ typedef struct Vertex {
 typedef struct Scene {
     Mesh* meshes;
     size_t mesh_count;
+    size_t primitive_count;
     Node* nodes;
     size_t node_count;
     Light* lights;
@@ -56,8 +129,32 @@ typedef struct Scene {
     size_t vertex_count;
     uint16_t* indices;
     size_t index_count;
+    uint32_t* indices32;
+    size_t index32_count;
+    Meshlet* meshlets;
+    size_t meshlet_count;
+
+    Hierarchy hierarchy;
+    bool transforms_dirty;
+    bool transforms_changed;
+    // Draw from CompactVertex buffers instead of Vertex. Set before
+    // load_scene, which also sets it for scenes with "compact_vertices":
+    // true in their glTF extras.
+    bool compact_vertices;
 } Scene;
 
+// Index i of a primitive, whichever width it is stored in
+static inline uint32_t primitive_index(Scene* scene, Primitive* primitive,
+        uint32_t i)
+{
+    if (primitive->wide_indices)
+        return scene->indices32[primitive->index_offset + i];
+    return scene->indices[primitive->index_offset + i];
+}
+
+void scene_build_hierarchy(Scene* scene);
+void node_mark_dirty(Scene* scene, Node* node);
+void scene_update_transforms(Scene* scene);
 void destroy_scene(Scene* scene);
 
 extern Scene scene;
@@ -1,12 +1,17 @@
 #version 450
 #extension GL_ARB_separate_shader_objects : enable
 
-layout(set = 1, binding = 0) uniform sampler2D tex_sampler;
+// Same texture set as mrt.frag, TEXTURE_INDEX is CURSOR_TEXTURE_INDEX when
+// bindless
+layout(constant_id = 0) const uint TEXTURE_COUNT = 1;
+layout(constant_id = 1) const uint TEXTURE_INDEX = 0;
+
+layout(set = 1, binding = 0) uniform sampler2D textures[TEXTURE_COUNT];
 
 layout(location = 0) in vec2 uv;
 
 layout(location = 0) out vec4 out_color;
 
 void main() {
-    out_color = texture(tex_sampler, uv);
+    out_color = texture(textures[TEXTURE_INDEX], uv);
 }
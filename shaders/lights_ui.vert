@@ -5,7 +5,7 @@ layout(location = 1) in vec3 color;
 layout(location = 2) in uint code;
 
 layout(location = 0) out vec3 out_color;
-layout(location = 1) out uint out_code;
+layout(location = 3) out uint out_code;
 
 layout(binding=0) uniform Uniform {
     mat4 view_proj;
@@ -9,25 +9,65 @@ layout(location = 1) out vec4 out_world_pos;
 layout(location = 2) out vec3 out_normal;
 layout(location = 3) out uint out_node_id;
 
+// Positions are unorm within the mesh bounds, normals octahedral snorm and
+// tex coords half floats
+layout(constant_id = 0) const bool COMPACT_VERTICES = false;
+
 layout(binding=0) uniform Uniform {
     mat4 view_proj;
 } uni;
 
-layout(push_constant) uniform PushConsts {
+struct Transform {
     mat4 model;
+    mat3 normal;
     uint node_id;
-} push_consts;
+    uint flags;
+    uint quantization;
+    uint lod;
+};
+
+layout(std430, binding=3) readonly buffer Transforms {
+    Transform transforms[];
+};
+
+// Transform index of every instance, draws start at their first instance
+layout(std430, binding=4) readonly buffer Instances {
+    uint instances[];
+};
+
+struct Quantization {
+    vec4 scale;
+    vec4 offset;
+};
+
+layout(std430, binding=5) readonly buffer Quantizations {
+    Quantization quantizations[];
+};
 
 out gl_PerVertex {
     vec4 gl_Position;
 };
 
+vec3 oct_decode(vec2 e) {
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0);
+    n.x += n.x >= 0.0 ? -t : t;
+    n.y += n.y >= 0.0 ? -t : t;
+    return normalize(n);
+}
+
 void main() {
-    out_world_pos = push_consts.model * vec4(position, 1.0);
+    Transform transform = transforms[instances[gl_InstanceIndex]];
+    vec3 local_pos = position;
+    vec3 local_normal = normal;
+    if (COMPACT_VERTICES) {
+        Quantization q = quantizations[transform.quantization];
+        local_pos = position * q.scale.xyz + q.offset.xyz;
+        local_normal = oct_decode(normal.xy);
+    }
+    out_world_pos = transform.model * vec4(local_pos, 1.0);
     gl_Position = uni.view_proj * out_world_pos;
     out_tex_coord = tex_coord;
-
-    mat3 mnorm = transpose(inverse(mat3(push_consts.model)));
-    out_normal = mnorm * normal;
-    out_node_id = push_consts.node_id;
+    out_normal = transform.normal * local_normal;
+    out_node_id = transform.node_id;
 }
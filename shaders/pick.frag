@@ -0,0 +1,10 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+layout(location = 3) flat in uint code;
+
+layout(location = 0) out uint out_code;
+
+void main() {
+    out_code = code;
+}
@@ -0,0 +1,38 @@
+#include <string.h>
+#include "sort.h"
+
+void radix_sort_u64(uint64_t* keys, uint64_t* scratch, uint32_t count)
+{
+    // All eight histograms in one read of the keys
+    uint32_t histograms[8][256];
+    memset(histograms, 0, sizeof(histograms));
+    for (uint32_t i=0; i < count; i++) {
+        uint64_t key = keys[i];
+        for (int d=0; d < 8; d++) {
+            histograms[d][(key >> (d * 8)) & 0xff]++;
+        }
+    }
+
+    uint64_t* src = keys;
+    uint64_t* dst = scratch;
+    for (int d=0; d < 8; d++) {
+        uint32_t* histogram = histograms[d];
+        if (count == 0 || histogram[(src[0] >> (d * 8)) & 0xff] == count)
+            continue;
+
+        uint32_t offset = 0;
+        for (int b=0; b < 256; b++) {
+            uint32_t bucket_count = histogram[b];
+            histogram[b] = offset;
+            offset += bucket_count;
+        }
+        for (uint32_t i=0; i < count; i++) {
+            uint64_t key = src[i];
+            dst[histogram[(key >> (d * 8)) & 0xff]++] = key;
+        }
+        uint64_t* swap = src;
+        src = dst;
+        dst = swap;
+    }
+    if (src != keys) memcpy(keys, src, sizeof(uint64_t) * count);
+}
@@ -0,0 +1,11 @@
+#ifndef SORT_H
+#define SORT_H
+
+#include <stdint.h>
+
+// Sorts keys ascending, 8 bits per pass. Passes where every key has the
+// same digit are skipped. scratch must hold count keys, the result ends up
+// in keys.
+void radix_sort_u64(uint64_t* keys, uint64_t* scratch, uint32_t count);
+
+#endif
@@ -0,0 +1,390 @@
+#include "transform.h"
+#include "utils.h"
+
+#if defined(__SSE__)
+#include <immintrin.h>
+#endif
+
+// Column-major T * R * S for one node
+static void compose_one(vec3 t, versor q, vec3 s, mat4 dest)
+{
+    float x2 = q[0] * 2.0f;
+    float y2 = q[1] * 2.0f;
+    float z2 = q[2] * 2.0f;
+    float xx = q[0] * x2;
+    float yy = q[1] * y2;
+    float zz = q[2] * z2;
+    float xy = q[0] * y2;
+    float xz = q[0] * z2;
+    float yz = q[1] * z2;
+    float wx = q[3] * x2;
+    float wy = q[3] * y2;
+    float wz = q[3] * z2;
+
+    dest[0][0] = (1.0f - (yy + zz)) * s[0];
+    dest[0][1] = (xy + wz) * s[0];
+    dest[0][2] = (xz - wy) * s[0];
+    dest[0][3] = 0.0f;
+    dest[1][0] = (xy - wz) * s[1];
+    dest[1][1] = (1.0f - (xx + zz)) * s[1];
+    dest[1][2] = (yz + wx) * s[1];
+    dest[1][3] = 0.0f;
+    dest[2][0] = (xz + wy) * s[2];
+    dest[2][1] = (yz - wx) * s[2];
+    dest[2][2] = (1.0f - (xx + yy)) * s[2];
+    dest[2][3] = 0.0f;
+    dest[3][0] = t[0];
+    dest[3][1] = t[1];
+    dest[3][2] = t[2];
+    dest[3][3] = 1.0f;
+}
+
+#if defined(__SSE__)
+// Splits 4 packed vec3s into one register per component
+static inline void load_vec3x4(vec3* v, __m128* x, __m128* y, __m128* z)
+{
+    __m128 a = _mm_loadu_ps(&v[0][0]); // x0 y0 z0 x1
+    __m128 b = _mm_loadu_ps(&v[1][1]); // y1 z1 x2 y2
+    __m128 c = _mm_loadu_ps(&v[2][2]); // z2 x3 y3 z3
+    __m128 u = _mm_shuffle_ps(b, c, _MM_SHUFFLE(1, 1, 2, 2));
+    *x = _mm_shuffle_ps(a, u, _MM_SHUFFLE(2, 0, 3, 0));
+    u = _mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 1, 1));
+    __m128 w = _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 2, 3, 3));
+    *y = _mm_shuffle_ps(u, w, _MM_SHUFFLE(2, 0, 2, 0));
+    u = _mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 1, 2, 2));
+    w = _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 0, 0));
+    *z = _mm_shuffle_ps(u, w, _MM_SHUFFLE(2, 0, 2, 0));
+}
+
+static inline void load_versorx4(versor* q,
+        __m128* x, __m128* y, __m128* z, __m128* w)
+{
+    *x = _mm_loadu_ps(q[0]);
+    *y = _mm_loadu_ps(q[1]);
+    *z = _mm_loadu_ps(q[2]);
+    *w = _mm_loadu_ps(q[3]);
+    _MM_TRANSPOSE4_PS(*x, *y, *z, *w);
+}
+
+// a, b, c, d hold rows 0-3 of column col for 4 matrices
+static inline void store_columnx4(mat4* dest, int col,
+        __m128 a, __m128 b, __m128 c, __m128 d)
+{
+    _MM_TRANSPOSE4_PS(a, b, c, d);
+    _mm_storeu_ps(dest[0][col], a);
+    _mm_storeu_ps(dest[1][col], b);
+    _mm_storeu_ps(dest[2][col], c);
+    _mm_storeu_ps(dest[3][col], d);
+}
+
+static void compose_x4(vec3* t, versor* r, vec3* s, mat4* dest)
+{
+    __m128 tx, ty, tz, sx, sy, sz, qx, qy, qz, qw;
+    load_vec3x4(t, &tx, &ty, &tz);
+    load_vec3x4(s, &sx, &sy, &sz);
+    load_versorx4(r, &qx, &qy, &qz, &qw);
+
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 zero = _mm_setzero_ps();
+    __m128 x2 = _mm_add_ps(qx, qx);
+    __m128 y2 = _mm_add_ps(qy, qy);
+    __m128 z2 = _mm_add_ps(qz, qz);
+    __m128 xx = _mm_mul_ps(qx, x2);
+    __m128 yy = _mm_mul_ps(qy, y2);
+    __m128 zz = _mm_mul_ps(qz, z2);
+    __m128 xy = _mm_mul_ps(qx, y2);
+    __m128 xz = _mm_mul_ps(qx, z2);
+    __m128 yz = _mm_mul_ps(qy, z2);
+    __m128 wx = _mm_mul_ps(qw, x2);
+    __m128 wy = _mm_mul_ps(qw, y2);
+    __m128 wz = _mm_mul_ps(qw, z2);
+
+    store_columnx4(dest, 0,
+            _mm_mul_ps(_mm_sub_ps(one, _mm_add_ps(yy, zz)), sx),
+            _mm_mul_ps(_mm_add_ps(xy, wz), sx),
+            _mm_mul_ps(_mm_sub_ps(xz, wy), sx),
+            zero);
+    store_columnx4(dest, 1,
+            _mm_mul_ps(_mm_sub_ps(xy, wz), sy),
+            _mm_mul_ps(_mm_sub_ps(one, _mm_add_ps(xx, zz)), sy),
+            _mm_mul_ps(_mm_add_ps(yz, wx), sy),
+            zero);
+    store_columnx4(dest, 2,
+            _mm_mul_ps(_mm_add_ps(xz, wy), sz),
+            _mm_mul_ps(_mm_sub_ps(yz, wx), sz),
+            _mm_mul_ps(_mm_sub_ps(one, _mm_add_ps(xx, yy)), sz),
+            zero);
+    store_columnx4(dest, 3, tx, ty, tz, one);
+}
+
+static inline void multiply_one(mat4 a, mat4 b, mat4 dest)
+{
+    __m128 a0 = _mm_loadu_ps(a[0]);
+    __m128 a1 = _mm_loadu_ps(a[1]);
+    __m128 a2 = _mm_loadu_ps(a[2]);
+    __m128 a3 = _mm_loadu_ps(a[3]);
+    for (int c=0; c < 4; c++) {
+        __m128 col = _mm_loadu_ps(b[c]);
+        __m128 r = _mm_mul_ps(a0,
+                _mm_shuffle_ps(col, col, _MM_SHUFFLE(0, 0, 0, 0)));
+        r = _mm_add_ps(r, _mm_mul_ps(a1,
+                _mm_shuffle_ps(col, col, _MM_SHUFFLE(1, 1, 1, 1))));
+        r = _mm_add_ps(r, _mm_mul_ps(a2,
+                _mm_shuffle_ps(col, col, _MM_SHUFFLE(2, 2, 2, 2))));
+        r = _mm_add_ps(r, _mm_mul_ps(a3,
+                _mm_shuffle_ps(col, col, _MM_SHUFFLE(3, 3, 3, 3))));
+        _mm_storeu_ps(dest[c], r);
+    }
+}
+#else
+static inline void multiply_one(mat4 a, mat4 b, mat4 dest)
+{
+    glm_mat4_mul(a, b, dest);
+}
+#endif
+
+#if defined(__AVX__)
+static inline __m256 combine(__m128 lo, __m128 hi)
+{
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+}
+
+static inline void load_vec3x8(vec3* v, __m256* x, __m256* y, __m256* z)
+{
+    __m128 x0, y0, z0, x1, y1, z1;
+    load_vec3x4(v, &x0, &y0, &z0);
+    load_vec3x4(v + 4, &x1, &y1, &z1);
+    *x = combine(x0, x1);
+    *y = combine(y0, y1);
+    *z = combine(z0, z1);
+}
+
+static inline void load_versorx8(versor* q,
+        __m256* x, __m256* y, __m256* z, __m256* w)
+{
+    __m128 x0, y0, z0, w0, x1, y1, z1, w1;
+    load_versorx4(q, &x0, &y0, &z0, &w0);
+    load_versorx4(q + 4, &x1, &y1, &z1, &w1);
+    *x = combine(x0, x1);
+    *y = combine(y0, y1);
+    *z = combine(z0, z1);
+    *w = combine(w0, w1);
+}
+
+// 4x4 transposes within each 128-bit half, then one store per matrix
+static inline void store_columnx8(mat4* dest, int col,
+        __m256 a, __m256 b, __m256 c, __m256 d)
+{
+    __m256 t0 = _mm256_unpacklo_ps(a, b);
+    __m256 t1 = _mm256_unpackhi_ps(a, b);
+    __m256 t2 = _mm256_unpacklo_ps(c, d);
+    __m256 t3 = _mm256_unpackhi_ps(c, d);
+    __m256 n0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 n1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 n2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 n3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    _mm_storeu_ps(dest[0][col], _mm256_castps256_ps128(n0));
+    _mm_storeu_ps(dest[1][col], _mm256_castps256_ps128(n1));
+    _mm_storeu_ps(dest[2][col], _mm256_castps256_ps128(n2));
+    _mm_storeu_ps(dest[3][col], _mm256_castps256_ps128(n3));
+    _mm_storeu_ps(dest[4][col], _mm256_extractf128_ps(n0, 1));
+    _mm_storeu_ps(dest[5][col], _mm256_extractf128_ps(n1, 1));
+    _mm_storeu_ps(dest[6][col], _mm256_extractf128_ps(n2, 1));
+    _mm_storeu_ps(dest[7][col], _mm256_extractf128_ps(n3, 1));
+}
+
+static void compose_x8(vec3* t, versor* r, vec3* s, mat4* dest)
+{
+    __m256 tx, ty, tz, sx, sy, sz, qx, qy, qz, qw;
+    load_vec3x8(t, &tx, &ty, &tz);
+    load_vec3x8(s, &sx, &sy, &sz);
+    load_versorx8(r, &qx, &qy, &qz, &qw);
+
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 zero = _mm256_setzero_ps();
+    __m256 x2 = _mm256_add_ps(qx, qx);
+    __m256 y2 = _mm256_add_ps(qy, qy);
+    __m256 z2 = _mm256_add_ps(qz, qz);
+    __m256 xx = _mm256_mul_ps(qx, x2);
+    __m256 yy = _mm256_mul_ps(qy, y2);
+    __m256 zz = _mm256_mul_ps(qz, z2);
+    __m256 xy = _mm256_mul_ps(qx, y2);
+    __m256 xz = _mm256_mul_ps(qx, z2);
+    __m256 yz = _mm256_mul_ps(qy, z2);
+    __m256 wx = _mm256_mul_ps(qw, x2);
+    __m256 wy = _mm256_mul_ps(qw, y2);
+    __m256 wz = _mm256_mul_ps(qw, z2);
+
+    store_columnx8(dest, 0,
+            _mm256_mul_ps(_mm256_sub_ps(one, _mm256_add_ps(yy, zz)), sx),
+            _mm256_mul_ps(_mm256_add_ps(xy, wz), sx),
+            _mm256_mul_ps(_mm256_sub_ps(xz, wy), sx),
+            zero);
+    store_columnx8(dest, 1,
+            _mm256_mul_ps(_mm256_sub_ps(xy, wz), sy),
+            _mm256_mul_ps(_mm256_sub_ps(one, _mm256_add_ps(xx, zz)), sy),
+            _mm256_mul_ps(_mm256_add_ps(yz, wx), sy),
+            zero);
+    store_columnx8(dest, 2,
+            _mm256_mul_ps(_mm256_add_ps(xz, wy), sz),
+            _mm256_mul_ps(_mm256_sub_ps(yz, wx), sz),
+            _mm256_mul_ps(_mm256_sub_ps(one, _mm256_add_ps(xx, yy)), sz),
+            zero);
+    store_columnx8(dest, 3, tx, ty, tz, one);
+}
+
+// Two result columns per step
+static inline void multiply_one_avx(mat4 a, mat4 b, mat4 dest)
+{
+    __m256 a0 = _mm256_broadcast_ps((const __m128*) a[0]);
+    __m256 a1 = _mm256_broadcast_ps((const __m128*) a[1]);
+    __m256 a2 = _mm256_broadcast_ps((const __m128*) a[2]);
+    __m256 a3 = _mm256_broadcast_ps((const __m128*) a[3]);
+    for (int c=0; c < 4; c += 2) {
+        __m256 cols = _mm256_loadu_ps(b[c]);
+        __m256 r = _mm256_mul_ps(a0, _mm256_shuffle_ps(cols, cols, 0x00));
+        r = _mm256_add_ps(r,
+                _mm256_mul_ps(a1, _mm256_shuffle_ps(cols, cols, 0x55)));
+        r = _mm256_add_ps(r,
+                _mm256_mul_ps(a2, _mm256_shuffle_ps(cols, cols, 0xaa)));
+        r = _mm256_add_ps(r,
+                _mm256_mul_ps(a3, _mm256_shuffle_ps(cols, cols, 0xff)));
+        _mm256_storeu_ps(dest[c], r);
+    }
+}
+#endif
+
+void transform_compose(vec3* translation, versor* rotation, vec3* scale,
+        mat4* dest, uint32_t count)
+{
+    uint32_t i = 0;
+#if defined(__AVX__)
+    for (; i + 8 <= count; i += 8) {
+        compose_x8(&translation[i], &rotation[i], &scale[i], &dest[i]);
+    }
+#endif
+#if defined(__SSE__)
+    for (; i + 4 <= count; i += 4) {
+        compose_x4(&translation[i], &rotation[i], &scale[i], &dest[i]);
+    }
+#endif
+    for (; i < count; i++) {
+        compose_one(translation[i], rotation[i], scale[i], dest[i]);
+    }
+}
+
+void transform_multiply(mat4* world, uint32_t* parent, mat4* local,
+        uint32_t first, uint32_t count)
+{
+    uint32_t end = first + count;
+    for (uint32_t i=first; i < end; i++) {
+#if defined(__AVX__)
+        multiply_one_avx(world[parent[i]], local[i], world[i]);
+#else
+        multiply_one(world[parent[i]], local[i], world[i]);
+#endif
+    }
+}
+
+#ifndef RELEASE
+#include "alloc.h"
+
+#define BENCH_NODES 100000
+#define BENCH_RUNS 10
+
+static float random_float(float min, float max)
+{
+    return min + (max - min) * (rand() / (float) RAND_MAX);
+}
+
+// Best of BENCH_RUNS for the cglm path and the batched kernels
+void transform_benchmark()
+{
+    vec3* translation = malloc_nofail(sizeof(vec3) * BENCH_NODES);
+    versor* rotation = malloc_nofail(sizeof(versor) * BENCH_NODES);
+    vec3* scale = malloc_nofail(sizeof(vec3) * BENCH_NODES);
+    mat4* local = malloc_nofail(sizeof(mat4) * BENCH_NODES);
+    mat4* world = malloc_nofail(sizeof(mat4) * BENCH_NODES);
+    uint32_t* parent = malloc_nofail(sizeof(uint32_t) * BENCH_NODES);
+
+    srand(1);
+    for (uint32_t i=0; i < BENCH_NODES; i++) {
+        for (int c=0; c < 3; c++) {
+            translation[i][c] = random_float(-10.0f, 10.0f);
+            scale[i][c] = random_float(0.5f, 2.0f);
+        }
+        vec3 axis = {random_float(-1.0f, 1.0f), random_float(-1.0f, 1.0f),
+            random_float(-1.0f, 1.0f)};
+        glm_vec3_normalize(axis);
+        glm_quatv(rotation[i], random_float(0.0f, GLM_PI), axis);
+        // 8-ary tree in breadth first order
+        parent[i] = i ? (i - 1) / 8 : 0;
+    }
+
+    double cglm_compose = 1e9;
+    double batch_compose = 1e9;
+    for (int run=0; run < BENCH_RUNS; run++) {
+        double start = now_seconds();
+        for (uint32_t i=0; i < BENCH_NODES; i++) {
+            glm_mat4_identity(world[i]);
+            glm_translate(world[i], translation[i]);
+            glm_quat_rotate(world[i], rotation[i], world[i]);
+            glm_scale(world[i], scale[i]);
+        }
+        cglm_compose = MIN(cglm_compose, now_seconds() - start);
+
+        start = now_seconds();
+        transform_compose(translation, rotation, scale, local, BENCH_NODES);
+        batch_compose = MIN(batch_compose, now_seconds() - start);
+    }
+    float max_error = 0.0f;
+    for (uint32_t i=0; i < BENCH_NODES; i++) {
+        for (int e=0; e < 16; e++) {
+            float error = fabsf(world[i][e / 4][e % 4] - local[i][e / 4][e % 4]);
+            max_error = MAX(max_error, error);
+        }
+    }
+
+    double cglm_multiply = 1e9;
+    double batch_multiply = 1e9;
+    float cglm_sum = 0.0f;
+    float batch_sum = 0.0f;
+    for (int run=0; run < BENCH_RUNS; run++) {
+        glm_mat4_copy(local[0], world[0]);
+        double start = now_seconds();
+        for (uint32_t i=1; i < BENCH_NODES; i++) {
+            glm_mat4_mul(world[parent[i]], local[i], world[i]);
+        }
+        cglm_multiply = MIN(cglm_multiply, now_seconds() - start);
+        cglm_sum = 0.0f;
+        for (uint32_t i=0; i < BENCH_NODES; i++) cglm_sum += world[i][3][0];
+
+        start = now_seconds();
+        uint32_t level_start = 1;
+        uint32_t level_width = 8;
+        while (level_start < BENCH_NODES) {
+            uint32_t count = MIN(level_width, BENCH_NODES - level_start);
+            transform_multiply(world, parent, local, level_start, count);
+            level_start += count;
+            level_width *= 8;
+        }
+        batch_multiply = MIN(batch_multiply, now_seconds() - start);
+        batch_sum = 0.0f;
+        for (uint32_t i=0; i < BENCH_NODES; i++) batch_sum += world[i][3][0];
+    }
+
+    printf("Transform benchmark, %d nodes\n", BENCH_NODES);
+    printf("compose:  cglm %.3f ms, batched %.3f ms, max error %g\n",
+            cglm_compose * 1000.0, batch_compose * 1000.0, max_error);
+    printf("multiply: cglm %.3f ms, batched %.3f ms, checksum %g/%g\n",
+            cglm_multiply * 1000.0, batch_multiply * 1000.0,
+            cglm_sum, batch_sum);
+
+    mem_free(translation);
+    mem_free(rotation);
+    mem_free(scale);
+    mem_free(local);
+    mem_free(world);
+    mem_free(parent);
+}
+#endif
@@ -0,0 +1,21 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include <cglm/cglm.h>
+#include <stdint.h>
+
+// Batched kernels for the scene hierarchy.
+// Composes 8 (AVX) or 4 (SSE) nodes per step, the rotation must be a unit
+// quaternion.
+void transform_compose(vec3* translation, versor* rotation, vec3* scale,
+        mat4* dest, uint32_t count);
+// world[i] = world[parent[i]] * local[i] for i in [first, first + count),
+// one SIMD 4x4 multiply per node. Parents must be outside the range.
+void transform_multiply(mat4* world, uint32_t* parent, mat4* local,
+        uint32_t first, uint32_t count);
+
+#ifndef RELEASE
+void transform_benchmark();
+#endif
+
+#endif
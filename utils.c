@@ -2,6 +2,7 @@
 #include "alloc.h"
 
 #include <stdio.h>
+#include <time.h>
 
 void errprint(const char* const err) {
     fprintf(stderr, "%s", err);
@@ -36,4 +37,12 @@ int read_binary_file(const char *filename, char* *const o_dest, size_t *o_size)
     fclose(file);
 
     return 0;
+}
+
+// Monotonic, usable before the window is created
+double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
 }   
@@ -8,6 +8,7 @@ void errprint(const char* const err);
 void fatal(const char* const err);
 void* malloc_nofail(size_t bytes);
 int read_binary_file(const char *filename, char* *const o_dest, size_t *o_size);
+double now_seconds();
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
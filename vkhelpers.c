@@ -36,7 +36,7 @@ int find_memory_type(
     return memory_type_index;
 }
 
-void create_2d_image(uint32_t width, uint32_t height,
+void create_2d_image(uint32_t width, uint32_t height, uint32_t mip_levels,
         VkSampleCountFlagBits samples, VkFormat format, VkImageTiling tiling,
         VkImageUsageFlags usage, VkMemoryPropertyFlags properties,
         VkImage* image, VkDeviceMemory* memory)
@@ -47,7 +47,7 @@ void create_2d_image(uint32_t width, uint32_t height,
         .extent.width = width,
         .extent.height = height,
         .extent.depth = 1,
-        .mipLevels = 1,
+        .mipLevels = mip_levels,
         .arrayLayers = 1,
         .format = format,
         .tiling = tiling,
@@ -85,7 +85,8 @@ void create_2d_image(uint32_t width, uint32_t height,
 }
 
 void create_2d_image_view(VkImage image, VkFormat format,
-        VkImageAspectFlags aspect_flags, VkImageView* image_view)
+        VkImageAspectFlags aspect_flags, uint32_t mip_levels,
+        VkImageView* image_view)
 {
     VkImageViewCreateInfo create_info = {
         .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
@@ -98,7 +99,7 @@ void create_2d_image_view(VkImage image, VkFormat format,
         .components.a = VK_COMPONENT_SWIZZLE_IDENTITY,
         .subresourceRange.aspectMask = aspect_flags,
         .subresourceRange.baseMipLevel = 0,
-        .subresourceRange.levelCount = 1,
+        .subresourceRange.levelCount = mip_levels,
         .subresourceRange.baseArrayLayer = 0,
         .subresourceRange.layerCount = 1,
     };
@@ -107,6 +108,80 @@ void create_2d_image_view(VkImage image, VkFormat format,
     }
 }
 
+uint32_t mip_level_count(uint32_t width, uint32_t height)
+{
+    uint32_t levels = 1;
+    for (uint32_t size = MAX(width, height); size > 1; size >>= 1) levels++;
+    return levels;
+}
+
+void record_mip_chain(VkCommandBuffer cmdbuf, VkImage image,
+        uint32_t width, uint32_t height, uint32_t mip_levels)
+{
+    VkImageMemoryBarrier barrier = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = image,
+        .subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .subresourceRange.levelCount = 1,
+        .subresourceRange.baseArrayLayer = 0,
+        .subresourceRange.layerCount = 1,
+    };
+    int32_t level_width = width;
+    int32_t level_height = height;
+    for (uint32_t level=1; level < mip_levels; level++) {
+        // The level above becomes the blit source
+        barrier.subresourceRange.baseMipLevel = level - 1;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1,
+                &barrier);
+
+        int32_t next_width = MAX(level_width / 2, 1);
+        int32_t next_height = MAX(level_height / 2, 1);
+        VkImageBlit blit = {
+            .srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+            .srcSubresource.mipLevel = level - 1,
+            .srcSubresource.baseArrayLayer = 0,
+            .srcSubresource.layerCount = 1,
+            .srcOffsets = {{0, 0, 0}, {level_width, level_height, 1}},
+            .dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+            .dstSubresource.mipLevel = level,
+            .dstSubresource.baseArrayLayer = 0,
+            .dstSubresource.layerCount = 1,
+            .dstOffsets = {{0, 0, 0}, {next_width, next_height, 1}},
+        };
+        vkCmdBlitImage(cmdbuf,
+                image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                1, &blit, VK_FILTER_LINEAR);
+
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, NULL, 0, NULL, 1,
+                &barrier);
+        level_width = next_width;
+        level_height = next_height;
+    }
+
+    // The last level was only written
+    barrier.subresourceRange.baseMipLevel = mip_levels - 1;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, NULL, 0, NULL, 1,
+            &barrier);
+}
+
 VkFormat find_depth_format() {
     enum {candidate_count = 3};
     const VkFormat const candidates[candidate_count] = {
@@ -283,6 +358,27 @@ void upload_to_device_local_buffer(
     destroy_buffer(&staging_buffer);
 }
 
+void upload_to_device_local_buffer_at(
+        void* data,
+        size_t size,
+        Buffer* destination,
+        VkDeviceSize offset,
+        VkQueue queue,
+        VkCommandPool command_pool)
+{
+    Buffer staging_buffer = upload_data_to_staging_buffer(data, size);
+    VkCommandBuffer command_buffer = begin_one_time_command_buffer(command_pool);
+    VkBufferCopy copy_region = {
+        .srcOffset = 0,
+        .dstOffset = offset,
+        .size = size,
+    };
+    vkCmdCopyBuffer(command_buffer, staging_buffer.buffer,
+            destination->buffer, 1, &copy_region);
+    submit_one_time_command_buffer(queue, command_buffer, command_pool);
+    destroy_buffer(&staging_buffer);
+}
+
 void device_local_buffer_from_data(
         void* data,
         size_t size,
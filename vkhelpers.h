@@ -15,20 +15,31 @@ typedef struct Texture {
     VkDeviceMemory memory;
     VkImageView view;
     VkDescriptorSet desc_set;
+    // Element in desc_set when that is the bindless texture array, else 0
+    uint32_t descriptor_index;
     int width;
     int height;
+    uint32_t mip_levels;
 } Texture;
 void destroy_texture(Texture* texture);
 
 int find_memory_type(
         VkMemoryRequirements memory_requirements,
         VkMemoryPropertyFlags required_properties);
-void create_2d_image(uint32_t width, uint32_t height,
+void create_2d_image(uint32_t width, uint32_t height, uint32_t mip_levels,
         VkSampleCountFlagBits samples, VkFormat format, VkImageTiling tiling,
         VkImageUsageFlags usage, VkMemoryPropertyFlags properties,
         VkImage* image, VkDeviceMemory* memory);
 void create_2d_image_view(VkImage image, VkFormat format,
-        VkImageAspectFlags aspect_flags, VkImageView* image_view);
+        VkImageAspectFlags aspect_flags, uint32_t mip_levels,
+        VkImageView* image_view);
+// Levels of a full mip chain down to 1x1
+uint32_t mip_level_count(uint32_t width, uint32_t height);
+// Fills levels 1 and up of a color image by linear blits, each from the one
+// above. Expects every level in TRANSFER_DST_OPTIMAL with level 0 written,
+// leaves them in SHADER_READ_ONLY_OPTIMAL for fragment shaders.
+void record_mip_chain(VkCommandBuffer cmdbuf, VkImage image,
+        uint32_t width, uint32_t height, uint32_t mip_levels);
 VkFormat find_depth_format();
 VkShaderModule create_shader_module(const char* path);
 VkCommandBuffer begin_one_time_command_buffer(VkCommandPool command_pool);
@@ -49,6 +60,13 @@ void upload_to_device_local_buffer(
         Buffer* destination,
         VkQueue queue,
         VkCommandPool command_pool);
+void upload_to_device_local_buffer_at(
+        void* data,
+        size_t size,
+        Buffer* destination,
+        VkDeviceSize offset,
+        VkQueue queue,
+        VkCommandPool command_pool);
 void device_local_buffer_from_data(
         void* data,
         size_t size,